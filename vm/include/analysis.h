@@ -0,0 +1,36 @@
+// Used to keep what the VM has worked out about an image on disk, so that
+// the next run of the same image can start from it.
+#ifndef ANALYSIS_H
+#define ANALYSIS_H
+
+#include <stdint.h>
+
+#include "architecture.h"
+#include "idiom.h"
+
+#define ANALYSIS_MAGIC 0x41334c43   // "LC3A"
+#define ANALYSIS_VERSION 3
+
+// The cache files are named by the hash of the image with this extension.
+#define ANALYSIS_EXTENSION ".lc3a"
+
+/*
+ * The layout of a cache file, which is mapped straight into memory. The
+ * header is written when the file is created and never changes after that.
+ */
+struct Analysis
+{
+  uint32_t magic;
+  uint32_t version;
+  // A hash of the whole of memory as the images left it.
+  uint64_t imageHash;
+  // How many runs have started from this file.
+  uint64_t runs;
+  // A bit for every address (bit `address % 64` of word `address / 64`),
+  // set once the guest has reached a loop head there in any run.
+  uint64_t reachedHeads[MEMORY_MAX / 64];
+};
+
+int loadAnalysis(struct Guest* guest, const char* directory);
+
+#endif
@@ -3,15 +3,20 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <signal.h>
 #include <stdint.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/termios.h>
 #include <sys/mman.h>
 
+#include "clock.h"
+#include "idiom.h"
+
 
 // The default starting position for the program counter (PC)
 #define PC_START 0x3000
@@ -19,7 +24,6 @@
 // 16-bit machine, each memory location stores a 16-bit value
 // 2^16 = 65536 memory locations
 #define MEMORY_MAX (1 << 16)
-uint16_t mem[MEMORY_MAX];
 
 // Our LC-3 architecture will have 10 registers:
 // - 8 general purpose registers (R_0 - R_7)
@@ -39,7 +43,6 @@ enum Register
   R_COND,
   R_MAX
 };
-uint16_t regs[R_MAX];
 
 // The R_COND register stores condition flags providing info about
 // the most recently executed calculation.
@@ -92,21 +95,111 @@ enum TrapCode
 enum MemRegisters
 {
   MR_KBSR = 0xFE00,   // Keyboard status register
-  MR_KBDR = 0xFE02    // Keyboard data register
+  MR_KBDR = 0xFE02,   // Keyboard data register
+  MR_CLOCK = 0xFE08,  // Milliseconds since the guest started (see clock.c)
+  MR_TIMER = 0xFE0A   // One-shot timer
+};
+
+extern struct termios originalTio;
+
+// The kinds of memory access that can be observed.
+enum MemAccess
+{
+  ACCESS_FETCH = 0,   // fetching an instruction
+  ACCESS_READ,        // a load
+  ACCESS_WRITE        // a store
+};
+
+/*
+ * The keyboard and display of a guest. Guests normally use the terminal, but
+ * a guest can be given a console that e.g. feeds it input from a buffer and
+ * collects what it prints instead.
+ *
+ * A console sets `stopped` when the guest can't usefully carry on, such as
+ * when it waits for more input than there is.
+ */
+struct Console
+{
+  int (*getChar)(struct Console* console);   // the next key, or EOF
+  int (*keyReady)(struct Console* console);
+  void (*putChar)(struct Console* console, char c);
+  void (*flush)(struct Console* console);
+  int stopped;
+};
+
+// Why a guest with its own console was stopped.
+enum ConsoleStop
+{
+  STOP_NONE = 0,
+  STOP_INPUT,             // it wanted input after all of it had been read
+  STOP_OUTPUT,            // nobody is reading what it prints any more
+  STOP_INVALID_OPCODE     // it executed RTI or the reserved opcode
+};
+
+// Called before the guest waits for a key, e.g. so that the live metrics are
+// up to date while it waits.
+extern void (*beforeInputWait)();
+
+// What a guest has done with its traps and console, for whoever wants to
+// report it (e.g. the live metrics).
+struct GuestStats
+{
+  uint64_t traps[256];      // by trap vector
+  uint64_t kbsrPolls;       // reads of the keyboard status register
+  uint64_t outputBytes;
+  uint64_t inputWaitNs;     // time spent waiting for a key
 };
 
-struct termios originalTio;
+/*
+ * Everything that belongs to a single guest. The VM normally runs just the
+ * one, `mainGuest`, but engines that run several side by side (e.g. the job
+ * server) give each of their threads a guest of its own, so every part of
+ * the VM that executes guest code is handed the guest to work on.
+ */
+struct Guest
+{
+  // Page aligned, so that its pages can be write protected on their own
+  // (see codewatch.c).
+  uint16_t mem[MEMORY_MAX] __attribute__((aligned(4096)));
+  uint16_t regs[R_MAX];
+  // The guest's console, NULL for the terminal.
+  struct Console* console;
+  struct GuestStats stats;
+  struct GuestClock clock;
+  struct GuestIdioms idioms;
+};
+
+extern struct Guest mainGuest;
+
+// Set while something (e.g. the cache simulator) wants to see every memory
+// access the guest makes. When it is clear memory accesses cost nothing
+// extra.
+extern int memObserved;
+
+struct Guest* newGuest();
 
-void updateConditionFlags(uint16_t registerIdx);
+void updateConditionFlags(struct Guest* guest, uint16_t registerIdx);
 
 void disableInputBuffering();
 
 void restoreInputBuffering();
 
-uint16_t checkKey();
+uint16_t checkKey(struct Guest* guest);
+
+int consoleGetChar(struct Guest* guest);
+
+void consolePutChar(struct Guest* guest, char c);
+
+void consoleWrite(struct Guest* guest, const char* text);
+
+void consoleFlush(struct Guest* guest);
+
+void memWrite(struct Guest* guest, uint16_t address, uint16_t addressVal);
+
+uint16_t memRead(struct Guest* guest, uint16_t address);
 
-void memWrite(uint16_t address, uint16_t addressVal);
+uint16_t memFetch(struct Guest* guest, uint16_t address);
 
-uint16_t memRead(uint16_t address);
+uint16_t memFetchUnobserved(struct Guest* guest, uint16_t address);
 
 #endif
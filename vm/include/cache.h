@@ -0,0 +1,42 @@
+// Used to simulate a cache hierarchy driven by the guest's memory accesses.
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdint.h>
+
+enum ReplacementPolicy
+{
+  POLICY_LRU = 0,   // evict the least recently used line
+  POLICY_FIFO,      // evict the line that was filled first
+  POLICY_RANDOM     // evict any line
+};
+
+// The shape of a single cache, sizes are in bytes (each LC-3 word is 2 bytes).
+struct CacheConfig
+{
+  uint32_t size;
+  uint32_t ways;
+  uint32_t lineSize;
+  enum ReplacementPolicy policy;
+};
+
+// The levels of the simulated hierarchy. Both L1 caches are backed by L2.
+enum CacheLevel
+{
+  CACHE_L1I = 0,
+  CACHE_L1D,
+  CACHE_L2,
+  CACHE_LEVELS
+};
+
+int initCacheSim(const char* spec);
+
+int cacheFetch(uint16_t address);
+
+int cacheData(uint16_t address);
+
+int cacheSimEnabled();
+
+void reportCacheSim();
+
+#endif
@@ -0,0 +1,60 @@
+// Used to give guests a clock and a timer, running either on the host's time
+// or on a virtual time that only moves as the guest retires instructions.
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <stdint.h>
+
+// How many instructions make a millisecond of virtual time by default, about
+// the speed of a real LC-3 board.
+#define CLOCK_DEFAULT_RATE 10000
+
+// The most instructions a loop reading the timer (or the clock) may have for
+// the guest going around it to count as doing nothing but waiting, see
+// clock.c.
+#define CLOCK_IDLE_LOOP 16
+
+// Instructions per millisecond of virtual time, or 0 to use the host's time.
+extern uint32_t clockRate;
+
+// Set when nobody is watching the guest (--headless), so that a guest idly
+// waiting while its timer is armed is moved straight on to the deadline.
+extern int clockWarp;
+
+struct Guest;
+
+// The clock and timer of a guest.
+struct GuestClock
+{
+  // The instructions the guest has retired, as far as the virtual clock is
+  // concerned. Only the loops that run with the virtual clock (and the
+  // native loop idioms) keep it up to date.
+  uint64_t instructions;
+  // Where the guest's time started, in retired instructions with the virtual
+  // clock and in host microseconds otherwise.
+  uint64_t start;
+  // Virtual microseconds skipped while the guest was idle.
+  uint64_t warped;
+  // When the timer goes off, in microseconds of guest time, if it is armed.
+  int armed;
+  uint64_t deadline;
+  // The last read of the timer or the clock, to tell when the guest is
+  // spinning on it.
+  uint16_t lastPollPc;
+  uint64_t lastPollRetired;
+};
+
+void startClock(struct GuestClock* clock);
+
+void resetClock(struct Guest* guest);
+
+uint16_t readClockRegister(struct GuestClock* clock, const uint16_t* mem,
+                           int stride, uint16_t pc, uint16_t address);
+
+uint16_t readClock(struct Guest* guest, uint16_t address);
+
+void armTimer(struct GuestClock* clock, uint16_t value);
+
+void writeTimer(struct Guest* guest, uint16_t value);
+
+#endif
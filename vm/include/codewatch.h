@@ -0,0 +1,34 @@
+// Used to find out when the guest writes to pages of memory whose contents
+// something has cached (e.g. the loops the idiom recogniser has matched).
+#ifndef CODEWATCH_H
+#define CODEWATCH_H
+
+#include <stdint.h>
+
+#include "architecture.h"
+
+// Memory is watched a host page at a time.
+#define WATCH_PAGE_WORDS 2048
+#define WATCH_PAGES (MEMORY_MAX / WATCH_PAGE_WORDS)
+
+// A page written this many times is changing too often to be worth caching
+// anything from, so it isn't watched any more.
+#define WATCH_MAX_WRITES 64
+
+// Called on the thread that wrote to a watched page, before the write goes
+// through, with the page that is about to change.
+typedef void (*PageWritten)(struct Guest* guest, int page);
+
+int startWatching(struct Guest* guest);
+
+void stopWatching();
+
+void addPageWatcher(PageWritten watcher);
+
+int watchAddress(uint16_t address);
+
+int watchAllPages();
+
+uint32_t takeDirtyPages();
+
+#endif
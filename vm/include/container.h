@@ -0,0 +1,72 @@
+// Used to read and write container images, which hold several segments of
+// memory along with an entry point and symbols.
+#ifndef CONTAINER_H
+#define CONTAINER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "image.h"
+
+#define CONTAINER_MAGIC "LC3C"
+#define CONTAINER_VERSION 1
+
+// Set in the header when the container says where the program counter starts.
+#define CONTAINER_HAS_ENTRY 1
+
+// Set for a segment whose words are LZ4 compressed.
+#define SEGMENT_LZ4 1
+
+/*
+ * A container starts with this header, followed by the segment table, the
+ * symbol table, the symbol names (each NUL terminated) and then the data of
+ * the segments. Everything is little endian, so that a segment that isn't
+ * compressed can be copied straight into memory from a mapping of the file.
+ */
+struct ContainerHeader
+{
+  char magic[4];
+  uint16_t version;
+  uint16_t flags;
+  uint16_t entry;
+  uint16_t segmentCount;
+  uint32_t symbolCount;
+  uint32_t namesSize;
+  uint32_t reserved;
+  // A hash of the origin, length and words of every segment in turn, which
+  // doesn't depend on how the segments are stored.
+  uint64_t contentHash;
+};
+
+struct ContainerSegment
+{
+  uint16_t origin;
+  uint16_t flags;
+  // In words.
+  uint32_t length;
+  // Where the data is from the start of the file, and its size there.
+  uint32_t offset;
+  uint32_t storedSize;
+  // The CRC-32 of the words as they are placed in memory.
+  uint32_t checksum;
+};
+
+struct ContainerSymbol
+{
+  uint16_t address;
+  uint16_t reserved;
+  // Where the name is in the names.
+  uint32_t name;
+};
+
+int isContainer(const uint8_t* data, size_t size);
+
+const char* readContainer(const uint8_t* data, size_t size,
+                          struct Image* image, uint16_t* memory);
+
+int writeContainer(FILE* file, const struct Image* image, int compress);
+
+uint32_t crc32(const uint8_t* data, size_t size);
+
+#endif
@@ -0,0 +1,26 @@
+// Used to debug a guest with GDB over its remote serial protocol.
+#ifndef DEBUG_H
+#define DEBUG_H
+
+#include <stdint.h>
+
+#include "architecture.h"
+
+// What the fetch path hands the interpreter in place of an instruction the
+// debugger wants to stop at. RES is otherwise never executed.
+#define BREAK_INSTRUCTION (OP_RES << 12)
+
+// Set while a debugger is attached.
+extern int debugging;
+
+int startDebugger(struct Guest* guest, const char* address);
+
+int debugFetch(uint16_t address);
+
+void debugAccess(uint16_t address, enum MemAccess access);
+
+int debugBreak(struct Guest* guest);
+
+void stopDebugger();
+
+#endif
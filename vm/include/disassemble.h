@@ -0,0 +1,14 @@
+// Used to turn LC-3 instructions back into assembly, e.g. for reports.
+#ifndef DISASSEMBLE_H
+#define DISASSEMBLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Long enough for any instruction disassembleInstruction writes.
+#define DISASSEMBLY_MAX 32
+
+void disassembleInstruction(uint16_t address, uint16_t instruction,
+                            char* text, size_t size);
+
+#endif
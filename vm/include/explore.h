@@ -0,0 +1,43 @@
+// Used to search the inputs of a guest by running many of them side by side
+// from shared snapshots.
+#ifndef EXPLORE_H
+#define EXPLORE_H
+
+#include <stdint.h>
+
+// The most instructions a single input may take before the guest asks for
+// the next one.
+#define EXPLORE_BRANCH_BUDGET 10000000ULL
+
+// The most inputs that can be tried at every step.
+#define MAX_EXPLORE_INPUTS 64
+
+/*
+ * Scores the state an input left the guest in, higher is better. It is called
+ * on the worker thread that ran the input, with that thread's memory and
+ * registers.
+ */
+typedef double (*ExploreScore)(const uint16_t* memory, const uint16_t* regs,
+                               void* context);
+
+struct ExploreOptions
+{
+  // A comma separated list of inputs, every one of which is tried as the
+  // next input from every state.
+  const char* inputs;
+  // Given to the guest before the search starts.
+  const char* prefix;
+  int depth;
+  // The most states that are searched further at every depth, the best
+  // scoring ones are kept.
+  int beam;
+  int workerCount;
+  ExploreScore score;
+  void* scoreContext;
+};
+
+int parseExploreScore(const char* spec, struct ExploreOptions* options);
+
+int runExploration(const struct ExploreOptions* options);
+
+#endif
@@ -0,0 +1,31 @@
+// Used to fuzz the input handling of a guest in-process, with the guest's
+// control flow as the coverage.
+#ifndef FUZZ_H
+#define FUZZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// How many counters the edges of the guest's control flow are hashed into.
+#define FUZZ_EDGES (1 << 16)
+
+// The most instructions a single input may take before it is given up on.
+#define FUZZ_DEFAULT_BUDGET 1000000ULL
+
+extern uint8_t fuzzEdges[FUZZ_EDGES];
+
+/*
+ * Counts the guest going from the instruction before `from` to `to`. The
+ * pair is hashed the same way wherever it happens, so every edge keeps its
+ * counter from one input to the next.
+ */
+static inline void recordEdge(uint16_t from, uint16_t to)
+{
+  fuzzEdges[(uint16_t)(from * 40503u) ^ to]++;
+}
+
+int startFuzzing(const char** imagePaths, int imageCount, uint64_t budget);
+
+int runFuzzInput(const uint8_t* data, size_t size);
+
+#endif
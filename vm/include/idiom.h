@@ -0,0 +1,54 @@
+// Used to recognise common LC-3 software loops and run them natively.
+#ifndef IDIOM_H
+#define IDIOM_H
+
+#include <signal.h>
+#include <stdint.h>
+
+// The loops the recogniser knows how to run as a single native operation.
+enum Idiom
+{
+  IDIOM_NONE = 0,
+  IDIOM_MULTIPLY,   // acc += value, repeated count times
+  IDIOM_SHIFT,      // acc += acc, repeated count times
+  IDIOM_COPY,       // word by word copy of count words
+  IDIOM_KINDS
+};
+
+struct Guest;
+
+// What the recogniser knows about a guest.
+struct GuestIdioms
+{
+  // Whether the VM should try to replace recognised loops, the original
+  // instructions are always used when nothing is recognised. It is per guest
+  // so that e.g. the validator can run the plain interpreter next to one
+  // that uses idioms.
+  int enabled;
+  // The number of guest instructions each idiom has stood in for.
+  uint64_t instructions[IDIOM_KINDS];
+  // What matchIdiom found at every loop head, plus one so that 0 means it
+  // hasn't been looked at. Only allocated for guests whose memory is watched
+  // (see cacheIdioms).
+  uint8_t* known;
+  // When set, a bit per address that lookupIdiom sets the first time it
+  // looks at a loop head there (see analysis.c).
+  uint64_t* reachedHeads;
+  // When set, no loop is run natively that would take the guest's retired
+  // instructions (see GuestClock) past this, e.g. to keep to a budget.
+  uint64_t stopAt;
+};
+
+// The idiom being run right now (IDIOM_NONE when the interpreter is running),
+// so that a signal handler can tell where the VM's time goes.
+extern _Thread_local volatile sig_atomic_t currentIdiom;
+
+enum Idiom matchIdiom(struct Guest* guest, uint16_t loopHead);
+
+void cacheIdioms(struct Guest* guest);
+
+int rememberIdiom(struct Guest* guest, uint16_t loopHead, enum Idiom idiom);
+
+uint32_t runIdiom(struct Guest* guest);
+
+#endif
@@ -0,0 +1,61 @@
+// Used to read LC-3 object files and container images into memory.
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Words to place into memory starting at `origin`.
+struct ImageSegment
+{
+  uint16_t origin;
+  uint32_t length;
+  uint16_t* words;
+};
+
+struct ImageSymbol
+{
+  uint16_t address;
+  char* name;
+};
+
+// An image read into host memory, ready to be placed into the VM's memory
+// any number of times. An object file is a single segment with no entry
+// point or symbols.
+struct Image
+{
+  struct ImageSegment* segments;
+  int segmentCount;
+  int hasEntry;
+  uint16_t entry;
+  struct ImageSymbol* symbols;
+  int symbolCount;
+};
+
+struct Guest;
+
+// Where the program counter starts, PC_START unless an image read with
+// readImage says otherwise.
+extern uint16_t entryPoint;
+
+uint16_t swap16(uint16_t x);
+
+void readImageFile(FILE* file);
+
+int readImage(const char* imagePath);
+
+int loadImage(const char* imagePath, struct Image* image);
+
+void placeImage(struct Guest* guest, const struct Image* image);
+
+void freeImage(struct Image* image);
+
+const char* lookupSymbol(uint16_t address, uint16_t* offset);
+
+// Enough for any symbol and offset written by formatSymbol.
+#define SYMBOL_TEXT_MAX 64
+
+void formatSymbol(uint16_t address, char* text, size_t size);
+
+#endif
@@ -2,30 +2,42 @@
 #ifndef INSTRUCTION_H
 #define INSTRUCTION_H
 
-void executeAdd(uint16_t addInstruction);
+#include <stdint.h>
 
-void executeAnd(uint16_t andInstruction);
+struct Guest;
 
-void executeNot(uint16_t notInstruction);
+uint16_t signExtend(uint16_t x, int bitCount);
 
-void executeBranch(uint16_t branchInstruction);
+uint16_t signExtendPcOffset(uint16_t currInstruction);
 
-void executeJump(uint16_t jumpInstruction);
+uint16_t extractRegister(uint16_t currInstruction, short endIdx);
 
-void executeJumpToSubroutine(uint16_t jumpInstruction);
+uint16_t extractBit(uint16_t currInstruction, short bitIdx);
 
-void executeLoad(uint16_t loadInstruction);
+void executeAdd(struct Guest* guest, uint16_t addInstruction);
 
-void executeLoadIndirect(uint16_t ldiInstruction);
+void executeAnd(struct Guest* guest, uint16_t andInstruction);
 
-void executeLoadRegister(uint16_t ldrInstruction);
+void executeNot(struct Guest* guest, uint16_t notInstruction);
 
-void executeLoadEffectiveAddress(uint16_t leaInstruction);
+void executeBranch(struct Guest* guest, uint16_t branchInstruction);
 
-void executeStore(uint16_t storeInstruction);
+void executeJump(struct Guest* guest, uint16_t jumpInstruction);
 
-void executeStoreIndirect(uint16_t stiInstruction);
+void executeJumpToSubroutine(struct Guest* guest, uint16_t jumpInstruction);
 
-void executeStoreRegister(uint16_t strInstruction);
+void executeLoad(struct Guest* guest, uint16_t loadInstruction);
+
+void executeLoadIndirect(struct Guest* guest, uint16_t ldiInstruction);
+
+void executeLoadRegister(struct Guest* guest, uint16_t ldrInstruction);
+
+void executeLoadEffectiveAddress(struct Guest* guest, uint16_t leaInstruction);
+
+void executeStore(struct Guest* guest, uint16_t storeInstruction);
+
+void executeStoreIndirect(struct Guest* guest, uint16_t stiInstruction);
+
+void executeStoreRegister(struct Guest* guest, uint16_t strInstruction);
 
 #endif
@@ -0,0 +1,38 @@
+// The main fetch, decode and execute loop of the VM.
+#ifndef INTERPRETER_H
+#define INTERPRETER_H
+
+#include <signal.h>
+#include <stdint.h>
+
+// The opcode the interpreter is executing right now, and the number of
+// instructions it has executed with each opcode, when it is counting (or an
+// estimate of them, when it is sampling).
+extern volatile sig_atomic_t currentOpcode;
+extern uint64_t opcodeCounts[16];
+
+// About how many instructions apart runInterpreterSampled looks at the
+// opcode being executed.
+#define OPCODE_SAMPLE_PERIOD 64
+
+struct Guest;
+
+int executeInstruction(struct Guest* guest, uint16_t currInstruction);
+
+void runInterpreter(struct Guest* guest);
+
+void runInterpreterClocked(struct Guest* guest);
+
+void runInterpreterCounted(struct Guest* guest, uint32_t interval,
+                           void (*tick)());
+
+void runInterpreterSampled(struct Guest* guest, uint32_t interval,
+                           void (*tick)());
+
+int runInterpreterBudget(struct Guest* guest, uint64_t budget,
+                         uint64_t* executed);
+
+int runInterpreterCovered(struct Guest* guest, uint64_t budget,
+                          uint64_t* executed);
+
+#endif
@@ -0,0 +1,17 @@
+// Used to compress and decompress data in the LZ4 block format.
+#ifndef LZ4_H
+#define LZ4_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The most bytes lz4Compress can write for `size` bytes of input.
+#define LZ4_BOUND(size) ((size) + (size) / 255 + 16)
+
+size_t lz4Compress(const uint8_t* source, size_t sourceSize, uint8_t* dest,
+                   size_t destCapacity);
+
+int lz4Decompress(const uint8_t* source, size_t sourceSize, uint8_t* dest,
+                  size_t destSize);
+
+#endif
@@ -0,0 +1,47 @@
+// Used to publish live counters of a running guest for lc3-top.
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+
+#define METRICS_MAGIC 0x4d33434c    // "LC3M"
+#define METRICS_VERSION 1
+
+// The segment is /dev/shm/lc3-vm.<pid> unless it is given a name.
+#define METRICS_PREFIX "/lc3-vm."
+
+/*
+ * The layout of the shared memory segment. The VM never waits for readers:
+ * it makes `sequence` odd while it updates the counters and even again when
+ * it is done, so a reader copies the segment and tries again if `sequence`
+ * was odd or changed while it was copying.
+ */
+struct Metrics
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t sequence;
+  int32_t pid;
+  int32_t running;              // cleared when the guest has stopped
+  uint64_t startNs;             // CLOCK_MONOTONIC
+  uint64_t updatedNs;
+  uint64_t instructions;        // retired, including idioms
+  double mips;                  // since the previous update
+  uint64_t opcodes[16];         // estimated from samples
+  uint64_t idiomInstructions;
+  uint64_t traps[256];          // by trap vector
+  uint64_t kbsrPolls;
+  uint64_t outputBytes;
+  uint64_t inputWaitNs;
+};
+
+// The number of instructions between updates of the segment.
+#define METRICS_INTERVAL (1 << 16)
+
+int initMetrics(const char* name);
+
+void publishMetrics();
+
+void closeMetrics();
+
+#endif
@@ -0,0 +1,29 @@
+// Used to measure the host's hardware performance counters while the VM runs.
+#ifndef PERFCOUNTERS_H
+#define PERFCOUNTERS_H
+
+#include <signal.h>
+#include <stdint.h>
+
+// The different ways the VM can execute guest code.
+enum Engine
+{
+  ENGINE_INTERPRETER = 0,   // the switch in interpreter.c
+  ENGINE_IDIOM,             // the native loop idioms in idiom.c
+  ENGINE_SPMD,              // the lockstep batch engine in spmd.c
+  ENGINES
+};
+
+// The engine running the guest right now. The idiom engine is picked up from
+// `currentIdiom` so it doesn't need to be set here.
+extern volatile sig_atomic_t perfEngine;
+
+int initPerfCounters();
+
+void startPerfCounters();
+
+void stopPerfCounters();
+
+void reportPerfCounters();
+
+#endif
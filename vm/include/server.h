@@ -0,0 +1,20 @@
+// Used to run guests as jobs for other processes over a Unix domain socket.
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stdint.h>
+
+// The most images a single job can ask for.
+#define MAX_JOB_IMAGES 8
+
+// The most input a single job can send.
+#define MAX_JOB_INPUT (1 << 20)
+
+// The budget of a job that doesn't ask for one, which is also the most
+// instructions a single job may ask for.
+#define MAX_JOB_BUDGET 1000000000ULL
+
+int runServer(const char* socketPath, const char** imagePaths, int imageCount,
+              int workerCount, int queueDepth);
+
+#endif
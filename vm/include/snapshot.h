@@ -0,0 +1,45 @@
+// Used to save and restore the state of a guest, with snapshots of related
+// states sharing the memory they have in common.
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+
+#include "architecture.h"
+
+// Memory is saved in pages of this many words, and a page that is the same
+// as in the snapshot a new one is taken from is shared rather than copied.
+#define SNAPSHOT_PAGE_WORDS 256
+#define SNAPSHOT_PAGES (MEMORY_MAX / SNAPSHOT_PAGE_WORDS)
+
+struct SnapshotPage
+{
+  int references;
+  uint64_t hash;
+  uint16_t words[SNAPSHOT_PAGE_WORDS];
+};
+
+// Snapshots and their pages are never changed once taken, so any thread can
+// restore them.
+struct Snapshot
+{
+  struct SnapshotPage* pages[SNAPSHOT_PAGES];
+  uint16_t regs[R_MAX];
+  // A hash of memory and registers, equal states have equal hashes (but
+  // equal hashes don't make equal states, see sameSnapshot).
+  uint64_t hash;
+};
+
+struct Snapshot* takeSnapshot(const struct Guest* guest,
+                              const struct Snapshot* base, uint32_t written);
+
+void restoreSnapshot(struct Guest* guest, const struct Snapshot* snapshot,
+                     const struct Snapshot* current, uint32_t written);
+
+int sameSnapshot(const struct Snapshot* first, const struct Snapshot* second);
+
+void freeSnapshot(struct Snapshot* snapshot);
+
+uint64_t snapshotPagesInUse();
+
+#endif
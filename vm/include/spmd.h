@@ -0,0 +1,85 @@
+// Used to run many instances of the same image in lockstep, one per SIMD lane.
+#ifndef SPMD_H
+#define SPMD_H
+
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "architecture.h"
+#include "clock.h"
+
+// The number of guests in a group. 16 lanes of 16 bits fill an AVX2 register,
+// build with -DSPMD_LANES=8 to fill an SSE register instead (those are the
+// only two sizes supported).
+#ifndef SPMD_LANES
+#define SPMD_LANES 16
+#endif
+
+// One 16-bit value per lane, e.g. the value of R0 in every guest.
+typedef uint16_t LaneVector __attribute__((vector_size(SPMD_LANES * 2)));
+
+// The keyboard and console of a single guest in the group.
+struct SpmdLane
+{
+  const uint8_t* input;
+  size_t inputLength;
+  size_t inputPos;
+  char* output;
+  size_t outputLength;
+  size_t outputCapacity;
+  const char* error;
+  // The lane's own clock and timer. Its instructions are only brought up to
+  // date when the lane reads or writes them, see laneClock in spmd.c.
+  struct GuestClock clock;
+};
+
+/*
+ * The registers are stored lane by lane so that a single register of every
+ * guest sits in one vector. Memory is interleaved the same way, the word at
+ * `address` for `lane` lives at `mem[address * SPMD_LANES + lane]`, so if all
+ * the guests access the same address it is a single vector load or store.
+ */
+struct SpmdGroup
+{
+  LaneVector regs[R_MAX];
+  uint16_t* mem;
+  // A bit per lane that is set while that guest is still running.
+  uint32_t running;
+  // Whether all of the running guests are at the same program counter.
+  int converged;
+  struct SpmdLane lanes[SPMD_LANES];
+  // A bit per lane that executed an instruction in the last step.
+  uint32_t stepped;
+  // The instructions each lane has retired that aren't on its clock yet, and
+  // the number of steps since they were last all added to the clocks (they
+  // have to be before a lane's count overflows).
+  LaneVector unclocked;
+  uint32_t unclockedSteps;
+  uint64_t retired;
+  uint64_t opcodeCounts[16];
+  uint64_t vectorSteps;
+  uint64_t scalarSteps;
+};
+
+// The opcode of the instruction being stepped, so that a signal handler can
+// tell where the time goes.
+extern volatile sig_atomic_t spmdCurrentOpcode;
+
+// The number of guest instructions retired with each opcode by all batches.
+extern uint64_t spmdInstructions[16];
+
+struct SpmdGroup* createSpmdGroup(const uint16_t* image, int laneCount);
+
+void freeSpmdGroup(struct SpmdGroup* group);
+
+void setSpmdInput(struct SpmdGroup* group, int lane, const uint8_t* input,
+                  size_t inputLength);
+
+uint64_t stepSpmdGroup(struct SpmdGroup* group);
+
+void runSpmdGroup(struct SpmdGroup* group);
+
+int runSpmdBatch(const char* inputList);
+
+#endif
@@ -0,0 +1,19 @@
+// Used to estimate how many cycles a guest would take on a pipelined LC-3.
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <stdint.h>
+
+#include "architecture.h"
+
+int initTiming(const char* configPath);
+
+int timingEnabled();
+
+void timingFetch(uint16_t address, int cacheLevel);
+
+void timingData(enum MemAccess access, int cacheLevel);
+
+void reportTiming();
+
+#endif
@@ -2,6 +2,8 @@
 #ifndef TRAP_H
 #define TRAP_H
 
-int handleTrap(uint16_t trapInstruction);
+struct Guest;
+
+int handleTrap(struct Guest* guest, uint16_t trapInstruction);
 
 #endif
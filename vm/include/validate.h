@@ -0,0 +1,18 @@
+// Used to check a faster execution engine against the reference interpreter.
+#ifndef VALIDATE_H
+#define VALIDATE_H
+
+#include <stdint.h>
+
+// Set while a validation runs, so that stores are passed on to
+// validateWrite.
+extern int validating;
+
+struct Guest;
+
+void validateWrite(struct Guest* guest, uint16_t address, uint16_t value);
+
+int runValidation(const char* engineName, const char* inputPath,
+                  uint64_t every);
+
+#endif
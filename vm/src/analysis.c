@@ -0,0 +1,199 @@
+/*
+ * Keeping the analysis of an image between runs.
+ *
+ * Every run of an image would otherwise find the same loops again, one
+ * backwards branch at a time, before the idiom recogniser's cache (see
+ * idiom.c) has warmed up. Instead, memory is hashed once the images have been
+ * read and a file named after the hash in the cache directory keeps which
+ * loop heads the guest has reached. Later runs of the same image map that
+ * file and start out remembering every one of them, rather than waiting for
+ * each to be reached again.
+ *
+ * Only where the loops are is kept, not what they do. Matching a loop is a
+ * handful of comparisons, so every head is matched again as it is
+ * remembered, and a file that has been tampered with can only change which
+ * loops are remembered up front. Remembering a loop watches its page for
+ * writes, so loops that were never reached are left alone.
+ *
+ * A head is marked the first time the recogniser looks at it (lookupIdiom),
+ * so the file is written to at most once per head and never from the loops
+ * themselves. Two VMs running the same image at once mark it with atomic
+ * ors, so neither loses the other's heads.
+ */
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "architecture.h"
+#include "idiom.h"
+#include "analysis.h"
+
+static struct Analysis* analysis;
+
+static uint64_t hashMemory(const uint16_t* mem)
+{
+  uint64_t hash = 0;
+  for (uint32_t idx = 0; idx < MEMORY_MAX; idx += 4)
+  {
+    uint64_t chunk;
+    memcpy(&chunk, mem + idx, sizeof(chunk));
+    hash = (hash ^ chunk) * 0x9E3779B97F4A7C15ULL;
+    hash ^= hash >> 29;
+  }
+  return hash;
+}
+
+// Makes `path` and any of its parents that don't exist yet.
+static int makeDirectories(const char* path)
+{
+  char partial[PATH_MAX];
+  snprintf(partial, sizeof(partial), "%s", path);
+  for (char* slash = partial + 1; *slash; slash++)
+  {
+    if (*slash == '/')
+    {
+      *slash = '\0';
+      mkdir(partial, 0755);
+      *slash = '/';
+    }
+  }
+  return mkdir(partial, 0755) == 0 || errno == EEXIST;
+}
+
+/*
+ * Makes a new, empty cache file at `path` for the image with hash `hash`. It
+ * is written under a name of its own and renamed into place once it is
+ * complete, so other VMs never map half a file.
+ */
+static struct Analysis* createAnalysis(const char* path, uint64_t hash)
+{
+  char temporary[PATH_MAX];
+  if (snprintf(temporary, sizeof(temporary), "%s.%d", path, (int)getpid())
+      >= (int)sizeof(temporary))
+  {
+    errno = ENAMETOOLONG;
+    return NULL;
+  }
+
+  int fd = open(temporary, O_CREAT | O_EXCL | O_RDWR, 0644);
+  if (fd < 0)
+  {
+    return NULL;
+  }
+  struct Analysis* result = MAP_FAILED;
+  if (ftruncate(fd, sizeof(struct Analysis)) == 0)
+  {
+    result = mmap(NULL, sizeof(struct Analysis), PROT_READ | PROT_WRITE,
+                  MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (result == MAP_FAILED)
+  {
+    unlink(temporary);
+    return NULL;
+  }
+
+  result->magic = ANALYSIS_MAGIC;
+  result->version = ANALYSIS_VERSION;
+  result->imageHash = hash;
+  if (rename(temporary, path) != 0)
+  {
+    munmap(result, sizeof(struct Analysis));
+    unlink(temporary);
+    return NULL;
+  }
+  return result;
+}
+
+// Maps the cache file at `path`, if there is one for this image.
+static struct Analysis* mapAnalysis(const char* path, uint64_t hash)
+{
+  int fd = open(path, O_RDWR);
+  if (fd < 0)
+  {
+    return NULL;
+  }
+  struct stat info;
+  struct Analysis* result = MAP_FAILED;
+  if (fstat(fd, &info) == 0 && info.st_size == sizeof(struct Analysis))
+  {
+    result = mmap(NULL, sizeof(struct Analysis), PROT_READ | PROT_WRITE,
+                  MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (result == MAP_FAILED)
+  {
+    return NULL;
+  }
+  if (result->magic != ANALYSIS_MAGIC || result->version != ANALYSIS_VERSION
+      || result->imageHash != hash)
+  {
+    munmap(result, sizeof(struct Analysis));
+    return NULL;
+  }
+  return result;
+}
+
+/*
+ * Maps the analysis of the image in the memory of `guest` from `directory`
+ * (or the user's cache directory when NULL), starting a new one if the image
+ * hasn't been seen before, and remembers the loops earlier runs reached. It
+ * has to be called on the thread that runs the guest, after cacheIdioms and
+ * before the guest's first instruction. Returns 0 if the cache couldn't be
+ * used.
+ */
+int loadAnalysis(struct Guest* guest, const char* directory)
+{
+  char defaultDirectory[PATH_MAX];
+  if (!directory)
+  {
+    const char* cacheHome = getenv("XDG_CACHE_HOME");
+    const char* home = getenv("HOME");
+    if (cacheHome && cacheHome[0] == '/')
+    {
+      snprintf(defaultDirectory, sizeof(defaultDirectory), "%s/lc3-vm",
+               cacheHome);
+    }
+    else
+    {
+      snprintf(defaultDirectory, sizeof(defaultDirectory),
+               "%s/.cache/lc3-vm", home ? home : "/tmp");
+    }
+    directory = defaultDirectory;
+  }
+
+  uint64_t hash = hashMemory(guest->mem);
+  char path[PATH_MAX];
+  if (snprintf(path, sizeof(path), "%s/%016llx" ANALYSIS_EXTENSION,
+               directory, (unsigned long long)hash) >= (int)sizeof(path))
+  {
+    fprintf(stderr, "Analysis cache directory name too long: %s\n",
+            directory);
+    return 0;
+  }
+
+  analysis = mapAnalysis(path, hash);
+  if (!analysis && makeDirectories(directory))
+  {
+    analysis = createAnalysis(path, hash);
+  }
+  if (!analysis)
+  {
+    fprintf(stderr, "Failed to use analysis cache %s: %s\n", path,
+            strerror(errno));
+    return 0;
+  }
+
+  analysis->runs++;
+  for (uint32_t word = 0; word < MEMORY_MAX / 64; word++)
+  {
+    for (uint64_t bits = analysis->reachedHeads[word]; bits;
+         bits &= bits - 1)
+    {
+      uint16_t head = word * 64 + __builtin_ctzll(bits);
+      rememberIdiom(guest, head, matchIdiom(guest, head));
+    }
+  }
+  guest->idioms.reachedHeads = analysis->reachedHeads;
+  return 1;
+}
@@ -1,8 +1,33 @@
 // Some high-level architecture specific functions
 #include "architecture.h"
+#include "cache.h"
+#include "timing.h"
+#include "debug.h"
+#include "validate.h"
+#include "clock.h"
 
-void updateConditionFlags(uint16_t registerIdx)
+struct Guest mainGuest = { .idioms.enabled = 1 };
+void (*beforeInputWait)();
+struct termios originalTio;
+int memObserved = 0;
+
+// Makes a new guest with empty memory and registers, for engines that run
+// guests of their own. Returns NULL if there isn't the memory for one.
+struct Guest* newGuest()
+{
+  struct Guest* guest = aligned_alloc(__alignof__(struct Guest),
+                                      sizeof(struct Guest));
+  if (guest)
+  {
+    memset(guest, 0, sizeof(struct Guest));
+    guest->idioms.enabled = 1;
+  }
+  return guest;
+}
+
+void updateConditionFlags(struct Guest* guest, uint16_t registerIdx)
 {
+  uint16_t* regs = guest->regs;
   if (regs[registerIdx] == 0)
   {
     regs[R_COND] = FL_ZRO;
@@ -19,32 +44,131 @@ void updateConditionFlags(uint16_t registerIdx)
   }
 }
 
-void memWrite(uint16_t address, uint16_t addressVal)
+/*
+ * Passes a memory access on to whatever is observing memory. Only called
+ * when `memObserved` is set, so none of this is paid for otherwise.
+ */
+static void observeMemAccess(uint16_t address, enum MemAccess access)
 {
-  mem[address] = addressVal;
+  // The level of the simulated caches that served the access, if any.
+  int cacheLevel = -1;
+
+  if (cacheSimEnabled())
+  {
+    cacheLevel = access == ACCESS_FETCH
+      ? cacheFetch(address) : cacheData(address);
+  }
+  if (timingEnabled())
+  {
+    if (access == ACCESS_FETCH)
+    {
+      timingFetch(address, cacheLevel);
+    }
+    else
+    {
+      timingData(access, cacheLevel);
+    }
+  }
+  if (debugging && access != ACCESS_FETCH)
+  {
+    debugAccess(address, access);
+  }
 }
 
-uint16_t memRead(uint16_t address)
+void memWrite(struct Guest* guest, uint16_t address, uint16_t addressVal)
 {
-  if (address == MR_KBSR)
+  if (__builtin_expect(memObserved, 0))
   {
-    if (checkKey())
+    observeMemAccess(address, ACCESS_WRITE);
+  }
+  // Only the device registers at the top of memory need a second look,
+  // the same as in readAddress.
+  if (__builtin_expect(address >= MR_KBSR, 0))
+  {
+    // Stores to the timer arm it rather than going to memory.
+    if (address == MR_TIMER)
     {
-      // If a key is pressed we update the KBSR register to show its pressed
-      // and read the character into KBDR.
-      mem[MR_KBSR] = (1 << 15);
-      mem[MR_KBDR] = getchar();
+      writeTimer(guest, addressVal);
+      return;
     }
-    else
+  }
+  // Only what reaches memory is in the memory hash.
+  if (__builtin_expect(memObserved, 0) && validating)
+  {
+    validateWrite(guest, address, addressVal);
+  }
+  guest->mem[address] = addressVal;
+}
+
+// Reading the keyboard status register polls the keyboard and the clock
+// registers read the guest's time, every other read just returns the
+// contents of memory.
+static uint16_t readAddress(struct Guest* guest, uint16_t address)
+{
+  uint16_t* mem = guest->mem;
+  if (__builtin_expect(address >= MR_KBSR, 0))
+  {
+    if (address == MR_CLOCK || address == MR_TIMER)
     {
-      // Otherwise the keyboard is not pressed
-      mem[MR_KBSR] = 0;
+      return readClock(guest, address);
+    }
+    if (address == MR_KBSR)
+    {
+      guest->stats.kbsrPolls++;
+      if (checkKey(guest))
+      {
+        // If a key is pressed we update the KBSR register to show its
+        // pressed and read the character into KBDR.
+        mem[MR_KBSR] = (1 << 15);
+        mem[MR_KBDR] = consoleGetChar(guest);
+      }
+      else
+      {
+        // Otherwise the keyboard is not pressed
+        mem[MR_KBSR] = 0;
+      }
     }
   }
   // Get the value at the specified address
   return mem[address];
 }
 
+uint16_t memRead(struct Guest* guest, uint16_t address)
+{
+  if (__builtin_expect(memObserved, 0))
+  {
+    observeMemAccess(address, ACCESS_READ);
+  }
+  return readAddress(guest, address);
+}
+
+/*
+ * Reads the instruction at `address`. This is the same as memRead except that
+ * observers are told it is an instruction fetch rather than a load.
+ */
+uint16_t memFetch(struct Guest* guest, uint16_t address)
+{
+  if (__builtin_expect(memObserved, 0))
+  {
+    observeMemAccess(address, ACCESS_FETCH);
+    if (debugging && debugFetch(address))
+    {
+      return BREAK_INSTRUCTION;
+    }
+  }
+  return readAddress(guest, address);
+}
+
+/*
+ * memFetch for callers that have already checked that nothing observes
+ * memory, so that e.g. the plain interpreter doesn't look at `memObserved`
+ * for every instruction.
+ */
+uint16_t memFetchUnobserved(struct Guest* guest, uint16_t address)
+{
+  return readAddress(guest, address);
+}
+
 void disableInputBuffering()
 {
   tcgetattr(STDIN_FILENO, &originalTio);
@@ -58,8 +182,13 @@ void restoreInputBuffering()
   tcsetattr(STDIN_FILENO, TCSANOW, &originalTio);
 }
 
-uint16_t checkKey()
+uint16_t checkKey(struct Guest* guest)
 {
+  struct Console* console = guest->console;
+  if (console)
+  {
+    return console->keyReady(console);
+  }
   fd_set readfds;
   FD_ZERO(&readfds);
   FD_SET(STDIN_FILENO, &readfds);
@@ -68,3 +197,56 @@ uint16_t checkKey()
   timeout.tv_usec = 0;
   return select(1, &readfds, NULL, NULL, &timeout) != 0;
 }
+
+// Reads a key from the guest's keyboard, waiting for one if needed.
+int consoleGetChar(struct Guest* guest)
+{
+  struct Console* console = guest->console;
+  struct timespec before, after;
+  if (beforeInputWait)
+  {
+    beforeInputWait();
+  }
+  clock_gettime(CLOCK_MONOTONIC, &before);
+  int c = console ? console->getChar(console) : getchar();
+  clock_gettime(CLOCK_MONOTONIC, &after);
+
+  guest->stats.inputWaitNs += (after.tv_sec - before.tv_sec) * 1000000000LL
+    + (after.tv_nsec - before.tv_nsec);
+  return c;
+}
+
+// Writes a character to the guest's display.
+void consolePutChar(struct Guest* guest, char c)
+{
+  guest->stats.outputBytes++;
+  if (guest->console)
+  {
+    guest->console->putChar(guest->console, c);
+  }
+  else
+  {
+    putc(c, stdout);
+  }
+}
+
+void consoleWrite(struct Guest* guest, const char* text)
+{
+  while (*text)
+  {
+    consolePutChar(guest, *text++);
+  }
+}
+
+// Makes sure everything written to the guest's display can be seen.
+void consoleFlush(struct Guest* guest)
+{
+  if (guest->console)
+  {
+    guest->console->flush(guest->console);
+  }
+  else
+  {
+    fflush(stdout);
+  }
+}
@@ -0,0 +1,387 @@
+/*
+ * A simulated cache hierarchy that the guest's memory accesses are fed
+ * through, so we can see how data layout choices in an LC-3 program would
+ * behave on a machine with caches.
+ *
+ * Instruction fetches go to L1I, loads and stores go to L1D, and a miss in
+ * either goes on to a unified L2. Every access is attributed to the program
+ * counter of the instruction that made it and to the region of memory it
+ * touched, and the totals are reported when the VM exits.
+ */
+#include <strings.h>
+
+#include "architecture.h"
+#include "cache.h"
+#include "image.h"
+
+// Accesses are grouped into regions of this many words for the report.
+#define REGION_SHIFT 8
+#define REGION_COUNT (MEMORY_MAX >> REGION_SHIFT)
+
+// How many of the worst instructions to list in the report.
+#define REPORT_TOP_PCS 20
+
+static const char* LEVEL_NAMES[CACHE_LEVELS] = { "L1I", "L1D", "L2" };
+static const char* POLICY_NAMES[] = { "lru", "fifo", "random" };
+
+/*
+ * A set associative cache. The tags of a set are stored next to each other,
+ * and `stamps` holds the time each line was last used (LRU) or filled (FIFO).
+ */
+struct Cache
+{
+  struct CacheConfig config;
+  uint32_t lineShift;
+  uint32_t setMask;
+  uint32_t* tags;
+  uint64_t* stamps;
+  // The line of the previous access, which is always a hit.
+  uint32_t lastLine;
+  uint64_t clock;
+  uint64_t hits;
+  uint64_t misses;
+};
+
+// The counters kept for each instruction and each region of memory.
+struct AccessStats
+{
+  uint32_t fetchMisses;
+  uint32_t dataAccesses;
+  uint32_t dataMisses;
+  uint32_t l2Misses;
+};
+
+static struct Cache caches[CACHE_LEVELS];
+static struct AccessStats* pcStats;
+static struct AccessStats regionStats[REGION_COUNT];
+static uint16_t currentPc;
+static int enabled;
+
+// A small, reasonable hierarchy for a 16-bit machine.
+static const struct CacheConfig DEFAULT_CONFIGS[CACHE_LEVELS] = {
+  { 1024, 2, 16, POLICY_LRU },
+  { 1024, 4, 16, POLICY_LRU },
+  { 8192, 8, 32, POLICY_LRU }
+};
+
+static int isPowerOfTwo(uint32_t x)
+{
+  return x && !(x & (x - 1));
+}
+
+static uint32_t log2u(uint32_t x)
+{
+  return 31 - __builtin_clz(x);
+}
+
+static int setupCache(struct Cache* cache, struct CacheConfig config)
+{
+  if (!isPowerOfTwo(config.size) || !isPowerOfTwo(config.ways)
+      || !isPowerOfTwo(config.lineSize) || config.lineSize < 2
+      || config.size < config.ways * config.lineSize)
+  {
+    return 0;
+  }
+  uint32_t lines = config.size / config.lineSize;
+
+  cache->config = config;
+  cache->lineShift = log2u(config.lineSize);
+  cache->setMask = lines / config.ways - 1;
+  cache->tags = malloc(lines * sizeof(uint32_t));
+  cache->stamps = calloc(lines, sizeof(uint64_t));
+  // No valid line ever has a tag of all ones.
+  memset(cache->tags, 0xFF, lines * sizeof(uint32_t));
+  cache->lastLine = UINT32_MAX;
+  return 1;
+}
+
+/*
+ * Parses a single `level:size:ways:line[:policy]` entry of the spec, e.g.
+ * `l1d:2048:4:16:lru`.
+ */
+static int parseLevel(char* entry, struct CacheConfig* configs)
+{
+  char* fields[5] = { NULL };
+  int fieldCount = 0;
+  for (char* field = strtok(entry, ":"); field && fieldCount < 5;
+       field = strtok(NULL, ":"))
+  {
+    fields[fieldCount++] = field;
+  }
+  if (fieldCount < 4)
+  {
+    return 0;
+  }
+
+  int level = -1;
+  for (int idx = 0; idx < CACHE_LEVELS; idx++)
+  {
+    if (strcasecmp(fields[0], LEVEL_NAMES[idx]) == 0)
+    {
+      level = idx;
+    }
+  }
+  if (level < 0)
+  {
+    return 0;
+  }
+
+  configs[level].size = strtoul(fields[1], NULL, 0);
+  configs[level].ways = strtoul(fields[2], NULL, 0);
+  configs[level].lineSize = strtoul(fields[3], NULL, 0);
+  if (fields[4])
+  {
+    int found = 0;
+    for (int idx = 0; idx <= POLICY_RANDOM; idx++)
+    {
+      if (strcasecmp(fields[4], POLICY_NAMES[idx]) == 0)
+      {
+        configs[level].policy = idx;
+        found = 1;
+      }
+    }
+    return found;
+  }
+  return 1;
+}
+
+/*
+ * Turns the simulator on. `spec` is a comma separated list of levels to
+ * override, e.g. `l1i:512:1:16,l2:16384:8:32:fifo`, or NULL to use the
+ * defaults for everything.
+ *
+ * Returns 0 if the spec can't be used.
+ */
+int initCacheSim(const char* spec)
+{
+  struct CacheConfig configs[CACHE_LEVELS];
+  memcpy(configs, DEFAULT_CONFIGS, sizeof(configs));
+
+  if (spec)
+  {
+    char* copy = strdup(spec);
+    char* saved;
+    for (char* entry = strtok_r(copy, ",", &saved); entry;
+         entry = strtok_r(NULL, ",", &saved))
+    {
+      if (!parseLevel(entry, configs))
+      {
+        free(copy);
+        return 0;
+      }
+    }
+    free(copy);
+  }
+
+  for (int level = 0; level < CACHE_LEVELS; level++)
+  {
+    if (!setupCache(&caches[level], configs[level]))
+    {
+      return 0;
+    }
+  }
+  pcStats = calloc(MEMORY_MAX, sizeof(struct AccessStats));
+  enabled = 1;
+  return 1;
+}
+
+int cacheSimEnabled()
+{
+  return enabled;
+}
+
+/*
+ * Looks up the byte address `address` in `cache`, filling the line on a miss.
+ * Returns 1 on a hit.
+ */
+static int lookup(struct Cache* cache, uint32_t address)
+{
+  uint32_t line = address >> cache->lineShift;
+  if (line == cache->lastLine)
+  {
+    cache->hits++;
+    return 1;
+  }
+  cache->lastLine = line;
+  cache->clock++;
+
+  uint32_t ways = cache->config.ways;
+  uint32_t first = (line & cache->setMask) * ways;
+  uint32_t* tags = cache->tags + first;
+  uint64_t* stamps = cache->stamps + first;
+
+  for (uint32_t way = 0; way < ways; way++)
+  {
+    if (tags[way] == line)
+    {
+      if (cache->config.policy == POLICY_LRU)
+      {
+        stamps[way] = cache->clock;
+      }
+      cache->hits++;
+      return 1;
+    }
+  }
+
+  // A miss, pick a line to replace. Empty lines have a stamp of 0 so they
+  // are always picked first by LRU and FIFO.
+  uint32_t victim = 0;
+  if (cache->config.policy == POLICY_RANDOM)
+  {
+    victim = rand() & (ways - 1);
+  }
+  else
+  {
+    for (uint32_t way = 1; way < ways; way++)
+    {
+      if (stamps[way] < stamps[victim])
+      {
+        victim = way;
+      }
+    }
+  }
+  tags[victim] = line;
+  stamps[victim] = cache->clock;
+  cache->misses++;
+  return 0;
+}
+
+/*
+ * Called for every instruction fetch. This is also where we find out which
+ * instruction the following data accesses belong to.
+ *
+ * Like cacheData it returns the level that had the data: CACHE_L1I (or
+ * CACHE_L1D), CACHE_L2, or CACHE_LEVELS if it had to come from memory.
+ */
+int cacheFetch(uint16_t address)
+{
+  currentPc = address;
+  if (lookup(&caches[CACHE_L1I], (uint32_t)address * 2))
+  {
+    return CACHE_L1I;
+  }
+  pcStats[address].fetchMisses++;
+  if (lookup(&caches[CACHE_L2], (uint32_t)address * 2))
+  {
+    return CACHE_L2;
+  }
+  pcStats[address].l2Misses++;
+  regionStats[address >> REGION_SHIFT].l2Misses++;
+  return CACHE_LEVELS;
+}
+
+// Called for every load and store the guest makes, see cacheFetch.
+int cacheData(uint16_t address)
+{
+  struct AccessStats* pc = &pcStats[currentPc];
+  struct AccessStats* region = &regionStats[address >> REGION_SHIFT];
+
+  pc->dataAccesses++;
+  region->dataAccesses++;
+  if (lookup(&caches[CACHE_L1D], (uint32_t)address * 2))
+  {
+    return CACHE_L1D;
+  }
+  pc->dataMisses++;
+  region->dataMisses++;
+  if (lookup(&caches[CACHE_L2], (uint32_t)address * 2))
+  {
+    return CACHE_L2;
+  }
+  pc->l2Misses++;
+  region->l2Misses++;
+  return CACHE_LEVELS;
+}
+
+static double percent(uint64_t part, uint64_t whole)
+{
+  return whole ? 100.0 * part / whole : 0.0;
+}
+
+static uint32_t totalMisses(const struct AccessStats* stats)
+{
+  return stats->fetchMisses + stats->dataMisses + stats->l2Misses;
+}
+
+/*
+ * Prints the hit rates of each cache, the instructions with the most misses
+ * and the miss rates for every region of memory that was used. The report
+ * goes to stderr so it doesn't get mixed up with the guest's output.
+ */
+void reportCacheSim()
+{
+  if (!enabled)
+  {
+    return;
+  }
+
+  fprintf(stderr, "\nCache simulation\n");
+  for (int level = 0; level < CACHE_LEVELS; level++)
+  {
+    struct Cache* cache = &caches[level];
+    uint64_t accesses = cache->hits + cache->misses;
+    fprintf(stderr, "  %-3s %6uB %2u-way %3uB lines %-6s: %llu accesses, "
+            "%llu misses (%.2f%% hit rate)\n", LEVEL_NAMES[level],
+            cache->config.size, cache->config.ways, cache->config.lineSize,
+            POLICY_NAMES[cache->config.policy],
+            (unsigned long long)accesses,
+            (unsigned long long)cache->misses,
+            percent(cache->hits, accesses));
+  }
+
+  // Selection of the instructions with the most misses, the list is short so
+  // a simple insertion into a sorted array is enough.
+  uint16_t top[REPORT_TOP_PCS];
+  int topCount = 0;
+  for (uint32_t pc = 0; pc < MEMORY_MAX; pc++)
+  {
+    uint32_t misses = totalMisses(&pcStats[pc]);
+    if (!misses)
+    {
+      continue;
+    }
+    int idx = topCount < REPORT_TOP_PCS ? topCount++ : REPORT_TOP_PCS;
+    while (idx > 0 && totalMisses(&pcStats[top[idx - 1]]) < misses)
+    {
+      if (idx < REPORT_TOP_PCS)
+      {
+        top[idx] = top[idx - 1];
+      }
+      idx--;
+    }
+    if (idx < REPORT_TOP_PCS)
+    {
+      top[idx] = pc;
+    }
+  }
+
+  fprintf(stderr, "\n  Instructions with the most misses\n");
+  fprintf(stderr, "  %-7s %12s %12s %12s %12s\n", "PC", "L1I misses",
+          "data access", "L1D misses", "L2 misses");
+  for (int idx = 0; idx < topCount; idx++)
+  {
+    struct AccessStats* stats = &pcStats[top[idx]];
+    char symbol[SYMBOL_TEXT_MAX];
+    formatSymbol(top[idx], symbol, sizeof(symbol));
+    fprintf(stderr, "  x%04X   %12u %12u %12u %12u  %s\n", top[idx],
+            stats->fetchMisses, stats->dataAccesses, stats->dataMisses,
+            stats->l2Misses, symbol);
+  }
+
+  fprintf(stderr, "\n  Data regions\n");
+  fprintf(stderr, "  %-13s %12s %12s %12s\n", "Addresses", "accesses",
+          "L1D miss %", "L2 misses");
+  for (int region = 0; region < REGION_COUNT; region++)
+  {
+    struct AccessStats* stats = &regionStats[region];
+    if (!stats->dataAccesses && !stats->l2Misses)
+    {
+      continue;
+    }
+    fprintf(stderr, "  x%04X-x%04X   %12u %11.2f%% %12u\n",
+            region << REGION_SHIFT, ((region + 1) << REGION_SHIFT) - 1,
+            stats->dataAccesses,
+            percent(stats->dataMisses, stats->dataAccesses),
+            stats->l2Misses);
+  }
+}
@@ -0,0 +1,218 @@
+/*
+ * The guest's clock and timer, two memory mapped registers:
+ *
+ * - MR_CLOCK reads as the milliseconds since the guest started, modulo 2^16.
+ * - Writing n to MR_TIMER arms it to go off n milliseconds from now, and
+ *   writing 0 disarms it. It reads as the whole milliseconds left while it
+ *   is armed and 0x8000 once it has gone off, so `LDI R0, TIMER` followed by
+ *   `BRzp` back to it waits for the timer.
+ *
+ * Time is normally the host's, so a guest waiting for a second waits for a
+ * real one. With a virtual clock, time is instead the number of instructions
+ * the guest has retired divided by `clockRate`, which is the same from one
+ * run to the next however fast the host is. Headless runs go one step
+ * further: a guest that is doing nothing but reading the timer or the clock
+ * while the timer is armed is idle, and rather than interpreting the wait its
+ * time is moved on to the deadline.
+ *
+ * Idle means that all the guest has done since its last read from the same
+ * instruction is go once around a short loop with that read in it, and that
+ * nothing in the loop stores, traps or jumps. That can only change registers
+ * the loop reads the time into again, so moving the time on can't be told
+ * apart from running the wait. A loop that does any work between reads runs
+ * on the clock like any other code.
+ */
+#include "architecture.h"
+#include "instruction.h"
+#include "clock.h"
+
+uint32_t clockRate = 0;
+int clockWarp = 0;
+
+static uint64_t hostMicroseconds()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// The guest's time in microseconds since it started.
+static uint64_t guestMicroseconds(struct GuestClock* clock)
+{
+  if (!clockRate)
+  {
+    return hostMicroseconds() - clock->start;
+  }
+  return (clock->instructions - clock->start) * 1000 / clockRate
+    + clock->warped;
+}
+
+// Starts the time of `clock` from zero with the timer disarmed.
+void startClock(struct GuestClock* clock)
+{
+  memset(clock, 0, sizeof(*clock));
+  clock->start = clockRate ? 0 : hostMicroseconds();
+}
+
+// Starts the guest's time from zero with the timer disarmed, e.g. for every
+// job in the job server.
+void resetClock(struct Guest* guest)
+{
+  startClock(&guest->clock);
+}
+
+// Whether `instruction` only reads memory and registers into registers.
+static int onlyReads(uint16_t instruction)
+{
+  switch (instruction >> 12)
+  {
+    case OP_ADD:
+    case OP_AND:
+    case OP_NOT:
+    case OP_LD:
+    case OP_LDI:
+    case OP_LDR:
+    case OP_LEA:
+      return 1;
+  }
+  return 0;
+}
+
+/*
+ * Whether `retired` instructions since the last read from the instruction at
+ * `poll` can only have been one pass around a loop that does nothing but
+ * wait: the first branch back to `poll` (or to a little before it) closes a
+ * loop of at most CLOCK_IDLE_LOOP instructions that only read, with no way
+ * out of it other than falling through that branch. Word n of the guest's
+ * memory is at `mem[n * stride]`.
+ */
+static int waitLoop(const uint16_t* mem, int stride, uint16_t poll,
+                    uint64_t retired)
+{
+  uint16_t furthest = poll;
+  for (uint16_t address = poll; (uint16_t)(address - poll) < CLOCK_IDLE_LOOP;
+       address++)
+  {
+    uint16_t instruction = mem[address * stride];
+    if (onlyReads(instruction) || ((instruction >> 12) == OP_BR
+                                   && !((instruction >> 9) & 0x7)))
+    {
+      continue;
+    }
+    if ((instruction >> 12) != OP_BR)
+    {
+      return 0;
+    }
+
+    uint16_t target = address + 1 + signExtendPcOffset(instruction);
+    if (target > address)
+    {
+      // Skipping ahead is fine as long as it stays in the loop.
+      furthest = target > furthest ? target : furthest;
+      continue;
+    }
+    if (target > poll || furthest > address
+        || address - target >= CLOCK_IDLE_LOOP
+        || retired > (uint64_t)(address - target + 1))
+    {
+      return 0;
+    }
+    for (uint16_t before = target; before != poll; before++)
+    {
+      if (!onlyReads(mem[before * stride]))
+      {
+        return 0;
+      }
+    }
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * Whether the guest is doing nothing but waiting for the time, see waitLoop.
+ * `pc` has already moved past the instruction reading it.
+ */
+static int pollingIdly(struct GuestClock* clock, const uint16_t* mem,
+                       int stride, uint16_t pc)
+{
+  int idle = pc == clock->lastPollPc
+    && waitLoop(mem, stride, pc - 1,
+                clock->instructions - clock->lastPollRetired);
+
+  clock->lastPollPc = pc;
+  clock->lastPollRetired = clock->instructions;
+  return idle;
+}
+
+/*
+ * The guest's time for a read of the clock or the timer. When it is headless
+ * and idly polling either of them while the timer is armed, its time is
+ * moved on to the deadline first, as nothing else can happen before then.
+ * With no timer armed there is no deadline to move to, so a guest waiting
+ * on the clock alone runs the whole wait.
+ */
+static uint64_t pollTime(struct GuestClock* clock, const uint16_t* mem,
+                         int stride, uint16_t pc)
+{
+  uint64_t now = guestMicroseconds(clock);
+  if (clock->armed && now < clock->deadline && clockWarp && clockRate
+      && pollingIdly(clock, mem, stride, pc))
+  {
+    clock->warped += clock->deadline - now;
+    now = clock->deadline;
+  }
+  return now;
+}
+
+static uint16_t readTimer(struct GuestClock* clock, const uint16_t* mem,
+                          int stride, uint16_t pc)
+{
+  if (!clock->armed)
+  {
+    return 0;
+  }
+
+  uint64_t now = pollTime(clock, mem, stride, pc);
+  if (now >= clock->deadline)
+  {
+    return 0x8000;
+  }
+
+  uint64_t left = (clock->deadline - now) / 1000;
+  return left > 0x7FFF ? 0x7FFF : left;
+}
+
+/*
+ * Reads MR_CLOCK or MR_TIMER from `clock`, for the instruction before `pc`
+ * in a guest whose word n of memory is at `mem[n * stride]`. Guests that
+ * aren't a struct Guest (e.g. SPMD lanes) keep a clock of their own and use
+ * this rather than readClock.
+ */
+uint16_t readClockRegister(struct GuestClock* clock, const uint16_t* mem,
+                           int stride, uint16_t pc, uint16_t address)
+{
+  if (address == MR_CLOCK)
+  {
+    return pollTime(clock, mem, stride, pc) / 1000;
+  }
+  return readTimer(clock, mem, stride, pc);
+}
+
+uint16_t readClock(struct Guest* guest, uint16_t address)
+{
+  return readClockRegister(&guest->clock, guest->mem, 1, guest->regs[R_PC],
+                           address);
+}
+
+// Writes `value` to the MR_TIMER of `clock`.
+void armTimer(struct GuestClock* clock, uint16_t value)
+{
+  clock->armed = value != 0;
+  clock->deadline = guestMicroseconds(clock) + (uint64_t)value * 1000;
+}
+
+void writeTimer(struct Guest* guest, uint16_t value)
+{
+  armTimer(&guest->clock, value);
+}
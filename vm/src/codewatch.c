@@ -0,0 +1,196 @@
+/*
+ * Watching memory for writes with the host's page protection.
+ *
+ * Anything cached from the guest's memory (such as the loops the idiom
+ * recogniser has matched) goes stale when the guest writes over it. Checking
+ * for that in memWrite would tax every store, so instead the pages something
+ * has been cached from are made read only. The first store to such a page
+ * faults, and the SIGSEGV handler tells the watchers what is about to change,
+ * makes the page writable again and lets the store go through. The page is
+ * only watched again once something is cached from it again, so stores to
+ * pages nothing is cached from never cost anything.
+ *
+ * A fault costs microseconds, so a page the guest keeps writing to (e.g.
+ * code that modifies itself in a loop) stops being watched after
+ * WATCH_MAX_WRITES writes, and nothing is cached from it any more.
+ *
+ * Resetting a guest (e.g. between fuzz inputs) only has to put back the
+ * pages that were written, so watchAllPages watches every page however often
+ * it has been written, and takeDirtyPages says which ones were. That costs a
+ * fault per page written between resets rather than a check on every store.
+ *
+ * Each thread watches the memory of the guest it runs, and only its own
+ * writes are caught, which is all a guest thread does.
+ */
+#include "architecture.h"
+#include "codewatch.h"
+
+#define WATCH_PAGE_BYTES (WATCH_PAGE_WORDS * sizeof(uint16_t))
+#define MAX_PAGE_WATCHERS 4
+
+// The guest this thread is watching, if any, the pages of its memory that
+// are read only right now and the ones written since takeDirtyPages.
+static _Thread_local struct Guest* watchedGuest;
+static _Thread_local uint32_t protectedPages;
+static _Thread_local uint32_t dirtyPageBits;
+static _Thread_local uint16_t pageWrites[WATCH_PAGES];
+
+static PageWritten watchers[MAX_PAGE_WATCHERS];
+static int watcherCount;
+
+// Whatever handled SIGSEGV before handleWriteFault was installed.
+static struct sigaction previousAction;
+
+static void handleWriteFault(int signal, siginfo_t* info, void* context)
+{
+  struct Guest* guest = watchedGuest;
+  uintptr_t offset = guest
+    ? (uintptr_t)info->si_addr - (uintptr_t)guest->mem : UINTPTR_MAX;
+  int page = offset / WATCH_PAGE_BYTES;
+  if (offset >= sizeof(guest->mem) || !(protectedPages & (1u << page)))
+  {
+    // Not one of ours, so it goes to whoever handled SIGSEGV before (e.g.
+    // libFuzzer, which reports the crash). If that was nobody, the store
+    // faults again and crashes the way it would have.
+    if (previousAction.sa_flags & SA_SIGINFO)
+    {
+      previousAction.sa_sigaction(signal, info, context);
+    }
+    else if (previousAction.sa_handler != SIG_DFL
+             && previousAction.sa_handler != SIG_IGN)
+    {
+      previousAction.sa_handler(signal);
+    }
+    else
+    {
+      struct sigaction action;
+      memset(&action, 0, sizeof(action));
+      action.sa_handler = SIG_DFL;
+      sigaction(SIGSEGV, &action, NULL);
+    }
+    return;
+  }
+
+  for (int idx = 0; idx < watcherCount; idx++)
+  {
+    watchers[idx](guest, page);
+  }
+  mprotect((uint8_t*)guest->mem + page * WATCH_PAGE_BYTES, WATCH_PAGE_BYTES,
+           PROT_READ | PROT_WRITE);
+  protectedPages &= ~(1u << page);
+  dirtyPageBits |= 1u << page;
+  if (pageWrites[page] < WATCH_MAX_WRITES)
+  {
+    pageWrites[page]++;
+  }
+}
+
+/*
+ * Starts watching for writes to the memory of `guest`, which the current
+ * thread runs. Returns 0 if it can't be watched, e.g. because the host's
+ * pages aren't the size we expect, in which case nothing should be cached.
+ *
+ * The first call installs the SIGSEGV handler, which passes the faults it
+ * doesn't own on to the handler that was there before, so anything else that
+ * handles SIGSEGV should install its handler first.
+ */
+int startWatching(struct Guest* guest)
+{
+  static int handlerInstalled;
+  if ((uintptr_t)guest->mem % WATCH_PAGE_BYTES != 0
+      || sysconf(_SC_PAGESIZE) != WATCH_PAGE_BYTES)
+  {
+    return 0;
+  }
+  if (!__atomic_exchange_n(&handlerInstalled, 1, __ATOMIC_ACQ_REL))
+  {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = handleWriteFault;
+    action.sa_flags = SA_SIGINFO;
+    sigaction(SIGSEGV, &action, &previousAction);
+  }
+  watchedGuest = guest;
+  return 1;
+}
+
+/*
+ * Stops watching the guest the current thread watches, making all of its
+ * memory writable again (e.g. so that it can be freed).
+ */
+void stopWatching()
+{
+  for (int page = 0; watchedGuest && page < WATCH_PAGES; page++)
+  {
+    if (protectedPages & (1u << page))
+    {
+      mprotect((uint8_t*)watchedGuest->mem + page * WATCH_PAGE_BYTES,
+               WATCH_PAGE_BYTES, PROT_READ | PROT_WRITE);
+    }
+  }
+  watchedGuest = NULL;
+  protectedPages = 0;
+  dirtyPageBits = 0;
+  memset(pageWrites, 0, sizeof(pageWrites));
+}
+
+// Adds a function to call when a watched page is written. Watchers have to
+// be added before any thread starts watching.
+void addPageWatcher(PageWritten watcher)
+{
+  if (watcherCount < MAX_PAGE_WATCHERS)
+  {
+    watchers[watcherCount++] = watcher;
+  }
+}
+
+static int protectPage(int page)
+{
+  if (protectedPages & (1u << page))
+  {
+    return 1;
+  }
+  if (mprotect((uint8_t*)watchedGuest->mem + page * WATCH_PAGE_BYTES,
+               WATCH_PAGE_BYTES, PROT_READ) != 0)
+  {
+    return 0;
+  }
+  protectedPages |= 1u << page;
+  return 1;
+}
+
+/*
+ * Watches the page holding `address` until it is next written. Returns
+ * whether it is being watched, if not nothing may be cached from it.
+ */
+int watchAddress(uint16_t address)
+{
+  int page = address / WATCH_PAGE_WORDS;
+  return watchedGuest && pageWrites[page] < WATCH_MAX_WRITES
+    && protectPage(page);
+}
+
+/*
+ * Watches every page until it is next written, whether or not anything is
+ * cached from it, so that every page written shows up in takeDirtyPages.
+ * Returns 0 if some page couldn't be watched, in which case which pages have
+ * been written isn't known.
+ */
+int watchAllPages()
+{
+  int watched = watchedGuest != NULL;
+  for (int page = 0; watched && page < WATCH_PAGES; page++)
+  {
+    watched = protectPage(page);
+  }
+  return watched;
+}
+
+// The pages written since the last call (one bit per page), e.g. the ones
+// to put back to reset the guest. Only writes to watched pages are seen.
+uint32_t takeDirtyPages()
+{
+  uint32_t pages = dirtyPageBits;
+  dirtyPageBits = 0;
+  return pages;
+}
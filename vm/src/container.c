@@ -0,0 +1,302 @@
+/*
+ * Container images: several segments of memory in one file, each with its
+ * own checksum and optionally LZ4 compressed, along with an entry point, a
+ * symbol table and a hash of the whole contents (see container.h for the
+ * layout).
+ *
+ * A container is read in a single pass, e.g. from a mapping of the file: the
+ * header and tables are checked and then every segment is decompressed or
+ * copied straight to where it goes, and checked there.
+ */
+#include "architecture.h"
+#include "lz4.h"
+#include "container.h"
+
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "Containers are read and written in the byte order of the host"
+#endif
+
+#define FNV_OFFSET 0xCBF29CE484222325ULL
+#define FNV_PRIME 0x100000001B3ULL
+
+// The standard CRC-32 (as used by zlib), a byte at a time.
+uint32_t crc32(const uint8_t* data, size_t size)
+{
+  static uint32_t table[256];
+  if (!table[1])
+  {
+    for (uint32_t byte = 0; byte < 256; byte++)
+    {
+      uint32_t crc = byte;
+      for (int bit = 0; bit < 8; bit++)
+      {
+        crc = crc & 1 ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+      }
+      table[byte] = crc;
+    }
+  }
+
+  uint32_t crc = 0xFFFFFFFF;
+  for (size_t idx = 0; idx < size; idx++)
+  {
+    crc = table[(crc ^ data[idx]) & 0xFF] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+static uint64_t hashBytes(uint64_t hash, const void* data, size_t size)
+{
+  const uint8_t* bytes = data;
+  for (size_t idx = 0; idx < size; idx++)
+  {
+    hash = (hash ^ bytes[idx]) * FNV_PRIME;
+  }
+  return hash;
+}
+
+// Adds a segment to the content hash (FNV-1a over its origin, length and
+// words).
+static uint64_t hashSegment(uint64_t hash, uint16_t origin, uint32_t length,
+                            const uint16_t* words)
+{
+  hash = hashBytes(hash, &origin, sizeof(origin));
+  hash = hashBytes(hash, &length, sizeof(length));
+  return hashBytes(hash, words, length * sizeof(uint16_t));
+}
+
+int isContainer(const uint8_t* data, size_t size)
+{
+  return size >= sizeof(struct ContainerHeader)
+    && memcmp(data, CONTAINER_MAGIC, 4) == 0;
+}
+
+/*
+ * Reads the container in `data`. The entry point and symbols go into `image`.
+ * If `memory` is given the segments are placed straight into it at their
+ * origins and `image` gets no segments, otherwise they are read into
+ * segments of `image`.
+ *
+ * Returns NULL if the container is intact, otherwise what is wrong with it,
+ * in which case whatever was read has to be freed with freeImage.
+ */
+const char* readContainer(const uint8_t* data, size_t size,
+                          struct Image* image, uint16_t* memory)
+{
+  struct ContainerHeader header;
+
+  memset(image, 0, sizeof(struct Image));
+  if (!isContainer(data, size))
+  {
+    return "not a container";
+  }
+  memcpy(&header, data, sizeof(header));
+  if (header.version != CONTAINER_VERSION)
+  {
+    return "unsupported version";
+  }
+
+  uint64_t segmentsAt = sizeof(header);
+  uint64_t symbolsAt = segmentsAt
+    + (uint64_t)header.segmentCount * sizeof(struct ContainerSegment);
+  uint64_t namesAt = symbolsAt
+    + (uint64_t)header.symbolCount * sizeof(struct ContainerSymbol);
+  const char* names = (const char*)data + namesAt;
+  if (namesAt + header.namesSize > size)
+  {
+    return "truncated";
+  }
+  if (header.namesSize && names[header.namesSize - 1])
+  {
+    return "malformed symbol names";
+  }
+
+  image->hasEntry = header.flags & CONTAINER_HAS_ENTRY;
+  image->entry = header.entry;
+
+  image->symbols = calloc(header.symbolCount + 1, sizeof(struct ImageSymbol));
+  for (uint32_t idx = 0; idx < header.symbolCount; idx++)
+  {
+    struct ContainerSymbol symbol;
+    memcpy(&symbol, data + symbolsAt + idx * sizeof(symbol), sizeof(symbol));
+    if (symbol.name >= header.namesSize)
+    {
+      return "malformed symbol table";
+    }
+    image->symbols[idx].address = symbol.address;
+    image->symbols[idx].name = strdup(names + symbol.name);
+    image->symbolCount++;
+  }
+
+  if (!memory)
+  {
+    image->segments = calloc(header.segmentCount + 1,
+                             sizeof(struct ImageSegment));
+  }
+  uint64_t hash = FNV_OFFSET;
+  for (int idx = 0; idx < header.segmentCount; idx++)
+  {
+    struct ContainerSegment segment;
+    memcpy(&segment, data + segmentsAt + idx * sizeof(segment),
+           sizeof(segment));
+    size_t wordBytes = segment.length * sizeof(uint16_t);
+    if (segment.origin + (uint64_t)segment.length > MEMORY_MAX)
+    {
+      return "segment outside of memory";
+    }
+    if ((uint64_t)segment.offset + segment.storedSize > size)
+    {
+      return "truncated";
+    }
+
+    uint16_t* words = memory ? memory + segment.origin : malloc(wordBytes);
+    if (!memory)
+    {
+      image->segments[image->segmentCount++] =
+        (struct ImageSegment){ segment.origin, segment.length, words };
+    }
+
+    const uint8_t* stored = data + segment.offset;
+    if (segment.flags & SEGMENT_LZ4)
+    {
+      if (!lz4Decompress(stored, segment.storedSize, (uint8_t*)words,
+                         wordBytes))
+      {
+        return "corrupt segment";
+      }
+    }
+    else if (segment.storedSize == wordBytes)
+    {
+      memcpy(words, stored, wordBytes);
+    }
+    else
+    {
+      return "corrupt segment";
+    }
+
+    if (crc32((const uint8_t*)words, wordBytes) != segment.checksum)
+    {
+      return "segment checksum mismatch";
+    }
+    hash = hashSegment(hash, segment.origin, segment.length, words);
+  }
+
+  if (hash != header.contentHash)
+  {
+    return "content hash mismatch";
+  }
+  return NULL;
+}
+
+static int compareSymbols(const void* a, const void* b)
+{
+  const struct ImageSymbol* first = a;
+  const struct ImageSymbol* second = b;
+  return first->address - second->address;
+}
+
+static int writeAll(FILE* file, const void* data, size_t size)
+{
+  return fwrite(data, 1, size, file) == size;
+}
+
+/*
+ * Writes `image` to `file` as a container, with the segments LZ4 compressed
+ * if `compress` is set (and it makes them smaller). The symbols are written
+ * in order of their addresses. Returns 0 if the file couldn't be written.
+ */
+int writeContainer(FILE* file, const struct Image* image, int compress)
+{
+  struct ContainerHeader header = { CONTAINER_MAGIC };
+  header.version = CONTAINER_VERSION;
+  header.flags = image->hasEntry ? CONTAINER_HAS_ENTRY : 0;
+  header.entry = image->entry;
+  header.segmentCount = image->segmentCount;
+  header.symbolCount = image->symbolCount;
+
+  struct ImageSymbol* symbols = malloc((image->symbolCount + 1)
+                                       * sizeof(struct ImageSymbol));
+  memcpy(symbols, image->symbols,
+         image->symbolCount * sizeof(struct ImageSymbol));
+  qsort(symbols, image->symbolCount, sizeof(struct ImageSymbol),
+        compareSymbols);
+  for (int idx = 0; idx < image->symbolCount; idx++)
+  {
+    header.namesSize += strlen(symbols[idx].name) + 1;
+  }
+
+  // Work out how every segment is stored before anything is written, as the
+  // tables come first.
+  struct ContainerSegment* segments = calloc(image->segmentCount + 1,
+                                             sizeof(struct ContainerSegment));
+  uint8_t** stored = calloc(image->segmentCount + 1, sizeof(uint8_t*));
+  uint32_t offset = sizeof(header)
+    + image->segmentCount * sizeof(struct ContainerSegment)
+    + image->symbolCount * sizeof(struct ContainerSymbol) + header.namesSize;
+  header.contentHash = FNV_OFFSET;
+
+  for (int idx = 0; idx < image->segmentCount; idx++)
+  {
+    const struct ImageSegment* segment = &image->segments[idx];
+    size_t wordBytes = segment->length * sizeof(uint16_t);
+    struct ContainerSegment* entry = &segments[idx];
+
+    entry->origin = segment->origin;
+    entry->length = segment->length;
+    entry->offset = offset;
+    entry->checksum = crc32((const uint8_t*)segment->words, wordBytes);
+    entry->storedSize = wordBytes;
+    stored[idx] = (uint8_t*)segment->words;
+    if (compress)
+    {
+      uint8_t* compressed = malloc(LZ4_BOUND(wordBytes));
+      size_t compressedSize = lz4Compress((const uint8_t*)segment->words,
+                                          wordBytes, compressed,
+                                          LZ4_BOUND(wordBytes));
+      if (compressedSize && compressedSize < wordBytes)
+      {
+        entry->flags = SEGMENT_LZ4;
+        entry->storedSize = compressedSize;
+        stored[idx] = compressed;
+      }
+      else
+      {
+        free(compressed);
+      }
+    }
+    offset += entry->storedSize;
+    header.contentHash = hashSegment(header.contentHash, segment->origin,
+                                     segment->length, segment->words);
+  }
+
+  int written = writeAll(file, &header, sizeof(header))
+    && writeAll(file, segments,
+                image->segmentCount * sizeof(struct ContainerSegment));
+  uint32_t nameOffset = 0;
+  for (int idx = 0; written && idx < image->symbolCount; idx++)
+  {
+    struct ContainerSymbol symbol = { symbols[idx].address, 0, nameOffset };
+    written = writeAll(file, &symbol, sizeof(symbol));
+    nameOffset += strlen(symbols[idx].name) + 1;
+  }
+  for (int idx = 0; written && idx < image->symbolCount; idx++)
+  {
+    written = writeAll(file, symbols[idx].name,
+                       strlen(symbols[idx].name) + 1);
+  }
+  for (int idx = 0; written && idx < image->segmentCount; idx++)
+  {
+    written = writeAll(file, stored[idx], segments[idx].storedSize);
+  }
+
+  for (int idx = 0; idx < image->segmentCount; idx++)
+  {
+    if (segments[idx].flags & SEGMENT_LZ4)
+    {
+      free(stored[idx]);
+    }
+  }
+  free(stored);
+  free(segments);
+  free(symbols);
+  return written;
+}
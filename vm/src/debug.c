@@ -0,0 +1,714 @@
+/*
+ * A stub for GDB's remote serial protocol, so a guest can be debugged from
+ * GDB (or anything else speaking the protocol) over a local TCP port or a
+ * Unix domain socket.
+ *
+ * The debugger costs nothing until it is attached. Attaching sets
+ * `memObserved`, which sends every fetch, load and store through the slow
+ * path in architecture.c where the stub gets to look at them:
+ *
+ * - Breakpoints live in a bitmap with a bit per address. When the program
+ *   counter reaches one, the fetch path hands the interpreter
+ *   BREAK_INSTRUCTION (a RES instruction) in place of the real one, and the
+ *   RES case of the dispatch calls debugBreak. Guest loads of that address
+ *   still see the real instruction.
+ * - Watchpoints are checked on loads and stores, but only when the page
+ *   bitmap says the page holds a watched address. A hit stops the guest
+ *   before the next instruction, as GDB expects.
+ * - Single steps and interrupts (Ctrl-C in GDB) also stop the guest by
+ *   handing the interpreter BREAK_INSTRUCTION on the next fetch.
+ *
+ * GDB doesn't know LC-3, so the stub describes the machine in the simplest
+ * terms: ten 16-bit little endian registers (R0 to R7, PC and COND) and a
+ * byte addressed memory where LC-3 address `a` is at bytes 2a and 2a + 1.
+ */
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "architecture.h"
+#include "idiom.h"
+#include "debug.h"
+
+int debugging = 0;
+
+// Why the guest stopped (or is about to).
+enum StopReason
+{
+  STOPPED_NONE = 0,
+  STOPPED_BREAKPOINT,
+  STOPPED_STEP,
+  STOPPED_INTERRUPT,
+  STOPPED_WATCH,
+  STOPPED_ILLEGAL
+};
+
+enum WatchKind
+{
+  WATCH_READ = 1,
+  WATCH_WRITE = 2,
+  WATCH_ACCESS = WATCH_READ | WATCH_WRITE
+};
+
+struct Watchpoint
+{
+  uint16_t first;
+  uint16_t last;
+  int kind;
+};
+
+#define MAX_WATCHPOINTS 32
+#define WATCH_PAGE_BITS 8
+#define MAX_PACKET 4096
+
+// How often (in instructions) a running guest checks for an interrupt.
+#define POLL_INTERVAL 4096
+
+// The guest being debugged.
+static struct Guest* debuggee;
+static int connection = -1;
+static int noAck;
+static int memObservedBefore;
+
+static uint8_t breakpoints[MEMORY_MAX / 8];
+static struct Watchpoint watchpoints[MAX_WATCHPOINTS];
+static int watchpointCount;
+static uint8_t watchedPages[MEMORY_MAX >> WATCH_PAGE_BITS];
+
+static int pendingStop;
+static int lastStop = STOPPED_BREAKPOINT;
+static int stepping;
+static int skipBreakpoint;
+static int untilPoll = POLL_INTERVAL;
+static uint16_t watchAddress;
+static int watchKind;
+
+static int isBreakpoint(uint16_t address)
+{
+  return breakpoints[address >> 3] & (1 << (address & 7));
+}
+
+// Rebuilds the page bitmap after the watchpoints have changed.
+static void updateWatchedPages()
+{
+  memset(watchedPages, 0, sizeof(watchedPages));
+  for (int idx = 0; idx < watchpointCount; idx++)
+  {
+    for (uint32_t page = watchpoints[idx].first >> WATCH_PAGE_BITS;
+         page <= (uint32_t)watchpoints[idx].last >> WATCH_PAGE_BITS; page++)
+    {
+      watchedPages[page] |= watchpoints[idx].kind;
+    }
+  }
+}
+
+/*
+ * The packets of the protocol are `$<data>#<checksum>`, and each one is
+ * acknowledged with `+` unless both sides have agreed to skip that.
+ */
+static int readByte()
+{
+  unsigned char c;
+  ssize_t received;
+  do
+  {
+    received = recv(connection, &c, 1, 0);
+  } while (received < 0 && errno == EINTR);
+  return received == 1 ? c : -1;
+}
+
+static void sendPacket(const char* data)
+{
+  char packet[MAX_PACKET + 4];
+  uint8_t checksum = 0;
+  size_t length = strlen(data);
+
+  for (size_t idx = 0; idx < length; idx++)
+  {
+    checksum += (uint8_t)data[idx];
+  }
+  int packetLength = snprintf(packet, sizeof(packet), "$%s#%02x", data,
+                              checksum);
+
+  do
+  {
+    send(connection, packet, packetLength, MSG_NOSIGNAL);
+  } while (!noAck && readByte() == '-');
+}
+
+// Reads the next packet into `buffer`, returning 0 if GDB has gone away.
+static int readPacket(char* buffer)
+{
+  for (;;)
+  {
+    int c = readByte();
+    if (c < 0)
+    {
+      return 0;
+    }
+    if (c != '$')
+    {
+      // Acknowledgements and interrupts while stopped mean nothing here.
+      continue;
+    }
+
+    size_t length = 0;
+    uint8_t checksum = 0;
+    while ((c = readByte()) >= 0 && c != '#')
+    {
+      if (length < MAX_PACKET - 1)
+      {
+        buffer[length++] = c;
+        checksum += c;
+      }
+    }
+    buffer[length] = '\0';
+    if (c < 0)
+    {
+      return 0;
+    }
+
+    // The checksum digits are read one at a time, into ints, so that the end
+    // of the connection is told apart from a byte wherever char is unsigned.
+    int high = readByte();
+    int low = high < 0 ? -1 : readByte();
+    if (low < 0)
+    {
+      return 0;
+    }
+    char expected[3] = { high, low, '\0' };
+    if (noAck)
+    {
+      return 1;
+    }
+    if (strtoul(expected, NULL, 16) == checksum)
+    {
+      send(connection, "+", 1, MSG_NOSIGNAL);
+      return 1;
+    }
+    send(connection, "-", 1, MSG_NOSIGNAL);
+  }
+}
+
+static void sendStop(int reason)
+{
+  char reply[64];
+  switch (reason)
+  {
+    case STOPPED_INTERRUPT:
+      strcpy(reply, "S02");
+      break;
+    case STOPPED_ILLEGAL:
+      strcpy(reply, "S04");
+      break;
+    case STOPPED_WATCH:
+      snprintf(reply, sizeof(reply), "T05%s:%x;",
+               watchKind == WATCH_WRITE ? "watch"
+               : watchKind == WATCH_READ ? "rwatch" : "awatch",
+               watchAddress * 2);
+      break;
+    default:
+      strcpy(reply, "S05");
+      break;
+  }
+  sendPacket(reply);
+}
+
+/*
+ * The PC is sent as the byte address GDB sees memory at, like everything
+ * else that holds an address, so it needs 32 bits. The other registers are
+ * 16 bits.
+ */
+static int registerBytes(int reg)
+{
+  return reg == R_PC ? 4 : 2;
+}
+
+static void appendRegister(char* buffer, int reg, uint16_t value)
+{
+  uint32_t gdbValue = reg == R_PC ? value * 2u : value;
+  for (int idx = 0; idx < registerBytes(reg); idx++)
+  {
+    sprintf(buffer + strlen(buffer), "%02x", (gdbValue >> (idx * 8)) & 0xFF);
+  }
+}
+
+/*
+ * Parses the value of register `reg` from the start of `hex` into `value`.
+ * Returns the number of characters it took up, or 0 if there aren't enough.
+ */
+static int parseRegister(const char* hex, int reg, uint16_t* value)
+{
+  int length = registerBytes(reg) * 2;
+  if ((int)strnlen(hex, length) < length)
+  {
+    return 0;
+  }
+
+  uint32_t gdbValue = 0;
+  for (int idx = 0; idx < registerBytes(reg); idx++)
+  {
+    char byte[3] = { hex[idx * 2], hex[idx * 2 + 1], '\0' };
+    gdbValue |= (uint32_t)strtoul(byte, NULL, 16) << (idx * 8);
+  }
+  *value = reg == R_PC ? gdbValue / 2 : gdbValue;
+  return length;
+}
+
+// The byte at `address` of GDB's byte addressed view of memory.
+static uint8_t readByteAt(uint32_t address)
+{
+  uint16_t word = debuggee->mem[(address >> 1) & 0xFFFF];
+  return address & 1 ? word >> 8 : word & 0xFF;
+}
+
+static void writeByteAt(uint32_t address, uint8_t value)
+{
+  uint16_t* word = &debuggee->mem[(address >> 1) & 0xFFFF];
+  *word = address & 1 ? (*word & 0x00FF) | (value << 8)
+    : (*word & 0xFF00) | value;
+}
+
+// Handles Z and z packets, returning the reply.
+static const char* changePoint(const char* packet, int insert)
+{
+  int type;
+  unsigned int address, length;
+  if (sscanf(packet + 1, "%d,%x,%x", &type, &address, &length) != 3)
+  {
+    return "E01";
+  }
+  uint16_t first = (address >> 1) & 0xFFFF;
+  uint16_t last = ((address + (length ? length : 1) - 1) >> 1) & 0xFFFF;
+
+  if (type == 0 || type == 1)
+  {
+    if (insert)
+    {
+      breakpoints[first >> 3] |= 1 << (first & 7);
+    }
+    else
+    {
+      breakpoints[first >> 3] &= ~(1 << (first & 7));
+    }
+    return "OK";
+  }
+
+  if (type < 2 || type > 4)
+  {
+    return "";
+  }
+  int kind = type == 2 ? WATCH_WRITE : type == 3 ? WATCH_READ : WATCH_ACCESS;
+  if (insert)
+  {
+    if (watchpointCount == MAX_WATCHPOINTS)
+    {
+      return "E02";
+    }
+    watchpoints[watchpointCount++] = (struct Watchpoint){ first, last, kind };
+  }
+  else
+  {
+    for (int idx = 0; idx < watchpointCount; idx++)
+    {
+      if (watchpoints[idx].first == first && watchpoints[idx].last == last
+          && watchpoints[idx].kind == kind)
+      {
+        watchpoints[idx] = watchpoints[--watchpointCount];
+        break;
+      }
+    }
+  }
+  updateWatchedPages();
+  return "OK";
+}
+
+/*
+ * Stops paying attention to the guest, e.g. when GDB detaches, so that it
+ * carries on at full speed.
+ */
+static void detach()
+{
+  close(connection);
+  connection = -1;
+  debugging = 0;
+  memObserved = memObservedBefore;
+  pendingStop = STOPPED_NONE;
+  stepping = 0;
+}
+
+/*
+ * Answers GDB's requests while the guest is stopped. Returns when GDB wants
+ * the guest to carry on (1) or has killed it (0).
+ */
+static int serveDebugger()
+{
+  uint16_t* regs = debuggee->regs;
+  char packet[MAX_PACKET];
+  char reply[MAX_PACKET];
+
+  while (readPacket(packet))
+  {
+    reply[0] = '\0';
+    switch (packet[0])
+    {
+      case '?':
+        sendStop(lastStop);
+        continue;
+      case 'g':
+        for (int reg = 0; reg < R_MAX; reg++)
+        {
+          appendRegister(reply, reg, regs[reg]);
+        }
+        break;
+      case 'G':
+      {
+        const char* hex = packet + 1;
+        for (int reg = 0; reg < R_MAX; reg++)
+        {
+          int used = parseRegister(hex, reg, &regs[reg]);
+          if (!used)
+          {
+            break;
+          }
+          hex += used;
+        }
+        strcpy(reply, "OK");
+        break;
+      }
+      case 'p':
+      {
+        unsigned int reg = strtoul(packet + 1, NULL, 16);
+        if (reg < R_MAX)
+        {
+          appendRegister(reply, reg, regs[reg]);
+        }
+        else
+        {
+          strcpy(reply, "E01");
+        }
+        break;
+      }
+      case 'P':
+      {
+        char* value;
+        unsigned int reg = strtoul(packet + 1, &value, 16);
+        if (reg < R_MAX && *value == '='
+            && parseRegister(value + 1, reg, &regs[reg]))
+        {
+          strcpy(reply, "OK");
+        }
+        else
+        {
+          strcpy(reply, "E01");
+        }
+        break;
+      }
+      case 'm':
+      {
+        unsigned int address, length;
+        if (sscanf(packet + 1, "%x,%x", &address, &length) != 2
+            || length > MAX_PACKET / 2 - 1)
+        {
+          strcpy(reply, "E01");
+          break;
+        }
+        for (unsigned int idx = 0; idx < length; idx++)
+        {
+          sprintf(reply + idx * 2, "%02x", readByteAt(address + idx));
+        }
+        break;
+      }
+      case 'M':
+      {
+        unsigned int address, length;
+        char* data = strchr(packet, ':');
+        if (sscanf(packet + 1, "%x,%x", &address, &length) != 2 || !data
+            || strlen(data + 1) < length * 2)
+        {
+          strcpy(reply, "E01");
+          break;
+        }
+        for (unsigned int idx = 0; idx < length; idx++)
+        {
+          char byte[3] = { data[1 + idx * 2], data[2 + idx * 2], '\0' };
+          writeByteAt(address + idx, strtoul(byte, NULL, 16));
+        }
+        strcpy(reply, "OK");
+        break;
+      }
+      case 'Z':
+      case 'z':
+        strcpy(reply, changePoint(packet, packet[0] == 'Z'));
+        break;
+      case 's':
+      case 'c':
+        if (packet[1])
+        {
+          regs[R_PC] = (strtoul(packet + 1, NULL, 16) >> 1) & 0xFFFF;
+        }
+        stepping = packet[0] == 's';
+        skipBreakpoint = 1;
+        return 1;
+      case 'D':
+        sendPacket("OK");
+        detach();
+        return 1;
+      case 'k':
+        detach();
+        return 0;
+      case 'H':
+      case 'T':
+        strcpy(reply, "OK");
+        break;
+      case 'q':
+        if (strncmp(packet, "qSupported", 10) == 0)
+        {
+          snprintf(reply, sizeof(reply),
+                   "PacketSize=%x;QStartNoAckMode+", MAX_PACKET - 8);
+        }
+        else if (strcmp(packet, "qAttached") == 0)
+        {
+          strcpy(reply, "1");
+        }
+        else if (strcmp(packet, "qfThreadInfo") == 0)
+        {
+          strcpy(reply, "m1");
+        }
+        else if (strcmp(packet, "qsThreadInfo") == 0)
+        {
+          strcpy(reply, "l");
+        }
+        else if (strcmp(packet, "qC") == 0)
+        {
+          strcpy(reply, "QC1");
+        }
+        break;
+      case 'Q':
+        if (strcmp(packet, "QStartNoAckMode") == 0)
+        {
+          sendPacket("OK");
+          noAck = 1;
+          continue;
+        }
+        break;
+    }
+    sendPacket(reply);
+  }
+
+  // GDB went away without detaching, so let the guest carry on alone.
+  detach();
+  return 1;
+}
+
+// Closes `fd` after a call on it failed, keeping the error from that call.
+static int closeFailed(int fd)
+{
+  int error = errno;
+  close(fd);
+  errno = error;
+  return -1;
+}
+
+// Opens `address`, a TCP port on the loopback interface or a socket path.
+static int listenForDebugger(const char* address)
+{
+  int fd;
+  if (strchr(address, '/'))
+  {
+    struct sockaddr_un unixAddress = { .sun_family = AF_UNIX };
+    if (strlen(address) >= sizeof(unixAddress.sun_path))
+    {
+      fprintf(stderr, "Socket path is too long: %s\n", address);
+      return -1;
+    }
+    strcpy(unixAddress.sun_path, address);
+
+    // Only a socket left behind by an earlier run is replaced.
+    struct stat existing;
+    if (lstat(address, &existing) == 0 && S_ISSOCK(existing.st_mode))
+    {
+      unlink(address);
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && bind(fd, (struct sockaddr*)&unixAddress,
+                        sizeof(unixAddress)) < 0)
+    {
+      fd = closeFailed(fd);
+    }
+  }
+  else
+  {
+    struct sockaddr_in tcpAddress = {
+      .sin_family = AF_INET,
+      .sin_port = htons(atoi(address)),
+      .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+    };
+    int reuse = 1;
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd >= 0
+        && (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse,
+                       sizeof(reuse)) < 0
+            || bind(fd, (struct sockaddr*)&tcpAddress,
+                    sizeof(tcpAddress)) < 0))
+    {
+      fd = closeFailed(fd);
+    }
+  }
+
+  if (fd >= 0 && listen(fd, 1) < 0)
+  {
+    fd = closeFailed(fd);
+  }
+  if (fd < 0)
+  {
+    fprintf(stderr, "Failed to listen on %s: %s\n", address, strerror(errno));
+  }
+  return fd;
+}
+
+/*
+ * Waits for GDB to connect and serves it with `guest` stopped before its
+ * first instruction. Returns 0 if the guest shouldn't run (the socket
+ * couldn't be opened or GDB killed it).
+ */
+int startDebugger(struct Guest* guest, const char* address)
+{
+  int listenFd = listenForDebugger(address);
+  if (listenFd < 0)
+  {
+    return 0;
+  }
+  fprintf(stderr, "Waiting for a debugger on %s\n", address);
+  connection = accept(listenFd, NULL, NULL);
+  close(listenFd);
+  if (connection < 0)
+  {
+    fprintf(stderr, "Failed to accept debugger: %s\n", strerror(errno));
+    return 0;
+  }
+  int noDelay = 1;
+  setsockopt(connection, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+  // Loops run natively by the idiom recogniser would skip breakpoints and
+  // single steps inside them.
+  guest->idioms.enabled = 0;
+  debuggee = guest;
+  debugging = 1;
+  memObservedBefore = memObserved;
+  memObserved = 1;
+  return serveDebugger();
+}
+
+/*
+ * Checks for an interrupt from GDB while the guest runs, without waiting.
+ */
+static void pollDebugger()
+{
+  unsigned char c;
+  ssize_t received = recv(connection, &c, 1, MSG_DONTWAIT);
+  if (received == 1 && c == 0x03)
+  {
+    pendingStop = STOPPED_INTERRUPT;
+  }
+  else if (received == 0)
+  {
+    detach();
+  }
+}
+
+/*
+ * Called for every fetch while debugging. Returns whether the interpreter
+ * should be handed BREAK_INSTRUCTION instead of the instruction at `address`.
+ */
+int debugFetch(uint16_t address)
+{
+  if (pendingStop)
+  {
+    return 1;
+  }
+  if (stepping)
+  {
+    // Run this one instruction and stop before the next.
+    stepping = 0;
+    skipBreakpoint = 0;
+    pendingStop = STOPPED_STEP;
+    return 0;
+  }
+  if (skipBreakpoint)
+  {
+    // The guest is carrying on from where it stopped, maybe a breakpoint.
+    skipBreakpoint = 0;
+    return 0;
+  }
+  if (--untilPoll == 0)
+  {
+    untilPoll = POLL_INTERVAL;
+    pollDebugger();
+    if (pendingStop)
+    {
+      return 1;
+    }
+  }
+  return isBreakpoint(address);
+}
+
+/*
+ * Called for every load and store while debugging, to check the watchpoints.
+ * Most accesses are to pages without any, so those are ruled out first.
+ */
+void debugAccess(uint16_t address, enum MemAccess access)
+{
+  int kind = access == ACCESS_WRITE ? WATCH_WRITE : WATCH_READ;
+  if (!(watchedPages[address >> WATCH_PAGE_BITS] & kind))
+  {
+    return;
+  }
+  for (int idx = 0; idx < watchpointCount; idx++)
+  {
+    if (address >= watchpoints[idx].first && address <= watchpoints[idx].last
+        && (watchpoints[idx].kind & kind))
+    {
+      pendingStop = STOPPED_WATCH;
+      watchAddress = address;
+      watchKind = watchpoints[idx].kind;
+      return;
+    }
+  }
+}
+
+/*
+ * Called when the interpreter executes BREAK_INSTRUCTION while debugging.
+ * The program counter is moved back onto the instruction that was replaced,
+ * GDB is told why the guest stopped and then gets to look around.
+ *
+ * It returns whether the VM is still running afterwards.
+ */
+int debugBreak(struct Guest* guest)
+{
+  uint16_t address = --guest->regs[R_PC];
+  int reason = pendingStop;
+  pendingStop = STOPPED_NONE;
+  if (reason == STOPPED_NONE)
+  {
+    // Either a breakpoint, or a RES instruction in the guest itself.
+    reason = isBreakpoint(address) ? STOPPED_BREAKPOINT : STOPPED_ILLEGAL;
+  }
+
+  lastStop = reason;
+  sendStop(reason);
+  return serveDebugger();
+}
+
+// Tells GDB the guest has halted.
+void stopDebugger()
+{
+  if (debugging)
+  {
+    sendPacket("W00");
+    detach();
+  }
+}
@@ -0,0 +1,125 @@
+/*
+ * Turns instructions back into the assembly they came from, using the same
+ * syntax as the LC-3 assembler. PC relative operands are shown as the address
+ * they refer to, which is why the address of the instruction is needed.
+ */
+#include "architecture.h"
+#include "instruction.h"
+#include "disassemble.h"
+
+static const char* trapName(uint16_t vector)
+{
+  switch (vector)
+  {
+    case TRAP_GETC:
+      return "GETC";
+    case TRAP_OUT:
+      return "OUT";
+    case TRAP_PUTS:
+      return "PUTS";
+    case TRAP_IN:
+      return "IN";
+    case TRAP_PUTSP:
+      return "PUTSP";
+    case TRAP_HALT:
+      return "HALT";
+  }
+  return NULL;
+}
+
+void disassembleInstruction(uint16_t address, uint16_t instruction,
+                            char* text, size_t size)
+{
+  uint16_t dr = extractRegister(instruction, 9);
+  uint16_t sr1 = extractRegister(instruction, 6);
+  // The address a PCoffset9 operand refers to.
+  uint16_t target = address + 1 + signExtendPcOffset(instruction);
+  int offset6 = (int16_t)signExtend(instruction & 0x3F, 6);
+
+  switch (instruction >> 12)
+  {
+    case OP_ADD:
+    case OP_AND:
+    {
+      const char* name = (instruction >> 12) == OP_ADD ? "ADD" : "AND";
+      if (extractBit(instruction, 5))
+      {
+        snprintf(text, size, "%s R%d, R%d, #%d", name, dr, sr1,
+                 (int16_t)signExtend(instruction & 0x1F, 5));
+      }
+      else
+      {
+        snprintf(text, size, "%s R%d, R%d, R%d", name, dr, sr1,
+                 extractRegister(instruction, 0));
+      }
+      break;
+    }
+    case OP_NOT:
+      snprintf(text, size, "NOT R%d, R%d", dr, sr1);
+      break;
+    case OP_BR:
+      if (((instruction >> 9) & 0x7) == 0)
+      {
+        snprintf(text, size, "NOP");
+        break;
+      }
+      snprintf(text, size, "BR%s%s%s x%04X",
+               extractBit(instruction, 11) ? "n" : "",
+               extractBit(instruction, 10) ? "z" : "",
+               extractBit(instruction, 9) ? "p" : "", target);
+      break;
+    case OP_JMP:
+      if (sr1 == R_7)
+      {
+        snprintf(text, size, "RET");
+        break;
+      }
+      snprintf(text, size, "JMP R%d", sr1);
+      break;
+    case OP_JSR:
+      if (extractBit(instruction, 11))
+      {
+        snprintf(text, size, "JSR x%04X",
+                 (uint16_t)(address + 1 + signExtend(instruction & 0x7FF, 11)));
+        break;
+      }
+      snprintf(text, size, "JSRR R%d", sr1);
+      break;
+    case OP_LD:
+      snprintf(text, size, "LD R%d, x%04X", dr, target);
+      break;
+    case OP_LDI:
+      snprintf(text, size, "LDI R%d, x%04X", dr, target);
+      break;
+    case OP_LDR:
+      snprintf(text, size, "LDR R%d, R%d, #%d", dr, sr1, offset6);
+      break;
+    case OP_LEA:
+      snprintf(text, size, "LEA R%d, x%04X", dr, target);
+      break;
+    case OP_ST:
+      snprintf(text, size, "ST R%d, x%04X", dr, target);
+      break;
+    case OP_STI:
+      snprintf(text, size, "STI R%d, x%04X", dr, target);
+      break;
+    case OP_STR:
+      snprintf(text, size, "STR R%d, R%d, #%d", dr, sr1, offset6);
+      break;
+    case OP_TRAP:
+      if (trapName(instruction & 0xFF))
+      {
+        snprintf(text, size, "%s", trapName(instruction & 0xFF));
+        break;
+      }
+      snprintf(text, size, "TRAP x%02X", instruction & 0xFF);
+      break;
+    case OP_RTI:
+      snprintf(text, size, "RTI");
+      break;
+    default:
+      // The reserved opcode has no assembly, so it can only be data.
+      snprintf(text, size, ".FILL x%04X", instruction);
+      break;
+  }
+}
@@ -0,0 +1,604 @@
+/*
+ * Searches the inputs of a guest, e.g. for the best sequence of moves in a
+ * game, by running every candidate input from every state worth exploring.
+ *
+ * The guest first runs until it asks for input. From then on the search goes
+ * a depth at a time: every state of the previous depth (the frontier) is
+ * restored on a worker thread, given each candidate input in turn and run
+ * until it asks for input again. The state it is left in is saved as a
+ * snapshot that shares every unchanged page of memory with the state it
+ * came from (see snapshot.c), so a state costs about as much memory as the
+ * pages the input touched. The workers watch their guest's memory for
+ * writes (see codewatch.c), so only the few pages branches write are looked
+ * at when taking a snapshot and put back before the next one, rather than
+ * all of memory.
+ *
+ * A state that has been seen before (e.g. after an input the guest ignored)
+ * is dropped. States are looked up by the hash of their memory and
+ * registers, but only dropped once their contents have been compared, so
+ * every state is kept until the search ends. The rest are scored by a
+ * callback over guest memory and the best scoring `beam` of them become the
+ * next frontier. The best state is the best scoring one, and the deepest of
+ * those, so without a score it is one that took every input it was given.
+ */
+#include <pthread.h>
+#include <time.h>
+
+#include "architecture.h"
+#include "interpreter.h"
+#include "idiom.h"
+#include "image.h"
+#include "codewatch.h"
+#include "snapshot.h"
+#include "explore.h"
+
+// How a branch of the search ended.
+enum BranchStop
+{
+  BRANCH_WAITING = 0,   // the guest asked for more input
+  BRANCH_HALTED,
+  BRANCH_INVALID,       // it executed RTI or the reserved opcode
+  BRANCH_BUDGET         // it ran EXPLORE_BRANCH_BUDGET instructions
+};
+
+// A state reached by the search.
+struct Node
+{
+  struct Node* parent;
+  // Owned by the table of states seen.
+  struct Snapshot* snapshot;
+  int input;
+  int depth;
+  int stop;
+  // Where the state came in its depth, to break ties between scores.
+  int order;
+  double score;
+};
+
+// The keyboard of a worker, which holds a single input.
+struct Keyboard
+{
+  // First, so that the console callbacks can get at the keyboard.
+  struct Console console;
+  const char* input;
+  size_t inputPos;
+};
+
+// What a worker thread knows about the memory of its guest.
+struct Worker
+{
+  struct Keyboard keyboard;
+  struct Guest* guest;
+  // Whether writes to the guest's memory are being watched.
+  int watching;
+  // The snapshot the guest was last restored from, and the pages that may
+  // have been written since (all of them if they aren't watched).
+  const struct Snapshot* restored;
+  uint32_t written;
+};
+
+// The work of a single depth, shared by the worker threads.
+struct Level
+{
+  const struct ExploreOptions* options;
+  struct Node** frontier;
+  int jobCount;
+  int next;
+  struct Node** children;
+};
+
+static char* inputs[MAX_EXPLORE_INPUTS];
+static int inputCount;
+
+// Whether the workers use idioms, as set for the thread starting the search.
+static int workerIdioms;
+
+// Every state seen so far, an open addressing hash table on the hashes of
+// their snapshots.
+static struct Snapshot** seen;
+static uint64_t seenCapacity;
+static uint64_t seenCount;
+static pthread_mutex_t seenLock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t duplicates;
+
+// A built in score over a range of memory, see parseExploreScore.
+enum RangeScoreKind
+{
+  SCORE_SUM = 0,
+  SCORE_MAX,
+  SCORE_ZEROS
+};
+
+struct RangeScore
+{
+  int kind;
+  uint16_t address;
+  uint32_t count;
+};
+
+static struct RangeScore rangeScore;
+
+static int keyboardGetChar(struct Console* console)
+{
+  struct Keyboard* keyboard = (struct Keyboard*)console;
+  if (keyboard->input[keyboard->inputPos])
+  {
+    return (unsigned char)keyboard->input[keyboard->inputPos++];
+  }
+  console->stopped = STOP_INPUT;
+  return EOF;
+}
+
+static int keyboardKeyReady(struct Console* console)
+{
+  struct Keyboard* keyboard = (struct Keyboard*)console;
+  if (keyboard->input[keyboard->inputPos])
+  {
+    return 1;
+  }
+  console->stopped = STOP_INPUT;
+  return 0;
+}
+
+// What the guest prints while exploring is of no interest.
+static void keyboardPutChar(struct Console* console, char c)
+{
+}
+
+static void keyboardFlush(struct Console* console)
+{
+}
+
+/*
+ * Runs `guest` until it asks for more input than its keyboard holds, halts or
+ * runs out of budget.
+ *
+ * The instruction that asked for input has already started (e.g. a GETC has
+ * set R7 and the program counter has moved on), so the registers are put
+ * back as they were before it. Run again with more input the guest then
+ * carries on as if it had been waiting for it all along.
+ */
+static int runUntilInput(struct Guest* guest)
+{
+  uint16_t before[R_MAX];
+  for (uint64_t count = 0; count < EXPLORE_BRANCH_BUDGET; count++)
+  {
+    memcpy(before, guest->regs, sizeof(before));
+    int running = executeInstruction(guest,
+                                     memFetch(guest, guest->regs[R_PC]++));
+    if (guest->console->stopped == STOP_INPUT)
+    {
+      memcpy(guest->regs, before, sizeof(before));
+      return BRANCH_WAITING;
+    }
+    if (guest->console->stopped == STOP_INVALID_OPCODE)
+    {
+      return BRANCH_INVALID;
+    }
+    if (!running)
+    {
+      return BRANCH_HALTED;
+    }
+  }
+  return BRANCH_BUDGET;
+}
+
+/*
+ * Remembers the state in `snapshot`, which the table takes over. Returns 0
+ * if the same state has been seen before, in which case the snapshot is
+ * freed.
+ */
+static int addState(struct Snapshot* snapshot)
+{
+  pthread_mutex_lock(&seenLock);
+  if (seenCount * 2 >= seenCapacity)
+  {
+    struct Snapshot** old = seen;
+    uint64_t oldCapacity = seenCapacity;
+    seenCapacity = seenCapacity ? seenCapacity * 2 : 1 << 16;
+    seen = calloc(seenCapacity, sizeof(struct Snapshot*));
+    for (uint64_t idx = 0; idx < oldCapacity; idx++)
+    {
+      if (old[idx])
+      {
+        uint64_t slot = old[idx]->hash & (seenCapacity - 1);
+        while (seen[slot])
+        {
+          slot = (slot + 1) & (seenCapacity - 1);
+        }
+        seen[slot] = old[idx];
+      }
+    }
+    free(old);
+  }
+
+  // Different states can share a hash, so every state with the same one is
+  // compared.
+  uint64_t slot = snapshot->hash & (seenCapacity - 1);
+  while (seen[slot] && (seen[slot]->hash != snapshot->hash
+                        || !sameSnapshot(seen[slot], snapshot)))
+  {
+    slot = (slot + 1) & (seenCapacity - 1);
+  }
+  int added = !seen[slot];
+  if (added)
+  {
+    seen[slot] = snapshot;
+    seenCount++;
+  }
+  pthread_mutex_unlock(&seenLock);
+  if (!added)
+  {
+    freeSnapshot(snapshot);
+  }
+  return added;
+}
+
+// Frees every state seen.
+static void forgetStates()
+{
+  for (uint64_t idx = 0; idx < seenCapacity; idx++)
+  {
+    freeSnapshot(seen[idx]);
+  }
+  free(seen);
+  seen = NULL;
+  seenCapacity = 0;
+  seenCount = 0;
+}
+
+/*
+ * Gives the guest in `parent`'s state input number `input` and runs it until
+ * it stops again. Returns the state it ends up in, or NULL if that has been
+ * seen before.
+ */
+static struct Node* runBranch(struct Level* level, struct Worker* worker,
+                              struct Node* parent, int input, int order)
+{
+  struct Guest* guest = worker->guest;
+  restoreSnapshot(guest, parent->snapshot, worker->restored, worker->written);
+  if (!worker->restored && worker->watching)
+  {
+    worker->watching = watchAllPages();
+    worker->written = worker->watching ? 0 : ~0u;
+  }
+  worker->restored = parent->snapshot;
+
+  worker->keyboard.input = inputs[input];
+  worker->keyboard.inputPos = 0;
+  worker->keyboard.console.stopped = STOP_NONE;
+  int stop = runUntilInput(guest);
+
+  // A page that has been written is left writable and counts as written by
+  // every branch from then on. Copying and comparing it is cheaper than a
+  // fault on every branch that writes it again, and most pages are never
+  // written at all.
+  worker->written |= takeDirtyPages();
+  struct Snapshot* snapshot = takeSnapshot(guest, parent->snapshot,
+                                           worker->written);
+  if (!addState(snapshot))
+  {
+    __atomic_add_fetch(&duplicates, 1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+
+  struct Node* node = calloc(1, sizeof(struct Node));
+  node->parent = parent;
+  node->snapshot = snapshot;
+  node->input = input;
+  node->depth = parent->depth + 1;
+  node->stop = stop;
+  node->order = order;
+  if (level->options->score)
+  {
+    node->score = level->options->score(guest->mem, guest->regs,
+                                        level->options->scoreContext);
+  }
+  return node;
+}
+
+static void* runWorker(void* argument)
+{
+  struct Level* level = argument;
+  struct Worker worker = {
+    { { keyboardGetChar, keyboardKeyReady, keyboardPutChar, keyboardFlush,
+        STOP_NONE } },
+    newGuest()
+  };
+  struct Guest* guest = worker.guest;
+  if (!guest)
+  {
+    printf("Failed to allocate a guest for a worker\n");
+    exit(1);
+  }
+  guest->idioms.enabled = workerIdioms;
+  guest->console = &worker.keyboard.console;
+  // Without watching, every page may have been written between branches.
+  worker.watching = startWatching(guest);
+  worker.written = ~0u;
+  for (;;)
+  {
+    int job = __atomic_fetch_add(&level->next, 1, __ATOMIC_RELAXED);
+    if (job >= level->jobCount)
+    {
+      break;
+    }
+    level->children[job] = runBranch(level, &worker,
+                                     level->frontier[job / inputCount],
+                                     job % inputCount, job);
+  }
+  stopWatching();
+  free(guest);
+  return NULL;
+}
+
+// Best scores first, and in the order the inputs were given for equal ones.
+static int compareNodes(const void* a, const void* b)
+{
+  const struct Node* first = *(struct Node* const*)a;
+  const struct Node* second = *(struct Node* const*)b;
+  if (first->score != second->score)
+  {
+    return first->score > second->score ? -1 : 1;
+  }
+  return first->order - second->order;
+}
+
+static double elapsedSince(const struct timespec* start)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void printPath(const struct Node* node)
+{
+  const struct Node* path[node->depth + 1];
+  int length = 0;
+  for (; node->parent; node = node->parent)
+  {
+    path[length++] = node;
+  }
+  for (int idx = length - 1; idx >= 0; idx--)
+  {
+    printf("%s%s", inputs[path[idx]->input], idx ? "," : "\n");
+  }
+  if (!length)
+  {
+    printf("(no input)\n");
+  }
+}
+
+static int splitInputs(const char* inputList)
+{
+  char* list = strdup(inputList);
+  inputCount = 0;
+  for (char* input = strtok(list, ","); input; input = strtok(NULL, ","))
+  {
+    if (inputCount == MAX_EXPLORE_INPUTS)
+    {
+      printf("At most %d inputs can be explored\n", MAX_EXPLORE_INPUTS);
+      return 0;
+    }
+    inputs[inputCount++] = input;
+  }
+  if (!inputCount)
+  {
+    printf("There must be at least one input to explore\n");
+    return 0;
+  }
+  return 1;
+}
+
+/*
+ * Runs the search described by `options`, starting from the images that have
+ * already been read into the main guest, and prints the best scoring inputs
+ * found.
+ * Returns 0 if the search couldn't be run.
+ */
+int runExploration(const struct ExploreOptions* options)
+{
+  if (!splitInputs(options->inputs))
+  {
+    return 0;
+  }
+  struct Guest* guest = &mainGuest;
+  workerIdioms = guest->idioms.enabled;
+
+  // The guest starts the same way it would from the command line, and is
+  // given the prefix to get it to where the search should start.
+  struct Keyboard keyboard = {
+    { keyboardGetChar, keyboardKeyReady, keyboardPutChar, keyboardFlush,
+      STOP_NONE },
+    options->prefix ? options->prefix : ""
+  };
+  guest->regs[R_COND] = FL_ZRO;
+  guest->regs[R_PC] = entryPoint;
+  guest->console = &keyboard.console;
+  int stop = runUntilInput(guest);
+  guest->console = NULL;
+  if (stop != BRANCH_WAITING)
+  {
+    printf("The guest never asked for input to explore\n");
+    return 0;
+  }
+
+  struct Node* root = calloc(1, sizeof(struct Node));
+  root->snapshot = takeSnapshot(guest, NULL, ~0u);
+  root->score = options->score
+    ? options->score(guest->mem, guest->regs, options->scoreContext) : 0;
+  addState(root->snapshot);
+
+  struct Node* best = root;
+  struct Node** frontier = malloc(sizeof(struct Node*));
+  frontier[0] = root;
+  int frontierCount = 1;
+  struct Node** nodes = NULL;
+  uint64_t nodeCount = 0;
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  for (int depth = 1; depth <= options->depth && frontierCount; depth++)
+  {
+    struct Level level = { options, frontier, frontierCount * inputCount };
+    level.children = calloc(level.jobCount, sizeof(struct Node*));
+    uint64_t duplicatesBefore = duplicates;
+
+    pthread_t workers[options->workerCount];
+    for (int idx = 0; idx < options->workerCount; idx++)
+    {
+      int error = pthread_create(&workers[idx], NULL, runWorker, &level);
+      if (error)
+      {
+        printf("Failed to start worker: %s\n", strerror(error));
+        exit(1);
+      }
+    }
+    for (int idx = 0; idx < options->workerCount; idx++)
+    {
+      pthread_join(workers[idx], NULL);
+    }
+
+    // Keep the new states together, best first.
+    int childCount = 0;
+    for (int job = 0; job < level.jobCount; job++)
+    {
+      if (level.children[job])
+      {
+        level.children[childCount++] = level.children[job];
+      }
+    }
+    qsort(level.children, childCount, sizeof(struct Node*), compareNodes);
+    nodes = realloc(nodes, (nodeCount + childCount) * sizeof(struct Node*));
+    memcpy(nodes + nodeCount, level.children,
+           childCount * sizeof(struct Node*));
+    nodeCount += childCount;
+
+    // A deeper state is better than an equally good shallower one.
+    if (childCount && level.children[0]->score >= best->score)
+    {
+      best = level.children[0];
+    }
+
+    // Only the best states the guest can be given more input in are searched
+    // further.
+    frontierCount = 0;
+    frontier = realloc(frontier, (childCount + 1) * sizeof(struct Node*));
+    for (int idx = 0; idx < childCount; idx++)
+    {
+      struct Node* child = level.children[idx];
+      if (child->stop == BRANCH_WAITING && frontierCount < options->beam)
+      {
+        frontier[frontierCount++] = child;
+      }
+    }
+
+    printf("Depth %d: %d new states, %llu duplicates, %d kept, best score "
+           "%g\n", depth, childCount,
+           (unsigned long long)(duplicates - duplicatesBefore), frontierCount,
+           childCount ? level.children[0]->score : 0.0);
+    free(level.children);
+  }
+
+  double seconds = elapsedSince(&start);
+  printf("Explored %llu states in %.2f s (%.0f states/s on %d workers), "
+         "dropped %llu duplicates\n", (unsigned long long)nodeCount, seconds,
+         (nodeCount + duplicates) / seconds, options->workerCount,
+         (unsigned long long)duplicates);
+  uint64_t pages = snapshotPagesInUse();
+  printf("%llu pages (%llu KiB) held %llu states, %.1f%% of copying all of "
+         "memory\n", (unsigned long long)pages,
+         (unsigned long long)pages * sizeof(struct SnapshotPage) / 1024,
+         (unsigned long long)nodeCount + 1,
+         100.0 * pages / ((nodeCount + 1) * SNAPSHOT_PAGES));
+  printf("Best score %g after %d inputs%s: ", best->score, best->depth,
+         best->stop == BRANCH_HALTED ? " (the guest halted)" : "");
+  printPath(best);
+
+  for (uint64_t idx = 0; idx < nodeCount; idx++)
+  {
+    free(nodes[idx]);
+  }
+  forgetStates();
+  free(root);
+  free(nodes);
+  free(frontier);
+  return 1;
+}
+
+static double scoreRange(const uint16_t* memory, const uint16_t* regs,
+                         void* context)
+{
+  const struct RangeScore* range = context;
+  double score = 0;
+  for (uint32_t idx = 0; idx < range->count; idx++)
+  {
+    uint16_t word = memory[(uint16_t)(range->address + idx)];
+    switch (range->kind)
+    {
+      case SCORE_SUM:
+        score += word;
+        break;
+      case SCORE_MAX:
+        score = word > score ? word : score;
+        break;
+      case SCORE_ZEROS:
+        score += word == 0;
+        break;
+    }
+  }
+  return score;
+}
+
+/*
+ * Sets `options` up to score states with one of the built in scores, given
+ * as `<sum|max|zeros>:<address>[:<count>]`. These add up, take the largest or
+ * count the zero words of `count` (by default 1) words starting at `address`
+ * (e.g. x3018 or 0x3018).
+ */
+int parseExploreScore(const char* spec, struct ExploreOptions* options)
+{
+  const char* kinds[] = { "sum:", "max:", "zeros:" };
+  int kind = -1;
+  for (int idx = 0; idx < 3; idx++)
+  {
+    if (strncmp(spec, kinds[idx], strlen(kinds[idx])) == 0)
+    {
+      kind = idx;
+      spec += strlen(kinds[idx]);
+    }
+  }
+  if (kind < 0)
+  {
+    return 0;
+  }
+
+  char* end;
+  int hex = spec[0] == 'x' || spec[0] == 'X';
+  unsigned long address = strtoul(spec + hex, &end, hex ? 16 : 0);
+  unsigned long count = 1;
+  if (end == spec + hex || address >= MEMORY_MAX)
+  {
+    return 0;
+  }
+  if (*end == ':')
+  {
+    spec = end + 1;
+    count = strtoul(spec, &end, 0);
+    if (end == spec || count == 0 || count > MEMORY_MAX)
+    {
+      return 0;
+    }
+  }
+  if (*end)
+  {
+    return 0;
+  }
+
+  rangeScore = (struct RangeScore){ kind, address, count };
+  options->score = scoreRange;
+  options->scoreContext = &rangeScore;
+  return 1;
+}
@@ -0,0 +1,215 @@
+/*
+ * In-process fuzzing of a guest's input handling (see tools/lc3-fuzz.c for
+ * the libFuzzer entry point).
+ *
+ * Every input is the whole of the guest's keyboard: it is what GETC and IN
+ * read and what the keyboard status register reports, and the guest is
+ * stopped once it wants more. The coverage is the guest's own control flow,
+ * every branch, jump and subroutine call counts its edge in `fuzzEdges`,
+ * which libFuzzer picks up as extra counters. Only the interpreter loop the
+ * fuzzer runs inputs with (runInterpreterCovered) counts them. The VM's own code isn't
+ * instrumented, as its coverage says nothing about the guest.
+ *
+ * Starting every input from a fresh VM would mean copying all of memory each
+ * time, so instead every page of memory is watched for writes (see
+ * codewatch.c) and only the pages written are copied back before the next
+ * input. Stores themselves don't pay anything for this. Nor is the guest run from its entry
+ * point every time: whatever it does before it first looks at the keyboard
+ * can't depend on the input, so that is only run once.
+ */
+#include "architecture.h"
+#include "image.h"
+#include "instruction.h"
+#include "interpreter.h"
+#include "clock.h"
+#include "codewatch.h"
+#include "fuzz.h"
+
+// libFuzzer looks for counters in this section on top of the ones the
+// compiler adds, elsewhere it is just another array.
+__attribute__((section("__libfuzzer_extra_counters")))
+uint8_t fuzzEdges[FUZZ_EDGES];
+
+// The keyboard of the guest being fuzzed, its output goes nowhere.
+struct FuzzConsole
+{
+  struct Console console;
+  const uint8_t* data;
+  size_t size;
+  size_t position;
+};
+
+static struct FuzzConsole fuzzConsole;
+static uint64_t fuzzBudget;
+
+// The guest is the main one, as the images are read into it.
+static struct Guest* const guest = &mainGuest;
+
+// Memory, registers and time as the images left them, before any input.
+static uint16_t pristine[MEMORY_MAX];
+static uint16_t pristineRegs[R_MAX];
+static struct GuestClock pristineClock;
+
+// Whether every page of memory is being watched for writes, so that only
+// the pages written have to be put back. If not, all of memory is.
+static int watchingPages;
+
+static int fuzzGetChar(struct Console* console)
+{
+  struct FuzzConsole* fuzz = (struct FuzzConsole*)console;
+  if (fuzz->position < fuzz->size)
+  {
+    return fuzz->data[fuzz->position++];
+  }
+  console->stopped = STOP_INPUT;
+  return EOF;
+}
+
+// A guest polling the keyboard after the whole input has been read would
+// otherwise spin until its budget runs out.
+static int fuzzKeyReady(struct Console* console)
+{
+  struct FuzzConsole* fuzz = (struct FuzzConsole*)console;
+  if (fuzz->position < fuzz->size)
+  {
+    return 1;
+  }
+  console->stopped = STOP_INPUT;
+  return 0;
+}
+
+static void fuzzPutChar(struct Console* console, char c)
+{
+}
+
+static void fuzzFlush(struct Console* console)
+{
+}
+
+/*
+ * Puts every page written since the last input back the way it was before
+ * the first one, and watches them again. That includes the keyboard
+ * registers, which polling the keyboard writes without going through a
+ * store.
+ */
+static void restoreMemory()
+{
+  if (!watchingPages)
+  {
+    memcpy(guest->mem, pristine, sizeof(pristine));
+    return;
+  }
+
+  uint32_t pages = takeDirtyPages();
+  while (pages)
+  {
+    uint32_t start = __builtin_ctz(pages) * WATCH_PAGE_WORDS;
+    memcpy(guest->mem + start, pristine + start,
+           WATCH_PAGE_WORDS * sizeof(uint16_t));
+    pages &= pages - 1;
+  }
+  watchingPages = watchAllPages();
+}
+
+/*
+ * Runs the guest with an empty keyboard until it first looks at it, and puts
+ * the registers back as they were before the instruction that did (the same
+ * way as runUntilInput in explore.c). Returns 0 if the guest never looks at
+ * the keyboard, i.e. it halts or runs out of budget first.
+ */
+static int runToFirstInput()
+{
+  uint16_t before[R_MAX];
+  int waiting = 0;
+  fuzzConsole.console.stopped = STOP_NONE;
+  fuzzConsole.size = 0;
+  fuzzConsole.position = 0;
+
+  guest->console = &fuzzConsole.console;
+  for (uint64_t count = 0; count < fuzzBudget; count++)
+  {
+    memcpy(before, guest->regs, sizeof(before));
+    int running = executeInstruction(guest,
+                                     memFetch(guest, guest->regs[R_PC]++));
+    guest->clock.instructions++;
+    if (fuzzConsole.console.stopped == STOP_INPUT)
+    {
+      memcpy(guest->regs, before, sizeof(before));
+      waiting = 1;
+      break;
+    }
+    if (!running || fuzzConsole.console.stopped)
+    {
+      break;
+    }
+  }
+  guest->console = NULL;
+  return waiting;
+}
+
+/*
+ * Reads the images into the main guest and runs it up to where it first
+ * wants input, which every input is then run from. Returns 0
+ * if an image can't be read.
+ */
+int startFuzzing(const char** imagePaths, int imageCount, uint64_t budget)
+{
+  for (int idx = 0; idx < imageCount; idx++)
+  {
+    if (!readImage(imagePaths[idx]))
+    {
+      printf("Failed to load image: %s\n", imagePaths[idx]);
+      return 0;
+    }
+  }
+  guest->regs[R_COND] = FL_ZRO;
+  guest->regs[R_PC] = entryPoint;
+  resetClock(guest);
+  memcpy(pristine, guest->mem, sizeof(pristine));
+  memcpy(pristineRegs, guest->regs, sizeof(pristineRegs));
+  pristineClock = guest->clock;
+
+  fuzzConsole.console = (struct Console){ fuzzGetChar, fuzzKeyReady,
+                                          fuzzPutChar, fuzzFlush };
+  fuzzBudget = budget;
+
+  // A guest that never reads its input is run from the start every time, so
+  // that whatever goes wrong with it still happens for every input.
+  if (runToFirstInput())
+  {
+    memcpy(pristine, guest->mem, sizeof(pristine));
+    memcpy(pristineRegs, guest->regs, sizeof(pristineRegs));
+    pristineClock = guest->clock;
+  }
+  else
+  {
+    memcpy(guest->mem, pristine, sizeof(pristine));
+    memcpy(guest->regs, pristineRegs, sizeof(pristineRegs));
+  }
+  watchingPages = startWatching(guest) && watchAllPages();
+  takeDirtyPages();
+  return 1;
+}
+
+/*
+ * Runs the guest from the images with `data` as its keyboard, until it halts,
+ * wants more input or runs out of budget. Returns why it stopped, a
+ * ConsoleStop (STOP_NONE if it halted or ran out of budget).
+ */
+int runFuzzInput(const uint8_t* data, size_t size)
+{
+  restoreMemory();
+  memcpy(guest->regs, pristineRegs, sizeof(pristineRegs));
+  guest->clock = pristineClock;
+
+  fuzzConsole.console.stopped = STOP_NONE;
+  fuzzConsole.data = data;
+  fuzzConsole.size = size;
+  fuzzConsole.position = 0;
+
+  guest->console = &fuzzConsole.console;
+  uint64_t executed;
+  runInterpreterCovered(guest, fuzzBudget, &executed);
+  guest->console = NULL;
+  return fuzzConsole.console.stopped;
+}
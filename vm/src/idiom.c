@@ -0,0 +1,383 @@
+/*
+ * Many LC-3 programs implement multiplication, shifts and block copies as
+ * small software loops because the ISA has no instructions for them. These
+ * loops dominate the run time of such programs, so when the VM is sitting at
+ * the head of one we recognise it from the instructions in memory and run
+ * the remaining iterations as a single native operation.
+ *
+ * The native version must leave the registers, memory and condition flags
+ * exactly as the original loop would have. Anything that doesn't match a
+ * pattern exactly is left to the interpreter.
+ *
+ * For guests whose memory is watched for writes (see codewatch.c), what was
+ * found at each loop head is remembered, and forgotten again when the guest
+ * writes to the page the loop is on.
+ */
+#include "architecture.h"
+#include "instruction.h"
+#include "idiom.h"
+#include "clock.h"
+#include "codewatch.h"
+
+_Thread_local volatile sig_atomic_t currentIdiom = IDIOM_NONE;
+
+// The longest pattern we look for, used to make sure the whole loop sits
+// below the memory mapped registers (fetching from those has side effects).
+#define IDIOM_MAX_LENGTH 6
+
+// `ADD R, R, #-1` is the only way to count down in LC-3.
+static int isDecrement(uint16_t instruction, uint16_t reg)
+{
+  return instruction == ((OP_ADD << 12) | (reg << 9) | (reg << 6) | 0x3F);
+}
+
+// `ADD R, R, #1` is the only way to step a pointer forward in LC-3.
+static int isIncrement(uint16_t instruction, uint16_t reg)
+{
+  return instruction == ((OP_ADD << 12) | (reg << 9) | (reg << 6) | 0x21);
+}
+
+/*
+ * Checks that `instruction` is the branch closing a loop of `length`
+ * instructions (including the branch itself).
+ *
+ * We accept BRp, which loops while the counter is positive, and BRnp, which
+ * loops until the counter reaches zero. The offset must point back to the
+ * first instruction of the loop.
+ */
+static int isLoopBranch(uint16_t instruction, int length)
+{
+  uint16_t flags = (instruction >> 9) & 0x7;
+  uint16_t offset = signExtendPcOffset(instruction);
+
+  return (instruction >> 12) == OP_BR
+    && (flags == FL_POS || flags == (FL_POS | FL_NEG))
+    && offset == (uint16_t)(-length);
+}
+
+/*
+ * The number of times the loop body runs from the head of the loop, given the
+ * value the counter has there.
+ *
+ * With BRp we keep going while the decremented counter is positive, so a
+ * counter that is zero or negative still gives a single iteration. With BRnp
+ * we keep going until the counter hits zero, so a counter of 0 wraps all the
+ * way around.
+ */
+static uint32_t iterationCount(uint16_t branchInstruction, uint16_t counter)
+{
+  if (extractBit(branchInstruction, 11))
+  {
+    return counter ? counter : 0x10000;
+  }
+  return (counter >= 1 && counter <= 0x8000) ? counter : 1;
+}
+
+/*
+ * Multiply (and shift) loops have the form:
+ *
+ * LOOP  ADD ACC, ACC, VALUE      ; VALUE is a register or imm5
+ *       ADD CNT, CNT, #-1
+ *       BRp LOOP
+ *
+ * When VALUE is ACC itself each iteration doubles ACC, so the loop is a
+ * shift left by CNT.
+ */
+static enum Idiom matchMultiply(const uint16_t* mem, uint16_t loopHead)
+{
+  uint16_t body = mem[loopHead];
+  uint16_t countDown = mem[(uint16_t)(loopHead + 1)];
+  uint16_t acc = extractRegister(body, 9);
+  uint16_t cnt = extractRegister(countDown, 9);
+
+  if ((body >> 12) != OP_ADD || extractRegister(body, 6) != acc
+      || !isDecrement(countDown, cnt) || cnt == acc
+      || !isLoopBranch(mem[(uint16_t)(loopHead + 2)], 3))
+  {
+    return IDIOM_NONE;
+  }
+  if (extractBit(body, 5))
+  {
+    return IDIOM_MULTIPLY;
+  }
+  if (extractRegister(body, 0) == acc)
+  {
+    return IDIOM_SHIFT;
+  }
+  return extractRegister(body, 0) == cnt ? IDIOM_NONE : IDIOM_MULTIPLY;
+}
+
+/*
+ * Word copy loops have the form:
+ *
+ * LOOP  LDR TMP, SRC, #0
+ *       STR TMP, DST, #0
+ *       ADD SRC, SRC, #1         ; these two may come in either order
+ *       ADD DST, DST, #1
+ *       ADD CNT, CNT, #-1
+ *       BRp LOOP
+ *
+ * All four registers have to be different for the loop to be a plain copy.
+ */
+static enum Idiom matchCopy(const uint16_t* mem, uint16_t loopHead)
+{
+  uint16_t load = mem[loopHead];
+  uint16_t store = mem[(uint16_t)(loopHead + 1)];
+  uint16_t tmp = extractRegister(load, 9);
+  uint16_t src = extractRegister(load, 6);
+  uint16_t dst = extractRegister(store, 6);
+  uint16_t cnt = extractRegister(mem[(uint16_t)(loopHead + 4)], 9);
+
+  if (load != ((OP_LDR << 12) | (tmp << 9) | (src << 6))
+      || store != ((OP_STR << 12) | (tmp << 9) | (dst << 6)))
+  {
+    return IDIOM_NONE;
+  }
+  if (tmp == src || tmp == dst || tmp == cnt || src == dst || src == cnt
+      || dst == cnt)
+  {
+    return IDIOM_NONE;
+  }
+
+  uint16_t step1 = mem[(uint16_t)(loopHead + 2)];
+  uint16_t step2 = mem[(uint16_t)(loopHead + 3)];
+  int stepsMatch = (isIncrement(step1, src) && isIncrement(step2, dst))
+    || (isIncrement(step1, dst) && isIncrement(step2, src));
+
+  if (!stepsMatch || !isDecrement(mem[(uint16_t)(loopHead + 4)], cnt)
+      || !isLoopBranch(mem[(uint16_t)(loopHead + 5)], 6))
+  {
+    return IDIOM_NONE;
+  }
+  return IDIOM_COPY;
+}
+
+/*
+ * Works out which idiom, if any, starts at `loopHead`.
+ */
+enum Idiom matchIdiom(struct Guest* guest, uint16_t loopHead)
+{
+  const uint16_t* mem = guest->mem;
+  // Never look at loops overlapping the memory mapped registers.
+  if (loopHead > MR_KBSR - IDIOM_MAX_LENGTH && loopHead <= MR_TIMER)
+  {
+    return IDIOM_NONE;
+  }
+
+  switch (mem[loopHead] >> 12)
+  {
+    case OP_ADD:
+      return matchMultiply(mem, loopHead);
+    case OP_LDR:
+      return matchCopy(mem, loopHead);
+  }
+  return IDIOM_NONE;
+}
+
+// Runs the rest of a multiply or shift loop, see `matchMultiply`.
+static uint32_t runMultiply(struct Guest* guest, uint16_t loopHead,
+                            enum Idiom idiom)
+{
+  uint16_t* mem = guest->mem;
+  uint16_t* regs = guest->regs;
+  uint16_t body = mem[loopHead];
+  uint16_t acc = extractRegister(body, 9);
+  uint16_t cnt = extractRegister(mem[(uint16_t)(loopHead + 1)], 9);
+  uint32_t count = iterationCount(mem[(uint16_t)(loopHead + 2)], regs[cnt]);
+
+  if (idiom == IDIOM_SHIFT)
+  {
+    regs[acc] = count >= 16 ? 0 : regs[acc] << count;
+  }
+  else
+  {
+    uint16_t value = extractBit(body, 5)
+      ? signExtend(body & 0x1F, 5) : regs[extractRegister(body, 0)];
+    regs[acc] += (uint16_t)(count * value);
+  }
+
+  regs[cnt] -= count;
+  updateConditionFlags(guest, cnt);
+  regs[R_PC] = loopHead + 3;
+  return count * 3;
+}
+
+/*
+ * Runs the rest of a copy loop, see `matchCopy`.
+ *
+ * The copy goes word by word through memRead and memWrite in the same order
+ * as the original loop, so overlapping ranges and memory mapped registers
+ * behave exactly as before. We only give up if the copy would overwrite the
+ * loop itself.
+ */
+static uint32_t runCopy(struct Guest* guest, uint16_t loopHead)
+{
+  uint16_t* mem = guest->mem;
+  uint16_t* regs = guest->regs;
+  uint16_t load = mem[loopHead];
+  uint16_t tmp = extractRegister(load, 9);
+  uint16_t src = extractRegister(load, 6);
+  uint16_t dst = extractRegister(mem[(uint16_t)(loopHead + 1)], 6);
+  uint16_t cnt = extractRegister(mem[(uint16_t)(loopHead + 4)], 9);
+  uint32_t count = iterationCount(mem[(uint16_t)(loopHead + 5)], regs[cnt]);
+
+  for (uint16_t idx = 0; idx < 6; idx++)
+  {
+    if ((uint16_t)(loopHead + idx - regs[dst]) < count)
+    {
+      return 0;
+    }
+  }
+
+  for (uint32_t idx = 0; idx < count; idx++)
+  {
+    regs[tmp] = memRead(guest, regs[src]++);
+    memWrite(guest, regs[dst]++, regs[tmp]);
+  }
+
+  regs[cnt] -= count;
+  updateConditionFlags(guest, cnt);
+  regs[R_PC] = loopHead + 6;
+  return count * 6;
+}
+
+// The number of instructions the loop at `loopHead` would retire if it was
+// run natively now.
+static uint64_t idiomInstructions(struct Guest* guest, uint16_t loopHead,
+                                  enum Idiom idiom)
+{
+  uint16_t* mem = guest->mem;
+  uint16_t* regs = guest->regs;
+  if (idiom == IDIOM_COPY)
+  {
+    uint16_t cnt = extractRegister(mem[(uint16_t)(loopHead + 4)], 9);
+    return iterationCount(mem[(uint16_t)(loopHead + 5)], regs[cnt]) * 6ULL;
+  }
+  uint16_t cnt = extractRegister(mem[(uint16_t)(loopHead + 1)], 9);
+  return iterationCount(mem[(uint16_t)(loopHead + 2)], regs[cnt]) * 3ULL;
+}
+
+// Forgets the loops that may run into `page`, as it is about to change.
+static void forgetIdioms(struct Guest* guest, int page)
+{
+  uint8_t* knownIdioms = guest->idioms.known;
+  if (!knownIdioms)
+  {
+    return;
+  }
+  uint16_t first = page * WATCH_PAGE_WORDS - (IDIOM_MAX_LENGTH - 1);
+  for (uint32_t idx = 0; idx < WATCH_PAGE_WORDS + IDIOM_MAX_LENGTH - 1; idx++)
+  {
+    knownIdioms[(uint16_t)(first + idx)] = 0;
+  }
+}
+
+/*
+ * Starts remembering the idioms found in `guest`, if its memory can be
+ * watched for the writes that would make them stale. It has to be called on
+ * the thread that runs the guest.
+ */
+void cacheIdioms(struct Guest* guest)
+{
+  static int watcherAdded;
+  if (!__atomic_exchange_n(&watcherAdded, 1, __ATOMIC_ACQ_REL))
+  {
+    addPageWatcher(forgetIdioms);
+  }
+  if (startWatching(guest) && !guest->idioms.known)
+  {
+    guest->idioms.known = calloc(MEMORY_MAX, sizeof(uint8_t));
+  }
+}
+
+/*
+ * Remembers that `idiom` is what matchIdiom finds at `loopHead` right now.
+ * Returns 0 if it can't be remembered, e.g. because the guest isn't caching
+ * idioms.
+ */
+int rememberIdiom(struct Guest* guest, uint16_t loopHead, enum Idiom idiom)
+{
+  // The match depends on the whole loop, which may run onto the next page.
+  if (!guest->idioms.known || !watchAddress(loopHead)
+      || !watchAddress(loopHead + IDIOM_MAX_LENGTH - 1))
+  {
+    return 0;
+  }
+  guest->idioms.known[loopHead] = idiom + 1;
+  return 1;
+}
+
+// matchIdiom, going by what was found last time where possible.
+static enum Idiom lookupIdiom(struct Guest* guest, uint16_t loopHead)
+{
+  struct GuestIdioms* idioms = &guest->idioms;
+  if (!idioms->known)
+  {
+    return matchIdiom(guest, loopHead);
+  }
+  if (idioms->known[loopHead])
+  {
+    return idioms->known[loopHead] - 1;
+  }
+
+  // Only heads that were never remembered get here, so marking them as
+  // reached costs nothing once the guest has settled into its loops. The bit
+  // is checked first so that heads marked by an earlier run never write to
+  // the shared file.
+  uint64_t* reached = idioms->reachedHeads;
+  uint64_t bit = 1ULL << (loopHead % 64);
+  if (reached && !(reached[loopHead / 64] & bit))
+  {
+    __atomic_fetch_or(&reached[loopHead / 64], bit, __ATOMIC_RELAXED);
+  }
+
+  enum Idiom idiom = matchIdiom(guest, loopHead);
+  rememberIdiom(guest, loopHead, idiom);
+  return idiom;
+}
+
+/*
+ * Called after a backwards branch. If the program counter now points at the
+ * head of a recognised loop we run the rest of the loop natively and leave
+ * the program counter just past it.
+ *
+ * It returns the number of guest instructions that were stood in for, which
+ * is 0 if nothing was recognised and the interpreter should carry on.
+ */
+uint32_t runIdiom(struct Guest* guest)
+{
+  uint16_t loopHead = guest->regs[R_PC];
+  enum Idiom idiom = lookupIdiom(guest, loopHead);
+  uint32_t retired = 0;
+
+  if (idiom == IDIOM_NONE)
+  {
+    return 0;
+  }
+  // A loop that would go past where the guest has to stop is left to the
+  // interpreter, which can stop part way through it.
+  if (guest->idioms.stopAt && guest->clock.instructions
+      + idiomInstructions(guest, loopHead, idiom) > guest->idioms.stopAt)
+  {
+    return 0;
+  }
+
+  currentIdiom = idiom;
+  switch (idiom)
+  {
+    case IDIOM_MULTIPLY:
+    case IDIOM_SHIFT:
+      retired = runMultiply(guest, loopHead, idiom);
+      break;
+    case IDIOM_COPY:
+      retired = runCopy(guest, loopHead);
+      break;
+    default:
+      break;
+  }
+  currentIdiom = IDIOM_NONE;
+
+  guest->idioms.instructions[idiom] += retired;
+  guest->clock.instructions += retired;
+  return retired;
+}
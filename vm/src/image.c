@@ -0,0 +1,239 @@
+/*
+ * Reading LC-3 object files. An object file is a big endian origin followed
+ * by the big endian words to place in memory starting at that origin.
+ *
+ * Container images (see container.c) can be used wherever an object file
+ * can, they are told apart by their magic number. swap16 and freeImage live
+ * in imagedata.c, which the tools share.
+ */
+#include <sys/stat.h>
+
+#include "architecture.h"
+#include "container.h"
+#include "image.h"
+
+uint16_t entryPoint = PC_START;
+
+// The symbols of every image read with readImage, by address.
+static struct ImageSymbol* symbols;
+static int symbolCount;
+
+/*
+ * Used to read a file representing the image to be run by the VM into the
+ * main guest's memory.
+ */
+void readImageFile(FILE* file)
+{
+  // Origin specifies where in memory to place the image
+  uint16_t origin;
+  // Read the first 16 bits from the file and place in origin
+  fread(&origin, sizeof(origin), 1, file);
+  // swap to little endian
+  origin = swap16(origin);
+
+  // Now we know to place the file starting at origin in our memory.
+  // As memory has a finite size, we know the maximum size we can read from
+  // the file.
+  uint16_t maxRead = MEMORY_MAX - origin;
+  // The starting address to write the program to.
+  uint16_t *instructionPointer = mainGuest.mem + origin;
+  // Now we read the entire program into memory (up to maxRead size) starting
+  // from the instructionPointer.
+  size_t instructionCount = fread(
+    instructionPointer, sizeof(uint16_t), maxRead, file);
+
+  // Lastly, for each instruction we need to swap from big endian to little
+  // endian, so we loop through starting from the origin.
+  while (instructionCount-- > 0)
+  {
+    *instructionPointer = swap16(*instructionPointer);
+    instructionPointer++;
+  }
+}
+
+/*
+ * Maps the container `file` into memory and reads it with readContainer,
+ * placing its segments straight into `memory` if that is given.
+ */
+static int readContainerFile(FILE* file, const char* imagePath,
+                             struct Image* image, uint16_t* memory)
+{
+  struct stat info;
+  if (fstat(fileno(file), &info) != 0 || info.st_size == 0)
+  {
+    return 0;
+  }
+  void* data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fileno(file),
+                    0);
+  if (data == MAP_FAILED)
+  {
+    return 0;
+  }
+  const char* error = readContainer(data, info.st_size, image, memory);
+  munmap(data, info.st_size);
+  if (error)
+  {
+    fprintf(stderr, "%s: %s\n", imagePath, error);
+    freeImage(image);
+    return 0;
+  }
+  return 1;
+}
+
+// Whether `file` starts with the magic number of a container. Leaves the file
+// at its start either way.
+static int startsContainer(FILE* file)
+{
+  char magic[4];
+  int container = fread(magic, 1, sizeof(magic), file) == sizeof(magic)
+    && memcmp(magic, CONTAINER_MAGIC, sizeof(magic)) == 0;
+  rewind(file);
+  return container;
+}
+
+static int compareSymbols(const void* a, const void* b)
+{
+  const struct ImageSymbol* first = a;
+  const struct ImageSymbol* second = b;
+  return first->address - second->address;
+}
+
+/*
+ * A convenient wrapper around readImageFile that accepts a file path.
+ *
+ * A container is placed straight into memory from a mapping of the file, and
+ * its entry point and symbols are kept for the rest of the VM.
+ */
+int readImage(const char* imagePath)
+{
+  FILE* file = fopen(imagePath, "rb");
+  if (!file)
+  {
+    return 0;
+  }
+  if (!startsContainer(file))
+  {
+    readImageFile(file);
+    fclose(file);
+    return 1;
+  }
+
+  struct Image image;
+  int read = readContainerFile(file, imagePath, &image, mainGuest.mem);
+  fclose(file);
+  if (!read)
+  {
+    return 0;
+  }
+  if (image.hasEntry)
+  {
+    entryPoint = image.entry;
+  }
+
+  // The names now belong to the VM's symbols.
+  symbols = realloc(symbols, (symbolCount + image.symbolCount)
+                    * sizeof(struct ImageSymbol));
+  memcpy(symbols + symbolCount, image.symbols,
+         image.symbolCount * sizeof(struct ImageSymbol));
+  symbolCount += image.symbolCount;
+  qsort(symbols, symbolCount, sizeof(struct ImageSymbol), compareSymbols);
+  image.symbolCount = 0;
+  freeImage(&image);
+  return 1;
+}
+
+/*
+ * Reads an object file or container into `image` without touching the VM's
+ * memory, so that it can be placed into memory again and again without going
+ * back to the file (e.g. once per job in the job server).
+ */
+int loadImage(const char* imagePath, struct Image* image)
+{
+  FILE* file = fopen(imagePath, "rb");
+  if (!file)
+  {
+    return 0;
+  }
+  if (startsContainer(file))
+  {
+    int read = readContainerFile(file, imagePath, image, NULL);
+    fclose(file);
+    return read;
+  }
+
+  uint16_t origin;
+  if (fread(&origin, sizeof(origin), 1, file) != 1)
+  {
+    fclose(file);
+    return 0;
+  }
+  memset(image, 0, sizeof(struct Image));
+  image->segments = calloc(1, sizeof(struct ImageSegment));
+  image->segmentCount = 1;
+
+  struct ImageSegment* segment = &image->segments[0];
+  segment->origin = swap16(origin);
+  segment->words = malloc((MEMORY_MAX - segment->origin) * sizeof(uint16_t));
+  segment->length = fread(segment->words, sizeof(uint16_t),
+                          MEMORY_MAX - segment->origin, file);
+  fclose(file);
+
+  for (uint32_t idx = 0; idx < segment->length; idx++)
+  {
+    segment->words[idx] = swap16(segment->words[idx]);
+  }
+  return 1;
+}
+
+// Copies the segments of an image loaded with loadImage into the memory of
+// `guest` at their origins.
+void placeImage(struct Guest* guest, const struct Image* image)
+{
+  for (int idx = 0; idx < image->segmentCount; idx++)
+  {
+    const struct ImageSegment* segment = &image->segments[idx];
+    memcpy(guest->mem + segment->origin, segment->words,
+           segment->length * sizeof(uint16_t));
+  }
+}
+
+/*
+ * Finds the symbol at or closest before `address` among the images read with
+ * readImage, and how far past it the address is. Returns NULL if there is
+ * none.
+ */
+const char* lookupSymbol(uint16_t address, uint16_t* offset)
+{
+  const struct ImageSymbol* found = NULL;
+  for (int idx = 0; idx < symbolCount && symbols[idx].address <= address;
+       idx++)
+  {
+    found = &symbols[idx];
+  }
+  if (!found)
+  {
+    return NULL;
+  }
+  *offset = address - found->address;
+  return found->name;
+}
+
+// Writes `address` relative to the symbol it is in (e.g. "LOOP+3") for
+// reports, or an empty string if there is no symbol before it.
+void formatSymbol(uint16_t address, char* text, size_t size)
+{
+  uint16_t offset;
+  const char* name = lookupSymbol(address, &offset);
+  if (!name)
+  {
+    text[0] = '\0';
+  }
+  else if (offset)
+  {
+    snprintf(text, size, "%s+%u", name, offset);
+  }
+  else
+  {
+    snprintf(text, size, "%s", name);
+  }
+}
@@ -0,0 +1,33 @@
+/*
+ * The parts of reading images that don't touch the VM, so that the tools
+ * (e.g. lc3-pack) can link against them without the rest of the VM.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "image.h"
+
+/*
+ * Used to swap between big endian and little endian.
+ *
+ * LC3 programs are big endian but most computers are little endian.
+ */
+uint16_t swap16(uint16_t x)
+{
+  return (x << 8) | (x >> 8);
+}
+
+void freeImage(struct Image* image)
+{
+  for (int idx = 0; idx < image->segmentCount; idx++)
+  {
+    free(image->segments[idx].words);
+  }
+  for (int idx = 0; idx < image->symbolCount; idx++)
+  {
+    free(image->symbols[idx].name);
+  }
+  free(image->segments);
+  free(image->symbols);
+  memset(image, 0, sizeof(struct Image));
+}
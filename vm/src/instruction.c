@@ -64,7 +64,7 @@ uint16_t extractBit(uint16_t currInstruction, short bitIdx)
  * - then bits 4-0 store a 5 bit value that is added to the first operand, this
  *   value must be sign extended to 16 bits
  */
-void executeAdd(uint16_t addInstruction)
+void executeAdd(struct Guest* guest, uint16_t addInstruction)
 {
   uint16_t dr = extractRegister(addInstruction, 9);
   uint16_t sr1 = extractRegister(addInstruction, 6);
@@ -76,15 +76,15 @@ void executeAdd(uint16_t addInstruction)
     // this is in bits 4-0 so we can bitwise-and with 31 (0x1F) which is 11111
     // in binary to only get the 5 most insignificant bits.
     uint16_t imm5 = signExtend(addInstruction & 0x1F, 5);
-    regs[dr] = regs[sr1] + imm5;
+    guest->regs[dr] = guest->regs[sr1] + imm5;
   }
   else
   {
     // We are in case 1, so the second register is in bits 2-0
     uint16_t sr2 = extractRegister(addInstruction, 0);
-    regs[dr] = regs[sr1] + regs[sr2];
+    guest->regs[dr] = guest->regs[sr1] + guest->regs[sr2];
   }
-  updateConditionFlags(dr);
+  updateConditionFlags(guest, dr);
 }
 
 /*
@@ -109,7 +109,7 @@ void executeAdd(uint16_t addInstruction)
  * - then bits 4-0 store a 5 bit value that is anded with the first operand,
  *   this value must be sign extended to 16 bits
  */
-void executeAnd(uint16_t andInstruction)
+void executeAnd(struct Guest* guest, uint16_t andInstruction)
 {
   uint16_t dr = extractRegister(andInstruction, 9);
   uint16_t sr1 = extractRegister(andInstruction, 6);
@@ -121,15 +121,15 @@ void executeAnd(uint16_t andInstruction)
     // this is in bits 4-0 so we can bitwise-and with 31 (0x1F) which is 11111
     // in binary to only get the 5 most insignificant bits.
     uint16_t imm5 = signExtend(andInstruction & 0x1F, 5);
-    regs[dr] = regs[sr1] & imm5;
+    guest->regs[dr] = guest->regs[sr1] & imm5;
   }
   else
   {
     // We are in case 1, so the second register is in bits 2-0
     uint16_t sr2 = extractRegister(andInstruction, 0);
-    regs[dr] = regs[sr1] & regs[sr2];
+    guest->regs[dr] = guest->regs[sr1] & guest->regs[sr2];
   }
-  updateConditionFlags(dr);
+  updateConditionFlags(guest, dr);
 }
 
 /*
@@ -147,13 +147,13 @@ void executeAnd(uint16_t andInstruction)
  * For this instruction we take the bitwise complement of the value in the
  * source register and store that in the destination register.
  */
-void executeNot(uint16_t notInstruction)
+void executeNot(struct Guest* guest, uint16_t notInstruction)
 {
   uint16_t dr = extractRegister(notInstruction, 9);
   uint16_t sr = extractRegister(notInstruction, 6);
 
-  regs[dr] = ~regs[sr];
-  updateConditionFlags(dr);
+  guest->regs[dr] = ~guest->regs[sr];
+  updateConditionFlags(guest, dr);
 }
 
 /*
@@ -172,20 +172,20 @@ void executeNot(uint16_t notInstruction)
  * If any of the branch conditions are true we add the 9-bit PCoffset9 to the
  * incremented program counter after sign extending to 16 bits
  */
-void executeBranch(uint16_t branchInstruction)
+void executeBranch(struct Guest* guest, uint16_t branchInstruction)
 {
   uint16_t nBit = extractBit(branchInstruction, 11);
   uint16_t zBit = extractBit(branchInstruction, 10);
   uint16_t pBit = extractBit(branchInstruction, 9);
 
-  uint16_t branchBit = nBit & (regs[R_COND] == FL_NEG);
-  branchBit |= zBit & (regs[R_COND] == FL_ZRO);
-  branchBit |= pBit & (regs[R_COND] == FL_POS);
+  uint16_t branchBit = nBit & (guest->regs[R_COND] == FL_NEG);
+  branchBit |= zBit & (guest->regs[R_COND] == FL_ZRO);
+  branchBit |= pBit & (guest->regs[R_COND] == FL_POS);
 
   if (branchBit)
   {
     uint16_t pcOffset = signExtendPcOffset(branchInstruction);
-    regs[R_PC] += pcOffset;
+    guest->regs[R_PC] += pcOffset;
   }
 }
 
@@ -203,10 +203,10 @@ void executeBranch(uint16_t branchInstruction)
  *
  * NOTE: function return is just a jump command with BaseR set to 111.
  */
-void executeJump(uint16_t jumpInstruction)
+void executeJump(struct Guest* guest, uint16_t jumpInstruction)
 {
   uint16_t baseR = extractRegister(jumpInstruction, 6);
-  regs[R_PC] = regs[baseR];
+  guest->regs[R_PC] = guest->regs[baseR];
 }
 
 /*
@@ -233,23 +233,23 @@ void executeJump(uint16_t jumpInstruction)
  * set the program counter to the address in this register. All other bits are
  * unused.
  */
-void executeJumpToSubroutine(uint16_t jumpInstruction)
+void executeJumpToSubroutine(struct Guest* guest, uint16_t jumpInstruction)
 {
   // Save current program counter in R7 (this PC points to current instruction
   // in the calling subroutine so we can come back here after).
-  regs[R_7] = regs[R_PC];
+  guest->regs[R_7] = guest->regs[R_PC];
 
   uint16_t modeBit = extractBit(jumpInstruction, 11);
 
   if (modeBit)
   {
     uint16_t pcOffset = signExtend(jumpInstruction & 0x7FF, 11);
-    regs[R_PC] += pcOffset;
+    guest->regs[R_PC] += pcOffset;
   }
   else
   {
     uint16_t baseR = extractRegister(jumpInstruction, 6);
-    regs[R_PC] = regs[baseR];
+    guest->regs[R_PC] = guest->regs[baseR];
   }
 }
 
@@ -266,16 +266,16 @@ void executeJumpToSubroutine(uint16_t jumpInstruction)
  * the program counter (PC) to get an address that is read from memory and
  * stored in the destination register.
  */
-void executeLoad(uint16_t loadInstruction)
+void executeLoad(struct Guest* guest, uint16_t loadInstruction)
 {
   uint16_t dr = extractRegister(loadInstruction, 9);
   uint16_t pcOffset = signExtend(loadInstruction & 0x1FF, 9);
 
   // We read from the memory at the address specified by the program counter
   // plus the offset and store that in the destination register.
-  regs[dr] = memRead(regs[R_PC] + pcOffset);
+  guest->regs[dr] = memRead(guest, guest->regs[R_PC] + pcOffset);
 
-  updateConditionFlags(dr);
+  updateConditionFlags(guest, dr);
 }
 
 /*
@@ -294,7 +294,7 @@ void executeLoad(uint16_t loadInstruction)
  * - then added to the increment program counter (PC) to get a memory
  *   address from which to read from
  */
-void executeLoadIndirect(uint16_t ldiInstruction)
+void executeLoadIndirect(struct Guest* guest, uint16_t ldiInstruction)
 {
   uint16_t dr = extractRegister(ldiInstruction, 9);
   uint16_t pcOffset = signExtendPcOffset(ldiInstruction);
@@ -305,9 +305,10 @@ void executeLoadIndirect(uint16_t ldiInstruction)
   // address pointing to where the actual data is stored, so we read that
   // address (the second mem_read) and load the value into the destination
   // register (dr).
-  regs[dr] = memRead(memRead(regs[R_PC] + pcOffset));
+  uint16_t address = memRead(guest, guest->regs[R_PC] + pcOffset);
+  guest->regs[dr] = memRead(guest, address);
 
-  updateConditionFlags(dr);
+  updateConditionFlags(guest, dr);
 }
 
 /*
@@ -326,7 +327,7 @@ void executeLoadIndirect(uint16_t ldiInstruction)
  * register. Then the value at that memory address is read and stored in the
  * destination register.
  */
-void executeLoadRegister(uint16_t ldrInstruction)
+void executeLoadRegister(struct Guest* guest, uint16_t ldrInstruction)
 {
   uint16_t dr = extractRegister(ldrInstruction, 9);
   uint16_t baseR = extractRegister(ldrInstruction, 6);
@@ -334,9 +335,9 @@ void executeLoadRegister(uint16_t ldrInstruction)
   // so it extracts those 6 bits and then we sign extend to 16 bits.
   uint16_t offset = signExtend(ldrInstruction & 0x3F, 6);
 
-  regs[dr] = memRead(regs[baseR] + offset);
+  guest->regs[dr] = memRead(guest, guest->regs[baseR] + offset);
 
-  updateConditionFlags(dr);
+  updateConditionFlags(guest, dr);
 }
 
 /*
@@ -353,7 +354,7 @@ void executeLoadRegister(uint16_t ldrInstruction)
  * In this instruction we load an address into the destination register, given
  * by the incremented PC counter plus the offset sign extended to 16 bits.
  */
-void executeLoadEffectiveAddress(uint16_t leaInstruction)
+void executeLoadEffectiveAddress(struct Guest* guest, uint16_t leaInstruction)
 {
   uint16_t dr = extractRegister(leaInstruction, 9);
   // the offset is the 9 most insignificant bits so we bitwise-and with 0x1FF
@@ -363,9 +364,9 @@ void executeLoadEffectiveAddress(uint16_t leaInstruction)
   // the program counter will have already been incremented by the time we
   // get here so we simply take that address, add the offset and store in the
   // destination register
-  regs[dr] = regs[R_PC] + pcOffset;
+  guest->regs[dr] = guest->regs[R_PC] + pcOffset;
 
-  updateConditionFlags(dr);
+  updateConditionFlags(guest, dr);
 }
 
 /*
@@ -383,7 +384,7 @@ void executeLoadEffectiveAddress(uint16_t leaInstruction)
  * bits) offset to the incremented program counter and store the contents of
  * the source register in that memory address.
  */
-void executeStore(uint16_t storeInstruction)
+void executeStore(struct Guest* guest, uint16_t storeInstruction)
 {
   uint16_t sr = extractRegister(storeInstruction, 9);
   // The offset is the 9 least significant bits so we bitwise-and the
@@ -394,7 +395,7 @@ void executeStore(uint16_t storeInstruction)
   // Write the contents of the source register into the appropriate memory
   // address. The program counter was already incremented so we just add the
   // offset.
-  memWrite(regs[R_PC] + pcOffset, regs[sr]);
+  memWrite(guest, guest->regs[R_PC] + pcOffset, guest->regs[sr]);
 }
 
 /*
@@ -412,7 +413,7 @@ void executeStore(uint16_t storeInstruction)
  * address to get another address and write the contents of the source register
  * to the memory location specified by this second address.
  */
-void executeStoreIndirect(uint16_t stiInstruction)
+void executeStoreIndirect(struct Guest* guest, uint16_t stiInstruction)
 {
   uint16_t sr = extractRegister(stiInstruction, 9);
   // the offset is in the 9 least significant bits so we take the bitwise-and
@@ -424,7 +425,8 @@ void executeStoreIndirect(uint16_t stiInstruction)
   // and read from the resulting memory location to get the destination address,
   // then we write the contents of the source register to this destination
   // address.
-  memWrite(memRead(regs[R_PC] + pcOffset), regs[sr]);
+  uint16_t address = memRead(guest, guest->regs[R_PC] + pcOffset);
+  memWrite(guest, address, guest->regs[sr]);
 }
 
 /*
@@ -443,7 +445,7 @@ void executeStoreIndirect(uint16_t stiInstruction)
  * it after sign extending to 16 bits to get a final address. The contents of
  * the source register are then written to this address.
  */
-void executeStoreRegister(uint16_t strInstruction)
+void executeStoreRegister(struct Guest* guest, uint16_t strInstruction)
 {
   uint16_t sr = extractRegister(strInstruction, 9);
   uint16_t baseR = extractRegister(strInstruction, 6);
@@ -454,5 +456,5 @@ void executeStoreRegister(uint16_t strInstruction)
 
   // We write the contents of the source register into the memory address
   // specified by in baseR plus the offset.
-  memWrite(regs[baseR] + offset, regs[sr]);
+  memWrite(guest, guest->regs[baseR] + offset, guest->regs[sr]);
 }
@@ -0,0 +1,302 @@
+/*
+ * The main VM procedure is the following:
+ * 1) load an instruction from memory at the address of the PC register
+ * 2) Increment the PC register
+ * 3) Look at the opcode to determine which type of instruction it should do
+ * 4) Perform the instruction with the instructions parameters
+ * 5) Loop back to step 1.
+ *
+ * The loop comes in a few flavours (e.g. one that counts what it executes),
+ * they all share the same inlined dispatch so they behave identically.
+ */
+#include "architecture.h"
+#include "instruction.h"
+#include "trap.h"
+#include "idiom.h"
+#include "debug.h"
+#include "clock.h"
+#include "fuzz.h"
+#include "interpreter.h"
+
+volatile sig_atomic_t currentOpcode;
+uint64_t opcodeCounts[16];
+
+/*
+ * Steps 3 and 4 for a single instruction. Returns whether the VM is still
+ * running afterwards.
+ *
+ * With `coverage` (only ever a constant, so the other loops don't pay for
+ * it) every branch, jump and subroutine call also counts the edge it took
+ * for the fuzzer, see recordEdge.
+ */
+static inline __attribute__((always_inline))
+int dispatch(struct Guest* guest, uint16_t currInstruction, int coverage)
+{
+  // Step 3: extract the opcode
+  uint16_t opcode = currInstruction >> 12;
+  uint16_t next = guest->regs[R_PC];
+
+  // Step 4: implement action based on opcode
+  switch (opcode)
+  {
+    case OP_ADD:
+      executeAdd(guest, currInstruction);
+      break;
+    case OP_AND:
+      executeAnd(guest, currInstruction);
+      break;
+    case OP_NOT:
+      executeNot(guest, currInstruction);
+      break;
+    case OP_BR:
+      executeBranch(guest, currInstruction);
+      // Every way out of a branch is an edge, including falling through.
+      if (coverage)
+      {
+        recordEdge(next, guest->regs[R_PC]);
+      }
+      // Backwards branches close loops, so this is where the recogniser
+      // gets the chance to run the rest of a known loop natively.
+      if (guest->idioms.enabled && extractBit(currInstruction, 8))
+      {
+        runIdiom(guest);
+      }
+      break;
+    case OP_JMP:
+      executeJump(guest, currInstruction);
+      if (coverage)
+      {
+        recordEdge(next, guest->regs[R_PC]);
+      }
+      break;
+    case OP_JSR:
+      executeJumpToSubroutine(guest, currInstruction);
+      if (coverage)
+      {
+        recordEdge(next, guest->regs[R_PC]);
+      }
+      break;
+    case OP_LD:
+      executeLoad(guest, currInstruction);
+      break;
+    case OP_LDI:
+      executeLoadIndirect(guest, currInstruction);
+      break;
+    case OP_LDR:
+      executeLoadRegister(guest, currInstruction);
+      break;
+    case OP_LEA:
+      executeLoadEffectiveAddress(guest, currInstruction);
+      break;
+    case OP_ST:
+      executeStore(guest, currInstruction);
+      break;
+    case OP_STI:
+      executeStoreIndirect(guest, currInstruction);
+      break;
+    case OP_STR:
+      executeStoreRegister(guest, currInstruction);
+      break;
+    case OP_TRAP:
+      return handleTrap(guest, currInstruction);
+    case OP_RES:
+      // While debugging, the fetch path hands us a RES instruction in place
+      // of any instruction the debugger wants to stop at (see debug.c).
+      if (debugging)
+      {
+        return debugBreak(guest);
+      }
+      // fall through
+    case OP_RTI:
+    default:
+      // A guest with its own console (e.g. a job server guest) is stopped on
+      // its own rather than taking the whole VM down with it.
+      if (guest->console)
+      {
+        guest->console->stopped = STOP_INVALID_OPCODE;
+        return 0;
+      }
+      printf("Invalid opcode received: %d", opcode);
+      exit(1);
+  }
+  return 1;
+}
+
+int executeInstruction(struct Guest* guest, uint16_t currInstruction)
+{
+  return dispatch(guest, currInstruction, 0);
+}
+
+/*
+ * Runs the guest until it halts.
+ *
+ * Whether anything observes memory is settled before the guest starts, so
+ * it is only looked at once rather than on every fetch.
+ */
+void runInterpreter(struct Guest* guest)
+{
+  int observed = memObserved;
+  int running = 1;
+  while (running)
+  {
+    // Steps 1 and 2: fetch instruction pointed to by program counter
+    // and then increment the program counter
+    uint16_t currInstruction = observed
+      ? memFetch(guest, guest->regs[R_PC]++)
+      : memFetchUnobserved(guest, guest->regs[R_PC]++);
+    running = dispatch(guest, currInstruction, 0);
+  }
+}
+
+/*
+ * Runs the guest until it halts, counting the instructions it retires for
+ * the virtual clock.
+ */
+void runInterpreterClocked(struct Guest* guest)
+{
+  int running = 1;
+  while (running)
+  {
+    uint16_t currInstruction = memFetch(guest, guest->regs[R_PC]++);
+    guest->clock.instructions++;
+    running = dispatch(guest, currInstruction, 0);
+  }
+}
+
+/*
+ * Runs the guest until it halts, counting the instructions executed with
+ * each opcode in `opcodeCounts` (and for the virtual clock) and keeping
+ * `currentOpcode` up to date so that a signal handler can see what the VM is
+ * doing.
+ *
+ * If `tick` is given it is called every `interval` instructions and once more
+ * when the VM halts, so the counts can be passed on in batches.
+ */
+void runInterpreterCounted(struct Guest* guest, uint32_t interval,
+                           void (*tick)())
+{
+  uint32_t untilTick = interval;
+  int running = 1;
+  while (running)
+  {
+    uint16_t currInstruction = memFetch(guest, guest->regs[R_PC]++);
+    currentOpcode = currInstruction >> 12;
+    opcodeCounts[currInstruction >> 12]++;
+    guest->clock.instructions++;
+    running = dispatch(guest, currInstruction, 0);
+
+    if (__builtin_expect(--untilTick == 0, 0))
+    {
+      untilTick = interval;
+      if (tick)
+      {
+        tick();
+      }
+    }
+  }
+  if (tick)
+  {
+    tick();
+  }
+}
+
+/*
+ * runInterpreterCounted for when estimates of the opcode counts will do,
+ * e.g. for showing them live. The opcode of one instruction every
+ * OPCODE_SAMPLE_PERIOD or so is counted for all the instructions since the
+ * last one, and the gaps between samples vary so that loops whose length
+ * divides the gap can't hide their other opcodes. The instructions retired
+ * are still counted exactly, but they are only added to the guest's clock at
+ * every sample, which is well below a millisecond of virtual time.
+ * `currentOpcode` isn't kept up to date.
+ *
+ * `tick` is called at the first sample after every `interval` instructions,
+ * and once more when the VM halts.
+ */
+void runInterpreterSampled(struct Guest* guest, uint32_t interval,
+                           void (*tick)())
+{
+  uint64_t nextTick = guest->clock.instructions + interval;
+  uint32_t random = 0x9E3779B9;
+  uint32_t gap = 1;
+  uint32_t untilSample = gap;
+  int observed = memObserved;
+  int running = 1;
+  while (running)
+  {
+    uint16_t currInstruction = observed
+      ? memFetch(guest, guest->regs[R_PC]++)
+      : memFetchUnobserved(guest, guest->regs[R_PC]++);
+    running = dispatch(guest, currInstruction, 0);
+
+    if (__builtin_expect(--untilSample == 0, 0))
+    {
+      opcodeCounts[currInstruction >> 12] += gap;
+      guest->clock.instructions += gap;
+
+      // xorshift32, for gaps from half to one and a half periods.
+      random ^= random << 13;
+      random ^= random >> 17;
+      random ^= random << 5;
+      gap = OPCODE_SAMPLE_PERIOD / 2 + random % OPCODE_SAMPLE_PERIOD;
+      untilSample = gap;
+
+      if (tick && guest->clock.instructions >= nextTick)
+      {
+        nextTick = guest->clock.instructions + interval;
+        tick();
+      }
+    }
+  }
+  guest->clock.instructions += gap - untilSample;
+  if (tick)
+  {
+    tick();
+  }
+}
+
+// The loop of runInterpreterBudget and runInterpreterCovered.
+static inline __attribute__((always_inline))
+int runBudget(struct Guest* guest, uint64_t budget, uint64_t* executed,
+              int coverage)
+{
+  // Counting on the clock takes in the instructions native loops stand in
+  // for as well as the ones interpreted.
+  uint64_t start = guest->clock.instructions;
+  guest->idioms.stopAt = start + budget;
+  int running = 1;
+  while (running && guest->clock.instructions - start < budget
+         && !guest->console->stopped)
+  {
+    uint16_t currInstruction = memFetch(guest, guest->regs[R_PC]++);
+    guest->clock.instructions++;
+    running = dispatch(guest, currInstruction, coverage);
+  }
+  guest->idioms.stopAt = 0;
+  *executed = guest->clock.instructions - start;
+  return running;
+}
+
+/*
+ * Runs the guest until it halts, `budget` instructions have been executed or
+ * its console stops it, so it has to have a console.
+ *
+ * The number of instructions executed is stored in `executed` and it returns
+ * whether the guest is still running. They are also counted for the virtual
+ * clock as they go, so guests run this way (e.g. jobs) can have one. Both
+ * include the instructions of loops run natively by the idiom recogniser,
+ * and a loop that would go past the budget is interpreted instead.
+ */
+int runInterpreterBudget(struct Guest* guest, uint64_t budget,
+                         uint64_t* executed)
+{
+  return runBudget(guest, budget, executed, 0);
+}
+
+// runInterpreterBudget, also counting the guest's control flow in
+// `fuzzEdges` for the fuzzer.
+int runInterpreterCovered(struct Guest* guest, uint64_t budget,
+                          uint64_t* executed)
+{
+  return runBudget(guest, budget, executed, 1);
+}
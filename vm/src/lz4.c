@@ -0,0 +1,207 @@
+/*
+ * The LZ4 block format, so that compressed segments of container images (see
+ * container.c) can also be read and written by the standard LZ4 tools.
+ *
+ * A block is a series of sequences. Each starts with a token byte holding the
+ * number of literal bytes in its top four bits and the length of the match
+ * minus 4 in its bottom four, where 15 means that more length bytes follow
+ * (each adding up to 255). Then come the literals, the two byte little endian
+ * offset back to the match and the extra match length bytes. The last
+ * sequence only has literals.
+ *
+ * The compressor is the simple greedy one: it looks up the last position the
+ * next four bytes were seen at in a hash table and takes the match if there
+ * is one.
+ */
+#include <string.h>
+
+#include "lz4.h"
+
+#define MIN_MATCH 4
+// The last match must start at least MATCH_LIMIT bytes before the end of the
+// block, and the last LAST_LITERALS bytes are always literals.
+#define MATCH_LIMIT 12
+#define LAST_LITERALS 5
+#define MAX_OFFSET 65535
+#define HASH_BITS 12
+
+static uint32_t read32(const uint8_t* p)
+{
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+static uint32_t hash4(uint32_t sequence)
+{
+  return (sequence * 2654435761U) >> (32 - HASH_BITS);
+}
+
+static uint8_t* writeLength(uint8_t* op, size_t length)
+{
+  while (length >= 255)
+  {
+    *op++ = 255;
+    length -= 255;
+  }
+  *op++ = length;
+  return op;
+}
+
+static uint8_t* writeLiterals(uint8_t* op, uint8_t* token,
+                              const uint8_t* literals, size_t length)
+{
+  *token = (length >= 15 ? 15 : length) << 4;
+  if (length >= 15)
+  {
+    op = writeLength(op, length - 15);
+  }
+  memcpy(op, literals, length);
+  return op + length;
+}
+
+/*
+ * Compresses `sourceSize` bytes into `dest`, which has to have room for
+ * LZ4_BOUND(sourceSize) bytes. Returns the size of the block, or 0 if it
+ * would be larger than `destCapacity`.
+ */
+size_t lz4Compress(const uint8_t* source, size_t sourceSize, uint8_t* dest,
+                   size_t destCapacity)
+{
+  // Where each hash was last seen, plus one so that 0 means nowhere.
+  uint32_t table[1 << HASH_BITS] = { 0 };
+  const uint8_t* ip = source;
+  const uint8_t* anchor = source;
+  const uint8_t* end = source + sourceSize;
+  uint8_t* op = dest;
+
+  if (destCapacity < LZ4_BOUND(sourceSize))
+  {
+    return 0;
+  }
+
+  while (sourceSize > MATCH_LIMIT && ip < end - MATCH_LIMIT)
+  {
+    uint32_t sequence = read32(ip);
+    uint32_t hash = hash4(sequence);
+    uint32_t last = table[hash];
+    table[hash] = ip - source + 1;
+
+    if (!last || (size_t)(ip - source) - (last - 1) > MAX_OFFSET
+        || read32(source + last - 1) != sequence)
+    {
+      ip++;
+      continue;
+    }
+    const uint8_t* match = source + last - 1;
+
+    const uint8_t* matchEnd = ip + MIN_MATCH;
+    while (matchEnd < end - LAST_LITERALS
+           && *matchEnd == match[matchEnd - ip])
+    {
+      matchEnd++;
+    }
+
+    uint8_t* token = op++;
+    op = writeLiterals(op, token, anchor, ip - anchor);
+    *op++ = (ip - match) & 0xFF;
+    *op++ = (ip - match) >> 8;
+    size_t matchLength = matchEnd - ip - MIN_MATCH;
+    *token |= matchLength >= 15 ? 15 : matchLength;
+    if (matchLength >= 15)
+    {
+      op = writeLength(op, matchLength - 15);
+    }
+    ip = anchor = matchEnd;
+  }
+
+  uint8_t* token = op++;
+  op = writeLiterals(op, token, anchor, end - anchor);
+  return op - dest;
+}
+
+// Reads the extra bytes of a length that didn't fit in its token.
+static int readLength(const uint8_t** ip, const uint8_t* end, size_t* length)
+{
+  uint8_t byte;
+  do
+  {
+    if (*ip >= end)
+    {
+      return 0;
+    }
+    byte = *(*ip)++;
+    *length += byte;
+  } while (byte == 255);
+  return 1;
+}
+
+/*
+ * Decompresses a block that has to come to exactly `destSize` bytes. Returns
+ * 0 if the block is malformed, which never writes outside of `dest`.
+ */
+int lz4Decompress(const uint8_t* source, size_t sourceSize, uint8_t* dest,
+                  size_t destSize)
+{
+  const uint8_t* ip = source;
+  const uint8_t* end = source + sourceSize;
+  uint8_t* op = dest;
+  uint8_t* destEnd = dest + destSize;
+
+  while (ip < end)
+  {
+    uint8_t token = *ip++;
+
+    size_t literals = token >> 4;
+    if (literals == 15 && !readLength(&ip, end, &literals))
+    {
+      return 0;
+    }
+    if (literals > (size_t)(end - ip) || literals > (size_t)(destEnd - op))
+    {
+      return 0;
+    }
+    memcpy(op, ip, literals);
+    ip += literals;
+    op += literals;
+
+    // The last sequence has no match.
+    if (ip == end)
+    {
+      break;
+    }
+    if (end - ip < 2)
+    {
+      return 0;
+    }
+    size_t offset = ip[0] | ip[1] << 8;
+    ip += 2;
+    size_t matchLength = token & 15;
+    if (matchLength == 15 && !readLength(&ip, end, &matchLength))
+    {
+      return 0;
+    }
+    matchLength += MIN_MATCH;
+    if (offset == 0 || offset > (size_t)(op - dest)
+        || matchLength > (size_t)(destEnd - op))
+    {
+      return 0;
+    }
+
+    // Matches may overlap what they copy, e.g. a run of one repeated byte.
+    const uint8_t* match = op - offset;
+    if (offset >= matchLength)
+    {
+      memcpy(op, match, matchLength);
+      op += matchLength;
+    }
+    else
+    {
+      while (matchLength--)
+      {
+        *op++ = *match++;
+      }
+    }
+  }
+  return op == destEnd;
+}
@@ -1,72 +1,26 @@
 /*
- * The main VM procedure is the following:
- * 1) load an instruction from memory at the address of the PC register
- * 2) Increment the PC register
- * 3) Look at the opcode to determine which type of instruction it should do
- * 4) Perform the instruction with the instructions parameters
- * 5) Loop back to step 1.
+ * The entry point of the VM. It reads the images into memory, sets up
+ * whatever the options ask for and then hands over to the interpreter (see
+ * interpreter.c for the main VM procedure).
  */
 
 #include "architecture.h"
 #include "instruction.h"
 #include "trap.h"
-
-/*
- * Used to swap between big endian and little endian.
- *
- * LC3 programs are big endian but most computers are little endian.
- */
-uint16_t swap16(uint16_t x)
-{
-  return (x << 8) | (x >> 8);
-}
-
-/*
- * Used to read a file representing the image to be run by the VM.
- */
-void readImageFile(FILE* file)
-{
-  // Origin specifies where in memory to place the image
-  uint16_t origin;
-  // Read the first 16 bits from the file and place in origin
-  fread(&origin, sizeof(origin), 1, file);
-  // swap to little endian
-  origin = swap16(origin);
-
-  // Now we know to place the file starting at origin in our memory.
-  // As memory has a finite size, we know the maximum size we can read from
-  // the file.
-  uint16_t maxRead = MEMORY_MAX - origin;
-  // The starting address to write the program to.
-  uint16_t *instructionPointer = mem + origin;
-  // Now we read the entire program into memory (up to maxRead size) starting
-  // from the instructionPointer.
-  size_t instructionCount = fread(
-    instructionPointer, sizeof(uint16_t), maxRead, file);
-
-  // Lastly, for each instruction we need to swap from big endian to little
-  // endian, so we loop through starting from the origin.
-  while (instructionCount-- > 0)
-  {
-    *instructionPointer = swap16(*instructionPointer);
-    instructionPointer++;
-  }
-}
-
-/*
- * A convenient wrapper around readImageFile that accepts a file path.
- */
-int readImage(const char* imagePath)
-{
-  FILE* file = fopen(imagePath, "rb");
-  if (!file)
-  {
-    return 0;
-  }
-  readImageFile(file);
-  fclose(file);
-  return 1;
-}
+#include "idiom.h"
+#include "spmd.h"
+#include "cache.h"
+#include "timing.h"
+#include "interpreter.h"
+#include "perfcounters.h"
+#include "image.h"
+#include "server.h"
+#include "metrics.h"
+#include "debug.h"
+#include "validate.h"
+#include "explore.h"
+#include "clock.h"
+#include "analysis.h"
 
 void handleInterrupt(int signal)
 {
@@ -77,16 +31,164 @@ void handleInterrupt(int signal)
 
 int main(int argc, const char* argv[])
 {
-  if (argc < 2)
-  {
-    // Show usage string
-    printf("Incorrect usage! Correct usage: lc3-vm [image-file1] ...\n");
-    exit(1);
-  }
+  int imageCount = 0;
+  const char* spmdInputs = NULL;
+  int perfCounters = 0;
+  int metrics = 0;
+  const char* metricsName = NULL;
+  const char* debuggerAddress = NULL;
+  const char* socketPath = NULL;
+  const char* validateEngine = NULL;
+  const char* validateInput = NULL;
+  uint64_t validateEvery = 0;
+  struct ExploreOptions explore = { NULL, NULL, 4, 256 };
+  const char* imagePaths[argc];
+  int workerCount = sysconf(_SC_NPROCESSORS_ONLN);
+  int queueDepth = 64;
+  int analysisCache = 0;
+  const char* analysisDirectory = NULL;
 
   // Check that the images can be read.
   for (int idx = 1; idx < argc; idx++)
   {
+    // Options start with `--`, everything else is an image.
+    if (strcmp(argv[idx], "--no-idioms") == 0)
+    {
+      mainGuest.idioms.enabled = 0;
+      continue;
+    }
+    if (strcmp(argv[idx], "--cache-sim") == 0
+        || strncmp(argv[idx], "--cache-sim=", 12) == 0)
+    {
+      const char* spec = argv[idx][11] == '=' ? argv[idx] + 12 : NULL;
+      if (!initCacheSim(spec))
+      {
+        printf("Invalid cache configuration: %s\n", spec);
+        exit(1);
+      }
+      continue;
+    }
+    if (strcmp(argv[idx], "--timing") == 0
+        || strncmp(argv[idx], "--timing=", 9) == 0)
+    {
+      if (!initTiming(argv[idx][8] == '=' ? argv[idx] + 9 : NULL))
+      {
+        exit(1);
+      }
+      continue;
+    }
+    if (strcmp(argv[idx], "--perf-counters") == 0)
+    {
+      perfCounters = 1;
+      continue;
+    }
+    if (strcmp(argv[idx], "--metrics") == 0
+        || strncmp(argv[idx], "--metrics=", 10) == 0)
+    {
+      metrics = 1;
+      metricsName = argv[idx][9] == '=' ? argv[idx] + 10 : NULL;
+      continue;
+    }
+    if (strncmp(argv[idx], "--gdb=", 6) == 0)
+    {
+      debuggerAddress = argv[idx] + 6;
+      continue;
+    }
+    if (strcmp(argv[idx], "--serve") == 0 && idx + 1 < argc)
+    {
+      socketPath = argv[++idx];
+      continue;
+    }
+    if (strncmp(argv[idx], "--serve=", 8) == 0)
+    {
+      socketPath = argv[idx] + 8;
+      continue;
+    }
+    if (strncmp(argv[idx], "--workers=", 10) == 0)
+    {
+      workerCount = atoi(argv[idx] + 10);
+      continue;
+    }
+    if (strncmp(argv[idx], "--queue=", 8) == 0)
+    {
+      queueDepth = atoi(argv[idx] + 8);
+      continue;
+    }
+    if (strncmp(argv[idx], "--validate=", 11) == 0)
+    {
+      validateEngine = argv[idx] + 11;
+      continue;
+    }
+    if (strncmp(argv[idx], "--validate-every=", 17) == 0)
+    {
+      validateEvery = strtoull(argv[idx] + 17, NULL, 10);
+      continue;
+    }
+    if (strncmp(argv[idx], "--validate-input=", 17) == 0)
+    {
+      validateInput = argv[idx] + 17;
+      continue;
+    }
+    if (strncmp(argv[idx], "--explore=", 10) == 0)
+    {
+      explore.inputs = argv[idx] + 10;
+      continue;
+    }
+    if (strncmp(argv[idx], "--explore-prefix=", 17) == 0)
+    {
+      explore.prefix = argv[idx] + 17;
+      continue;
+    }
+    if (strncmp(argv[idx], "--explore-depth=", 16) == 0)
+    {
+      explore.depth = atoi(argv[idx] + 16);
+      continue;
+    }
+    if (strncmp(argv[idx], "--explore-beam=", 15) == 0)
+    {
+      explore.beam = atoi(argv[idx] + 15);
+      continue;
+    }
+    if (strncmp(argv[idx], "--explore-score=", 16) == 0)
+    {
+      if (!parseExploreScore(argv[idx] + 16, &explore))
+      {
+        printf("Invalid score: %s\n", argv[idx] + 16);
+        exit(1);
+      }
+      continue;
+    }
+    if (strcmp(argv[idx], "--virtual-clock") == 0
+        || strncmp(argv[idx], "--virtual-clock=", 16) == 0)
+    {
+      clockRate = argv[idx][15] == '=' ? atoi(argv[idx] + 16)
+        : CLOCK_DEFAULT_RATE;
+      if (clockRate == 0)
+      {
+        printf("The virtual clock needs at least one instruction per ms\n");
+        exit(1);
+      }
+      continue;
+    }
+    if (strcmp(argv[idx], "--headless") == 0)
+    {
+      clockWarp = 1;
+      continue;
+    }
+    if (strcmp(argv[idx], "--analysis-cache") == 0
+        || strncmp(argv[idx], "--analysis-cache=", 17) == 0)
+    {
+      analysisCache = 1;
+      analysisDirectory = argv[idx][16] == '=' ? argv[idx] + 17 : NULL;
+      continue;
+    }
+    if (strncmp(argv[idx], "--spmd=", 7) == 0)
+    {
+      spmdInputs = argv[idx] + 7;
+      continue;
+    }
+    imagePaths[imageCount++] = argv[idx];
+
     // We read each image into memory, throwing an error if it can't be read.
     if (!readImage(argv[idx]))
     {
@@ -95,77 +197,164 @@ int main(int argc, const char* argv[])
     }
   }
 
-  signal(SIGINT, handleInterrupt);
-  disableInputBuffering();
+  // Time only skips ahead when it is virtual, so headless runs get the
+  // virtual clock unless they asked for a particular one.
+  if (clockWarp && !clockRate)
+  {
+    clockRate = CLOCK_DEFAULT_RATE;
+  }
+
+  if (imageCount == 0)
+  {
+    // Show usage string
+    printf("Incorrect usage! Correct usage: lc3-vm [--no-idioms] "
+           "[--spmd=input1,input2,...] [--cache-sim[=config]] "
+           "[--timing[=config-file]] [--perf-counters] [--metrics[=name]] "
+           "[--gdb=port|socket] [--virtual-clock[=instructions-per-ms]] "
+           "[--headless] [--analysis-cache[=dir]] "
+           "[--validate=idioms|spmd [--validate-every=n] "
+           "[--validate-input=file]] "
+           "[--explore=input1,input2,... [--explore-prefix=input] "
+           "[--explore-depth=n] [--explore-beam=n] "
+           "[--explore-score=sum|max|zeros:address[:count]] [--workers=n]] "
+           "[--serve socket [--workers=n] [--queue=n]] [image-file1] ...\n");
+    exit(1);
+  }
+
+  // The job server keeps the images loaded and runs guests for clients
+  // until it is killed, see server.c.
+  if (socketPath)
+  {
+    if (workerCount < 1 || queueDepth < 1)
+    {
+      printf("There must be at least one worker and one queued job\n");
+      exit(1);
+    }
+    return !runServer(socketPath, imagePaths, imageCount, workerCount,
+                      queueDepth);
+  }
+
+  // Validation runs the guest twice over with its own keyboard and console,
+  // see validate.c.
+  if (validateEngine)
+  {
+    return !runValidation(validateEngine, validateInput, validateEvery);
+  }
+
+  // The search runs guests on worker threads from snapshots of the one
+  // started here, see explore.c.
+  if (explore.inputs)
+  {
+    if (workerCount < 1 || explore.depth < 1 || explore.beam < 1)
+    {
+      printf("The search needs at least one worker, depth and kept state\n");
+      exit(1);
+    }
+    explore.workerCount = workerCount;
+    return !runExploration(&explore);
+  }
+
+  // The counters are reported at exit so that guests halting through a trap
+  // or an interrupt are measured too.
+  if (perfCounters)
+  {
+    if (!initPerfCounters())
+    {
+      exit(1);
+    }
+    atexit(reportPerfCounters);
+    perfEngine = spmdInputs ? ENGINE_SPMD : ENGINE_INTERPRETER;
+  }
+
+  // Batch runs of many guests don't touch the terminal, every guest reads
+  // its own input file instead.
+  if (spmdInputs)
+  {
+    if (perfCounters)
+    {
+      startPerfCounters();
+    }
+    return !runSpmdBatch(spmdInputs);
+  }
+
+  // The simulated caches and the timing model have to see every fetch, so
+  // the loops the idiom recogniser would skip over are interpreted instead.
+  if (cacheSimEnabled() || timingEnabled())
+  {
+    mainGuest.idioms.enabled = 0;
+    memObserved = 1;
+    atexit(reportTiming);
+    atexit(reportCacheSim);
+  }
+
+  // The segment is removed at exit, after the final counters are published.
+  if (metrics)
+  {
+    if (!initMetrics(metricsName))
+    {
+      exit(1);
+    }
+    atexit(closeMetrics);
+    beforeInputWait = publishMetrics;
+  }
+
+  struct Guest* guest = &mainGuest;
 
   // initially load the zero flag into the condition register
-  regs[R_COND] = FL_ZRO;
+  guest->regs[R_COND] = FL_ZRO;
 
   // Set the program counter to the starting position
-  regs[R_PC] = PC_START;
-
-  int running = 1;
-  while (running)
-  {
-    // Steps 1 and 2: fetch instruction pointed to by program counter
-    // and then increment the program counter
-    uint16_t currInstruction = memRead(regs[R_PC]++);
-
-    // Step 3: extract the opcode
-    uint16_t opcode = currInstruction >> 12;
-
-    // Step 4: implement action based on opcode
-    switch (opcode)
-    {
-      case OP_ADD:
-        executeAdd(currInstruction);
-        break;
-      case OP_AND:
-        executeAnd(currInstruction);
-        break;
-      case OP_NOT:
-        executeNot(currInstruction);
-        break;
-      case OP_BR:
-        executeBranch(currInstruction);
-        break;
-      case OP_JMP:
-        executeJump(currInstruction);
-        break;
-      case OP_JSR:
-        executeJumpToSubroutine(currInstruction);
-        break;
-      case OP_LD:
-        executeLoad(currInstruction);
-        break;
-      case OP_LDI:
-        executeLoadIndirect(currInstruction);
-        break;
-      case OP_LDR:
-        executeLoadRegister(currInstruction);
-        break;
-      case OP_LEA:
-        executeLoadEffectiveAddress(currInstruction);
-        break;
-      case OP_ST:
-        executeStore(currInstruction);
-        break;
-      case OP_STI:
-        executeStoreIndirect(currInstruction);
-        break;
-      case OP_STR:
-        executeStoreRegister(currInstruction);
-        break;
-      case OP_TRAP:
-        running = handleTrap(currInstruction);
-        break;
-      case OP_RES:
-      case OP_RTI:
-      default:
-        printf("Invalid opcode received: %d", opcode);
-        exit(1);
+  guest->regs[R_PC] = entryPoint;
+
+  // The guest's time starts with its first instruction.
+  resetClock(guest);
+
+  // The loops found by the idiom recogniser are remembered for as long as
+  // the guest doesn't write over them.
+  if (guest->idioms.enabled)
+  {
+    cacheIdioms(guest);
+
+    // Loops reached in earlier runs of the same images are remembered from
+    // the start. The run goes on without them if the cache can't be used.
+    if (analysisCache)
+    {
+      loadAnalysis(guest, analysisDirectory);
     }
   }
 
+  // The debugger gets to look at the guest before its first instruction.
+  if (debuggerAddress && !startDebugger(guest, debuggerAddress))
+  {
+    exit(1);
+  }
+
+  signal(SIGINT, handleInterrupt);
+  disableInputBuffering();
+
+  // Counting what the interpreter executes costs a little, so it only
+  // happens when something wants the counts. The host counters are divided
+  // by the exact counts, live metrics make do with samples.
+  if (perfCounters)
+  {
+    startPerfCounters();
+    runInterpreterCounted(guest, METRICS_INTERVAL,
+                          metrics ? publishMetrics : NULL);
+    stopPerfCounters();
+  }
+  else if (metrics)
+  {
+    runInterpreterSampled(guest, METRICS_INTERVAL, publishMetrics);
+  }
+  else if (clockRate)
+  {
+    runInterpreterClocked(guest);
+  }
+  else
+  {
+    runInterpreter(guest);
+  }
+
+  stopDebugger();
   restoreInputBuffering();
 }
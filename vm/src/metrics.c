@@ -0,0 +1,127 @@
+/*
+ * Publishes live counters of the running guest into a shared memory segment,
+ * so that lc3-top (see tools/lc3-top.c) can show how the guest is doing
+ * while it runs.
+ *
+ * The interpreter counts into its own memory and only copies the counters
+ * into the segment every METRICS_INTERVAL instructions or so. The opcode
+ * counts are estimated from samples (see runInterpreterSampled), which keeps
+ * the cost in the interpreter loop down to counting instructions. Updating the segment
+ * takes no locks or system calls (clock_gettime doesn't enter the kernel).
+ */
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "architecture.h"
+#include "idiom.h"
+#include "interpreter.h"
+#include "metrics.h"
+
+static struct Metrics* metrics;
+static char segmentName[256];
+
+static uint64_t nanoseconds()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/*
+ * Creates the segment, named METRICS_PREFIX followed by the process id
+ * unless `name` is given. Returns 0 if it couldn't be created.
+ */
+int initMetrics(const char* name)
+{
+  if (name)
+  {
+    snprintf(segmentName, sizeof(segmentName), "%s%s",
+             name[0] == '/' ? "" : "/", name);
+  }
+  else
+  {
+    snprintf(segmentName, sizeof(segmentName), METRICS_PREFIX "%d",
+             (int)getpid());
+  }
+
+  int fd = shm_open(segmentName, O_CREAT | O_RDWR | O_TRUNC, 0644);
+  if (fd < 0 || ftruncate(fd, sizeof(struct Metrics)) < 0)
+  {
+    fprintf(stderr, "Failed to create metrics segment %s: %s\n", segmentName,
+            strerror(errno));
+    return 0;
+  }
+  metrics = mmap(NULL, sizeof(struct Metrics), PROT_READ | PROT_WRITE,
+                 MAP_SHARED, fd, 0);
+  close(fd);
+  if (metrics == MAP_FAILED)
+  {
+    metrics = NULL;
+    shm_unlink(segmentName);
+    return 0;
+  }
+
+  metrics->magic = METRICS_MAGIC;
+  metrics->version = METRICS_VERSION;
+  metrics->pid = getpid();
+  metrics->running = 1;
+  metrics->startNs = metrics->updatedNs = nanoseconds();
+  return 1;
+}
+
+// Copies the counters into the segment.
+void publishMetrics()
+{
+  if (!metrics)
+  {
+    return;
+  }
+
+  // The clock counts everything the guest retires, native loops included.
+  uint64_t instructions = mainGuest.clock.instructions;
+  uint64_t idioms = 0;
+  for (int idiom = 0; idiom < IDIOM_KINDS; idiom++)
+  {
+    idioms += mainGuest.idioms.instructions[idiom];
+  }
+  uint64_t now = nanoseconds();
+
+  __atomic_store_n(&metrics->sequence, metrics->sequence + 1,
+                   __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  if (now > metrics->updatedNs)
+  {
+    metrics->mips = (double)(instructions - metrics->instructions)
+      * 1000 / (now - metrics->updatedNs);
+  }
+  metrics->updatedNs = now;
+  metrics->instructions = instructions;
+  memcpy(metrics->opcodes, opcodeCounts, sizeof(metrics->opcodes));
+  metrics->idiomInstructions = idioms;
+  memcpy(metrics->traps, mainGuest.stats.traps, sizeof(metrics->traps));
+  metrics->kbsrPolls = mainGuest.stats.kbsrPolls;
+  metrics->outputBytes = mainGuest.stats.outputBytes;
+  metrics->inputWaitNs = mainGuest.stats.inputWaitNs;
+
+  __atomic_store_n(&metrics->sequence, metrics->sequence + 1,
+                   __ATOMIC_RELEASE);
+}
+
+/*
+ * Publishes the final counters and removes the segment. A reader that
+ * already has it mapped still sees the final counters, with `running`
+ * cleared.
+ */
+void closeMetrics()
+{
+  if (!metrics)
+  {
+    return;
+  }
+  publishMetrics();
+  metrics->running = 0;
+  munmap(metrics, sizeof(struct Metrics));
+  metrics = NULL;
+  shm_unlink(segmentName);
+}
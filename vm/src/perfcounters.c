@@ -0,0 +1,346 @@
+/*
+ * Measures the host's hardware performance counters around the interpreter
+ * loop with perf_event_open, so that tuning the dispatch loop can be based on
+ * numbers rather than guesses.
+ *
+ * Reading the counters around every guest instruction would cost far more
+ * than the instruction itself, so instead each counter is set up to raise a
+ * signal every `period` events. The signal handler charges those events to
+ * whatever the VM was executing at that moment (the engine and the guest
+ * opcode), which over a run gives an accurate statistical picture of where
+ * the host's cycles, instructions and branch misses go. The totals for the
+ * whole run are read from the counters themselves.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#include "architecture.h"
+#include "idiom.h"
+#include "spmd.h"
+#include "interpreter.h"
+#include "perfcounters.h"
+
+volatile sig_atomic_t perfEngine = ENGINE_INTERPRETER;
+
+// The counters we sample. Cycles fall back to the task clock (in
+// nanoseconds) on hosts that don't expose hardware counters, e.g. most VMs,
+// so that the attribution still works there.
+enum Event
+{
+  EVENT_CYCLES = 0,
+  EVENT_INSTRUCTIONS,
+  EVENT_BRANCHES,
+  EVENT_BRANCH_MISSES,
+  EVENT_L1D_MISSES,
+  EVENT_L1I_MISSES,
+  EVENTS
+};
+
+struct PerfEvent
+{
+  const char* name;
+  uint32_t type;
+  uint64_t config;
+  // Prime periods so the samples don't fall into step with the guest's loops.
+  uint64_t period;
+  int fd;
+  uint64_t total;
+};
+
+#define CACHE_READ_MISS(cache) ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) \
+  | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static struct PerfEvent events[EVENTS] = {
+  { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, 100003, -1, 0 },
+  { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, 100003,
+    -1, 0 },
+  { "branches", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS, 20011,
+    -1, 0 },
+  { "branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, 1009,
+    -1, 0 },
+  { "L1D-misses", PERF_TYPE_HW_CACHE, CACHE_READ_MISS(PERF_COUNT_HW_CACHE_L1D),
+    1009, -1, 0 },
+  { "L1I-misses", PERF_TYPE_HW_CACHE, CACHE_READ_MISS(PERF_COUNT_HW_CACHE_L1I),
+    1009, -1, 0 }
+};
+
+// Samples for each event, engine and opcode (or idiom).
+static uint64_t samples[EVENTS][ENGINES][16];
+static int enabled;
+static int running;
+static int cyclesAreTime;
+
+static const char* ENGINE_NAMES[ENGINES] = { "interpreter", "idiom", "spmd" };
+static const char* OPCODE_NAMES[16] = {
+  "BR", "ADD", "LD", "ST", "JSR", "AND", "LDR", "STR",
+  "RTI", "NOT", "LDI", "STI", "JMP", "RES", "LEA", "TRAP"
+};
+static const char* IDIOM_NAMES[IDIOM_KINDS] = {
+  "none", "multiply", "shift", "copy"
+};
+
+static int openEvent(uint32_t type, uint64_t config, uint64_t period)
+{
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.sample_period = period;
+  attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED
+    | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/*
+ * Charges `period` events to whatever the VM is doing. The counter is
+ * disabled after each overflow, so it has to be re-armed for the next one.
+ */
+static void handleOverflow(int signal, siginfo_t* info, void* context)
+{
+  for (int event = 0; event < EVENTS; event++)
+  {
+    if (events[event].fd == info->si_fd)
+    {
+      if (perfEngine == ENGINE_SPMD)
+      {
+        samples[event][ENGINE_SPMD][spmdCurrentOpcode & 0xF]++;
+      }
+      else if (currentIdiom != IDIOM_NONE)
+      {
+        samples[event][ENGINE_IDIOM][currentIdiom & 0xF]++;
+      }
+      else
+      {
+        samples[event][ENGINE_INTERPRETER][currentOpcode & 0xF]++;
+      }
+      if (running)
+      {
+        ioctl(info->si_fd, PERF_EVENT_IOC_REFRESH, 1);
+      }
+      return;
+    }
+  }
+}
+
+/*
+ * Opens the counters. Events the host doesn't support are left out of the
+ * report, but without something to measure time there is nothing to report
+ * so then we give up and return 0.
+ */
+int initPerfCounters()
+{
+  for (int event = 0; event < EVENTS; event++)
+  {
+    struct PerfEvent* perfEvent = &events[event];
+    perfEvent->fd = openEvent(perfEvent->type, perfEvent->config,
+                              perfEvent->period);
+    if (perfEvent->fd < 0 && event == EVENT_CYCLES)
+    {
+      perfEvent->name = "task-clock (ns)";
+      perfEvent->type = PERF_TYPE_SOFTWARE;
+      perfEvent->config = PERF_COUNT_SW_TASK_CLOCK;
+      perfEvent->fd = openEvent(perfEvent->type, perfEvent->config,
+                                perfEvent->period);
+      cyclesAreTime = 1;
+    }
+    if (perfEvent->fd < 0)
+    {
+      if (event == EVENT_CYCLES)
+      {
+        fprintf(stderr, "perf_event_open failed: %s\n", strerror(errno));
+        return 0;
+      }
+      fprintf(stderr, "perf counter %s is not available, leaving it out\n",
+              perfEvent->name);
+      continue;
+    }
+
+    // Deliver the overflow of this counter to this thread as a signal that
+    // carries the file descriptor, so we know which counter it was.
+    struct f_owner_ex owner = { F_OWNER_TID, syscall(SYS_gettid) };
+    fcntl(perfEvent->fd, F_SETFL, O_ASYNC);
+    fcntl(perfEvent->fd, F_SETSIG, SIGIO);
+    fcntl(perfEvent->fd, F_SETOWN_EX, &owner);
+  }
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_sigaction = handleOverflow;
+  action.sa_flags = SA_SIGINFO | SA_RESTART;
+  sigaction(SIGIO, &action, NULL);
+
+  enabled = 1;
+  return 1;
+}
+
+void startPerfCounters()
+{
+  running = 1;
+  for (int event = 0; event < EVENTS; event++)
+  {
+    if (events[event].fd >= 0)
+    {
+      ioctl(events[event].fd, PERF_EVENT_IOC_RESET, 0);
+      ioctl(events[event].fd, PERF_EVENT_IOC_REFRESH, 1);
+    }
+  }
+}
+
+/*
+ * Stops the counters and reads their totals. If the kernel had to share the
+ * hardware between more counters than it has, the totals are scaled up by
+ * the fraction of the time each counter was actually counting.
+ */
+void stopPerfCounters()
+{
+  if (!running)
+  {
+    return;
+  }
+  running = 0;
+  for (int event = 0; event < EVENTS; event++)
+  {
+    struct PerfEvent* perfEvent = &events[event];
+    if (perfEvent->fd < 0)
+    {
+      continue;
+    }
+    ioctl(perfEvent->fd, PERF_EVENT_IOC_DISABLE, 0);
+
+    uint64_t values[3];
+    if (read(perfEvent->fd, values, sizeof(values)) == sizeof(values))
+    {
+      perfEvent->total = values[2] && values[2] < values[1]
+        ? (uint64_t)((double)values[0] * values[1] / values[2]) : values[0];
+    }
+  }
+}
+
+// The estimated number of events charged to one engine and opcode.
+static uint64_t estimate(int event, int engine, int opcode)
+{
+  return samples[event][engine][opcode] * events[event].period;
+}
+
+static uint64_t guestInstructions(int engine, int opcode)
+{
+  switch (engine)
+  {
+    case ENGINE_INTERPRETER:
+      return opcodeCounts[opcode];
+    case ENGINE_IDIOM:
+      return opcode < IDIOM_KINDS
+        ? mainGuest.idioms.instructions[opcode] : 0;
+    case ENGINE_SPMD:
+      return spmdInstructions[opcode];
+  }
+  return 0;
+}
+
+static void printRatio(uint64_t numerator, uint64_t denominator, int available)
+{
+  if (available && denominator)
+  {
+    fprintf(stderr, " %10.3f", (double)numerator / denominator);
+  }
+  else
+  {
+    fprintf(stderr, " %10s", "-");
+  }
+}
+
+/*
+ * Prints the host cost of each guest opcode (and idiom) for each engine, and
+ * the totals for the whole run, to stderr.
+ */
+void reportPerfCounters()
+{
+  if (!enabled)
+  {
+    return;
+  }
+  stopPerfCounters();
+
+  uint64_t guestTotal = 0;
+  for (int engine = 0; engine < ENGINES; engine++)
+  {
+    for (int opcode = 0; opcode < 16; opcode++)
+    {
+      guestTotal += guestInstructions(engine, opcode);
+    }
+  }
+
+  fprintf(stderr, "\nHost performance counters\n");
+  for (int event = 0; event < EVENTS; event++)
+  {
+    if (events[event].fd >= 0)
+    {
+      fprintf(stderr, "  %-16s %16llu", events[event].name,
+              (unsigned long long)events[event].total);
+      printRatio(events[event].total, guestTotal, 1);
+      fprintf(stderr, " per guest instruction\n");
+    }
+  }
+  if (events[EVENT_BRANCHES].fd >= 0 && events[EVENT_BRANCH_MISSES].fd >= 0
+      && events[EVENT_BRANCHES].total)
+  {
+    fprintf(stderr, "  branch miss rate %15.2f%%\n",
+            100.0 * events[EVENT_BRANCH_MISSES].total
+            / events[EVENT_BRANCHES].total);
+  }
+
+  // Sampled estimates per engine and opcode.
+  const char* cycleName = cyclesAreTime ? "ns/instr" : "cycles/in";
+  int hasInstructions = events[EVENT_INSTRUCTIONS].fd >= 0;
+  int hasBranches = events[EVENT_BRANCHES].fd >= 0;
+  int hasMisses = events[EVENT_BRANCH_MISSES].fd >= 0;
+  int hasL1d = events[EVENT_L1D_MISSES].fd >= 0;
+  int hasL1i = events[EVENT_L1I_MISSES].fd >= 0;
+
+  fprintf(stderr, "\n  %-12s %-9s %14s %10s %10s %10s %10s %10s %10s\n",
+          "Engine", "Opcode", "guest instrs", cycleName, "host/in",
+          "br-miss/in", "br-miss %", "L1D/in", "L1I/in");
+  for (int engine = 0; engine < ENGINES; engine++)
+  {
+    for (int opcode = 0; opcode < 16; opcode++)
+    {
+      uint64_t guest = guestInstructions(engine, opcode);
+      if (!guest && !samples[EVENT_CYCLES][engine][opcode])
+      {
+        continue;
+      }
+      const char* name = engine == ENGINE_IDIOM
+        ? (opcode < IDIOM_KINDS ? IDIOM_NAMES[opcode] : "?")
+        : OPCODE_NAMES[opcode];
+
+      fprintf(stderr, "  %-12s %-9s %14llu", ENGINE_NAMES[engine], name,
+              (unsigned long long)guest);
+      printRatio(estimate(EVENT_CYCLES, engine, opcode), guest, 1);
+      printRatio(estimate(EVENT_INSTRUCTIONS, engine, opcode), guest,
+                 hasInstructions);
+      printRatio(estimate(EVENT_BRANCH_MISSES, engine, opcode), guest,
+                 hasMisses);
+      if (hasBranches && hasMisses
+          && estimate(EVENT_BRANCHES, engine, opcode))
+      {
+        fprintf(stderr, " %9.2f%%",
+                100.0 * estimate(EVENT_BRANCH_MISSES, engine, opcode)
+                / estimate(EVENT_BRANCHES, engine, opcode));
+      }
+      else
+      {
+        fprintf(stderr, " %10s", "-");
+      }
+      printRatio(estimate(EVENT_L1D_MISSES, engine, opcode), guest, hasL1d);
+      printRatio(estimate(EVENT_L1I_MISSES, engine, opcode), guest, hasL1i);
+      fprintf(stderr, "\n");
+    }
+  }
+}
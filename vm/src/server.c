@@ -0,0 +1,620 @@
+/*
+ * A job server that keeps the images loaded and runs guests for other
+ * processes, so that running a short guest costs a few microseconds rather
+ * than a process start, reading the images and setting up the terminal.
+ *
+ * Clients connect to a Unix domain socket and send a single job:
+ *
+ *   RUN <budget> <input-length> <image> [<image> ...]\n<input bytes>
+ *
+ * The images are named by the path they were given to the server with (or
+ * just its file name) and are placed in memory in the order given. The input
+ * bytes are the guest's keyboard, and the budget is the most instructions
+ * the guest may execute (0 for the server's maximum).
+ *
+ * The guest's output is streamed back as it is produced in chunks of
+ *
+ *   OUT <length>\n<output bytes>
+ *
+ * followed by a final line when the guest stops:
+ *
+ *   END <halted|budget|input|invalid-opcode> <instructions> <microseconds>\n
+ *
+ * where `input` means the guest wanted more input than it was given. A job
+ * that can't be accepted is answered with `ERR <reason>\n`, or with
+ * `BUSY <queued>\n` when the queue of waiting jobs is full.
+ *
+ * The main thread accepts connections and reads the jobs from all of them at
+ * once as they arrive, with poll, so that a client that is slow to send its
+ * job holds nobody else up. Complete jobs are run by a pool of worker
+ * threads, each with a guest of its own.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+
+#include "architecture.h"
+#include "interpreter.h"
+#include "idiom.h"
+#include "image.h"
+#include "clock.h"
+#include "server.h"
+
+// Output is sent when this much has built up, or when the guest flushes its
+// output and nothing has been sent for OUTPUT_INTERVAL_NS.
+#define OUTPUT_CHUNK 4096
+#define OUTPUT_INTERVAL_NS 1000000
+
+// The longest request line we accept.
+#define MAX_REQUEST_LINE 4096
+
+// How long a client has to send the whole of its job.
+#define REQUEST_TIMEOUT_NS 1000000000ULL
+
+// The most connections whose jobs are read at once, any more wait in the
+// listen backlog.
+#define MAX_PENDING 256
+
+struct Job
+{
+  // First, so that the console callbacks can get at the job.
+  struct Console console;
+  int fd;
+  const struct Image* images[MAX_JOB_IMAGES];
+  int imageCount;
+  uint64_t budget;
+  char* input;
+  size_t inputLength;
+  size_t inputPos;
+  char output[OUTPUT_CHUNK];
+  size_t outputLength;
+  uint64_t lastSend;
+  uint64_t accepted;
+};
+
+// A connection whose job hasn't been read in full yet.
+struct Pending
+{
+  int fd;
+  uint64_t accepted;
+  // The request line as far as it has arrived, until it is complete and
+  // has been turned into `job`.
+  char line[MAX_REQUEST_LINE + 1];
+  size_t lineLength;
+  struct Job* job;
+  size_t inputReceived;
+};
+
+// The preloaded images.
+static struct Image* images;
+static const char** imageNames;
+static int imagesLoaded;
+
+// The jobs waiting for a worker, as a ring buffer.
+static struct Job** queue;
+static int queueCapacity;
+static int queueHead;
+static int queueLength;
+static pthread_mutex_t queueLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queueReady = PTHREAD_COND_INITIALIZER;
+
+static uint64_t nanoseconds()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Sends all of `data`, returning 0 if the client has gone away.
+static int sendAll(int fd, const char* data, size_t length)
+{
+  while (length)
+  {
+    ssize_t sent = send(fd, data, length, MSG_NOSIGNAL);
+    if (sent < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if (sent <= 0)
+    {
+      return 0;
+    }
+    data += sent;
+    length -= sent;
+  }
+  return 1;
+}
+
+static void sendLine(int fd, const char* line)
+{
+  sendAll(fd, line, strlen(line));
+}
+
+// Sends the output collected so far as an OUT chunk.
+static void sendOutput(struct Job* job)
+{
+  char header[32];
+  int headerLength = snprintf(header, sizeof(header), "OUT %zu\n",
+                              job->outputLength);
+
+  if (!sendAll(job->fd, header, headerLength)
+      || !sendAll(job->fd, job->output, job->outputLength))
+  {
+    // Nobody is listening any more, so there's no point carrying on.
+    job->console.stopped = STOP_OUTPUT;
+  }
+  job->outputLength = 0;
+  job->lastSend = nanoseconds();
+}
+
+static int jobGetChar(struct Console* console)
+{
+  struct Job* job = (struct Job*)console;
+  if (job->inputPos < job->inputLength)
+  {
+    return (unsigned char)job->input[job->inputPos++];
+  }
+  console->stopped = STOP_INPUT;
+  return EOF;
+}
+
+// A guest polling the keyboard after all of its input has been read would
+// otherwise spin until its budget runs out.
+static int jobKeyReady(struct Console* console)
+{
+  struct Job* job = (struct Job*)console;
+  if (job->inputPos < job->inputLength)
+  {
+    return 1;
+  }
+  console->stopped = STOP_INPUT;
+  return 0;
+}
+
+static void jobPutChar(struct Console* console, char c)
+{
+  struct Job* job = (struct Job*)console;
+  job->output[job->outputLength++] = c;
+  if (job->outputLength == OUTPUT_CHUNK)
+  {
+    sendOutput(job);
+  }
+}
+
+static void jobFlush(struct Console* console)
+{
+  struct Job* job = (struct Job*)console;
+  if (job->outputLength
+      && nanoseconds() - job->lastSend >= OUTPUT_INTERVAL_NS)
+  {
+    sendOutput(job);
+  }
+}
+
+static void freeJob(struct Job* job)
+{
+  close(job->fd);
+  free(job->input);
+  free(job);
+}
+
+/*
+ * Runs a job on the worker's guest from a clean machine, the same way the VM
+ * would run it from the command line.
+ */
+static void runJob(struct Guest* guest, struct Job* job)
+{
+  memset(guest->mem, 0, sizeof(guest->mem));
+  memset(guest->regs, 0, sizeof(guest->regs));
+  for (int idx = 0; idx < job->imageCount; idx++)
+  {
+    placeImage(guest, job->images[idx]);
+  }
+  guest->regs[R_COND] = FL_ZRO;
+  guest->regs[R_PC] = PC_START;
+  for (int idx = 0; idx < job->imageCount; idx++)
+  {
+    if (job->images[idx]->hasEntry)
+    {
+      guest->regs[R_PC] = job->images[idx]->entry;
+    }
+  }
+  resetClock(guest);
+
+  job->lastSend = nanoseconds();
+  guest->console = &job->console;
+  uint64_t executed;
+  int running = runInterpreterBudget(guest, job->budget, &executed);
+  guest->console = NULL;
+
+  if (job->console.stopped == STOP_OUTPUT)
+  {
+    freeJob(job);
+    return;
+  }
+  if (job->outputLength)
+  {
+    sendOutput(job);
+  }
+
+  const char* reason = "halted";
+  if (job->console.stopped == STOP_INPUT)
+  {
+    reason = "input";
+  }
+  else if (job->console.stopped == STOP_INVALID_OPCODE)
+  {
+    reason = "invalid-opcode";
+  }
+  else if (running)
+  {
+    reason = "budget";
+  }
+
+  char end[96];
+  snprintf(end, sizeof(end), "END %s %llu %llu\n", reason,
+           (unsigned long long)executed,
+           (unsigned long long)(nanoseconds() - job->accepted) / 1000);
+  sendLine(job->fd, end);
+  freeJob(job);
+}
+
+static void* runWorker(void* argument)
+{
+  struct Guest* guest = argument;
+  for (;;)
+  {
+    pthread_mutex_lock(&queueLock);
+    while (queueLength == 0)
+    {
+      pthread_cond_wait(&queueReady, &queueLock);
+    }
+    struct Job* job = queue[queueHead];
+    queueHead = (queueHead + 1) % queueCapacity;
+    queueLength--;
+    pthread_mutex_unlock(&queueLock);
+
+    runJob(guest, job);
+  }
+  return NULL;
+}
+
+// Finds a preloaded image by the path it was given with or its file name.
+static const struct Image* findImage(const char* name)
+{
+  for (int idx = 0; idx < imagesLoaded; idx++)
+  {
+    const char* slash = strrchr(imageNames[idx], '/');
+    if (strcmp(imageNames[idx], name) == 0
+        || (slash && strcmp(slash + 1, name) == 0))
+    {
+      return &images[idx];
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Turns the request line of a job into a job, with room for its input, or
+ * turns it away with the reason why. `restLength` bytes of the input came
+ * with the line. Returns the job, or NULL if it was turned away.
+ */
+static struct Job* parseRequest(int fd, char* line, size_t restLength,
+                                uint64_t accepted)
+{
+  char* state;
+  char* command = strtok_r(line, " ", &state);
+  char* budget = strtok_r(NULL, " ", &state);
+  char* inputLength = strtok_r(NULL, " ", &state);
+  if (!command || strcmp(command, "RUN") != 0 || !budget || !inputLength)
+  {
+    sendLine(fd, "ERR malformed request\n");
+    return NULL;
+  }
+
+  struct Job* job = calloc(1, sizeof(struct Job));
+  job->fd = fd;
+  job->accepted = accepted;
+  job->budget = strtoull(budget, NULL, 10);
+  job->inputLength = strtoull(inputLength, NULL, 10);
+  job->console = (struct Console){ jobGetChar, jobKeyReady, jobPutChar,
+                                   jobFlush, STOP_NONE };
+
+  const char* error = NULL;
+  if (job->budget == 0)
+  {
+    job->budget = MAX_JOB_BUDGET;
+  }
+  if (job->budget > MAX_JOB_BUDGET)
+  {
+    error = "ERR budget too large\n";
+  }
+  if (job->inputLength > MAX_JOB_INPUT || restLength > job->inputLength)
+  {
+    error = "ERR input too large\n";
+  }
+
+  char* name;
+  while (!error && (name = strtok_r(NULL, " ", &state)))
+  {
+    if (job->imageCount == MAX_JOB_IMAGES)
+    {
+      error = "ERR too many images\n";
+    }
+    else if (!(job->images[job->imageCount++] = findImage(name)))
+    {
+      error = "ERR unknown image\n";
+    }
+  }
+  if (!error && job->imageCount == 0)
+  {
+    error = "ERR no images\n";
+  }
+  if (error)
+  {
+    sendLine(fd, error);
+    free(job);
+    return NULL;
+  }
+  job->input = malloc(job->inputLength + 1);
+  return job;
+}
+
+/*
+ * Reads whatever has arrived on a pending connection, without waiting.
+ * Returns 1 once the whole job has been read, 0 if there is more to come and
+ * -1 if the job was turned away.
+ */
+static int readPending(struct Pending* pending)
+{
+  struct Job* job = pending->job;
+  char* buffer = job ? job->input + pending->inputReceived
+    : pending->line + pending->lineLength;
+  size_t space = job ? job->inputLength - pending->inputReceived
+    : MAX_REQUEST_LINE - pending->lineLength;
+
+  ssize_t received = recv(pending->fd, buffer, space, 0);
+  if (received < 0 && (errno == EINTR || errno == EAGAIN))
+  {
+    return 0;
+  }
+  if (received <= 0)
+  {
+    sendLine(pending->fd, job ? "ERR truncated input\n"
+             : "ERR malformed request\n");
+    return -1;
+  }
+  if (job)
+  {
+    pending->inputReceived += received;
+    return pending->inputReceived == job->inputLength;
+  }
+
+  char* newline = memchr(buffer, '\n', received);
+  pending->lineLength += received;
+  if (!newline)
+  {
+    if (pending->lineLength < MAX_REQUEST_LINE)
+    {
+      return 0;
+    }
+    sendLine(pending->fd, "ERR malformed request\n");
+    return -1;
+  }
+
+  // Anything read past the end of the line is already part of the input.
+  size_t restLength = pending->line + pending->lineLength - newline - 1;
+  *newline = '\0';
+  job = parseRequest(pending->fd, pending->line, restLength,
+                     pending->accepted);
+  if (!job)
+  {
+    return -1;
+  }
+  memcpy(job->input, newline + 1, restLength);
+  pending->job = job;
+  pending->inputReceived = restLength;
+  return restLength == job->inputLength;
+}
+
+// Queues a job for the workers, unless the queue is already full.
+static int queueJob(struct Job* job)
+{
+  pthread_mutex_lock(&queueLock);
+  if (queueLength == queueCapacity)
+  {
+    int queued = queueLength;
+    pthread_mutex_unlock(&queueLock);
+
+    char busy[32];
+    snprintf(busy, sizeof(busy), "BUSY %d\n", queued);
+    sendLine(job->fd, busy);
+    return 0;
+  }
+  queue[(queueHead + queueLength) % queueCapacity] = job;
+  queueLength++;
+  pthread_cond_signal(&queueReady);
+  pthread_mutex_unlock(&queueLock);
+  return 1;
+}
+
+static int listenOn(const char* socketPath)
+{
+  struct sockaddr_un address = { .sun_family = AF_UNIX };
+  if (strlen(socketPath) >= sizeof(address.sun_path))
+  {
+    fprintf(stderr, "Socket path is too long: %s\n", socketPath);
+    return -1;
+  }
+  strcpy(address.sun_path, socketPath);
+
+  // A socket left behind by an earlier server is replaced, anything else
+  // at that path is left alone.
+  struct stat existing;
+  if (lstat(socketPath, &existing) == 0 && S_ISSOCK(existing.st_mode))
+  {
+    unlink(socketPath);
+  }
+
+  // Non-blocking, so that accepting a client that has already gone away
+  // can't hold up the jobs being read.
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (fd < 0 || bind(fd, (struct sockaddr*)&address, sizeof(address)) < 0
+      || listen(fd, SOMAXCONN) < 0)
+  {
+    fprintf(stderr, "Failed to listen on %s: %s\n", socketPath,
+            strerror(errno));
+    return -1;
+  }
+  return fd;
+}
+
+/*
+ * Loads the images, starts the workers and serves jobs until the process is
+ * killed. Returns 0 if the server couldn't be started.
+ */
+int runServer(const char* socketPath, const char** imagePaths, int imageCount,
+              int workerCount, int queueDepth)
+{
+  images = calloc(imageCount, sizeof(struct Image));
+  imageNames = imagePaths;
+  for (; imagesLoaded < imageCount; imagesLoaded++)
+  {
+    if (!loadImage(imagePaths[imagesLoaded], &images[imagesLoaded]))
+    {
+      fprintf(stderr, "Failed to load image: %s\n", imagePaths[imagesLoaded]);
+      return 0;
+    }
+  }
+
+  int listenFd = listenOn(socketPath);
+  if (listenFd < 0)
+  {
+    return 0;
+  }
+
+  queueCapacity = queueDepth;
+  queue = calloc(queueCapacity, sizeof(struct Job*));
+  for (int idx = 0; idx < workerCount; idx++)
+  {
+    // Every worker runs its jobs on a guest of its own.
+    struct Guest* guest = newGuest();
+    if (!guest)
+    {
+      fprintf(stderr, "Failed to allocate a guest for a worker\n");
+      return 0;
+    }
+    guest->idioms.enabled = mainGuest.idioms.enabled;
+
+    pthread_t worker;
+    int error = pthread_create(&worker, NULL, runWorker, guest);
+    if (error)
+    {
+      fprintf(stderr, "Failed to start worker: %s\n", strerror(error));
+      return 0;
+    }
+    pthread_detach(worker);
+  }
+  fprintf(stderr, "Serving %d images on %s with %d workers\n", imageCount,
+          socketPath, workerCount);
+
+  struct Pending* pending[MAX_PENDING];
+  struct pollfd polled[MAX_PENDING + 1];
+  int pendingCount = 0;
+  for (;;)
+  {
+    // Wait for a new client or more of a job, but no longer than until the
+    // first job that is being read runs out of time.
+    uint64_t now = nanoseconds();
+    int timeout = -1;
+    polled[0] = (struct pollfd){ listenFd,
+                                 pendingCount < MAX_PENDING ? POLLIN : 0 };
+    for (int idx = 0; idx < pendingCount; idx++)
+    {
+      polled[idx + 1] = (struct pollfd){ pending[idx]->fd, POLLIN };
+      uint64_t deadline = pending[idx]->accepted + REQUEST_TIMEOUT_NS;
+      int left = deadline > now ? (deadline - now + 999999) / 1000000 : 0;
+      if (timeout < 0 || left < timeout)
+      {
+        timeout = left;
+      }
+    }
+    if (poll(polled, pendingCount + 1, timeout) < 0 && errno != EINTR)
+    {
+      fprintf(stderr, "Failed to poll: %s\n", strerror(errno));
+      return 0;
+    }
+
+    // Finished connections are replaced by the last one, which has already
+    // been looked at, so this goes backwards.
+    now = nanoseconds();
+    for (int idx = pendingCount - 1; idx >= 0; idx--)
+    {
+      struct Pending* connection = pending[idx];
+      int status = 0;
+      if (polled[idx + 1].revents)
+      {
+        status = readPending(connection);
+      }
+      else if (now - connection->accepted >= REQUEST_TIMEOUT_NS)
+      {
+        sendLine(connection->fd, connection->job ? "ERR truncated input\n"
+                 : "ERR malformed request\n");
+        status = -1;
+      }
+      if (!status)
+      {
+        continue;
+      }
+
+      struct Job* job = connection->job;
+      if (status > 0)
+      {
+        // The workers send the output with blocking calls.
+        fcntl(job->fd, F_SETFL, fcntl(job->fd, F_GETFL) & ~O_NONBLOCK);
+        if (!queueJob(job))
+        {
+          freeJob(job);
+        }
+      }
+      else if (job)
+      {
+        freeJob(job);
+      }
+      else
+      {
+        close(connection->fd);
+      }
+      free(connection);
+      pending[idx] = pending[--pendingCount];
+    }
+
+    while ((polled[0].revents & POLLIN) && pendingCount < MAX_PENDING)
+    {
+      int fd = accept(listenFd, NULL, NULL);
+      if (fd < 0)
+      {
+        if (errno == EINTR || errno == ECONNABORTED)
+        {
+          continue;
+        }
+        if (errno == EAGAIN)
+        {
+          break;
+        }
+        fprintf(stderr, "Failed to accept: %s\n", strerror(errno));
+        return 0;
+      }
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+      struct Pending* connection = calloc(1, sizeof(struct Pending));
+      connection->fd = fd;
+      connection->accepted = nanoseconds();
+      pending[pendingCount++] = connection;
+    }
+  }
+}
@@ -0,0 +1,150 @@
+/*
+ * Snapshots of a guest. A snapshot keeps memory as a table
+ * of reference counted pages, and taking a snapshot relative to another one
+ * (its base) shares every page that hasn't changed since. A guest that only
+ * touches a few pages between snapshots, as most do, costs a few pages per
+ * snapshot rather than all of memory.
+ *
+ * Pages are never changed once they are in a snapshot, so snapshots can be
+ * shared between threads. Only the reference counts are updated atomically.
+ */
+#include "architecture.h"
+#include "codewatch.h"
+#include "snapshot.h"
+
+// How many snapshot pages make up a page the guest's writes are watched in.
+#define PAGES_PER_WATCH_PAGE (WATCH_PAGE_WORDS / SNAPSHOT_PAGE_WORDS)
+
+static uint64_t pagesInUse;
+
+static uint64_t hashWords(const uint16_t* words)
+{
+  uint64_t hash = 0;
+  for (int idx = 0; idx < SNAPSHOT_PAGE_WORDS; idx += 4)
+  {
+    uint64_t chunk;
+    memcpy(&chunk, words + idx, sizeof(chunk));
+    hash = (hash ^ chunk) * 0x9E3779B97F4A7C15ULL;
+    hash ^= hash >> 29;
+  }
+  return hash;
+}
+
+static struct SnapshotPage* newPage(const uint16_t* words)
+{
+  struct SnapshotPage* page = malloc(sizeof(struct SnapshotPage));
+  page->references = 1;
+  memcpy(page->words, words, sizeof(page->words));
+  page->hash = hashWords(words);
+  __atomic_add_fetch(&pagesInUse, 1, __ATOMIC_RELAXED);
+  return page;
+}
+
+/*
+ * Takes a snapshot of the memory and registers of `guest`. Pages that are the
+ * same as in `base` (if given) are shared with it. `written` has a bit for
+ * every watched page (see codewatch.h) the guest may have written since it
+ * was in the state of `base`, and the pages outside those are shared without
+ * looking at them. Pass ~0 if it isn't known.
+ */
+struct Snapshot* takeSnapshot(const struct Guest* guest,
+                              const struct Snapshot* base, uint32_t written)
+{
+  struct Snapshot* snapshot = malloc(sizeof(struct Snapshot));
+  uint64_t hash = 0;
+
+  for (int idx = 0; idx < SNAPSHOT_PAGES; idx++)
+  {
+    const uint16_t* words = guest->mem + idx * SNAPSHOT_PAGE_WORDS;
+    int maybeWritten = (written >> (idx / PAGES_PER_WATCH_PAGE)) & 1;
+    struct SnapshotPage* page;
+    if (base && (!maybeWritten
+                 || memcmp(base->pages[idx]->words, words,
+                           sizeof(page->words)) == 0))
+    {
+      page = base->pages[idx];
+      __atomic_add_fetch(&page->references, 1, __ATOMIC_RELAXED);
+    }
+    else
+    {
+      page = newPage(words);
+    }
+    snapshot->pages[idx] = page;
+    hash = (hash ^ page->hash) * 0xBF58476D1CE4E5B9ULL + idx;
+  }
+
+  memcpy(snapshot->regs, guest->regs, sizeof(guest->regs));
+  for (int reg = 0; reg < R_MAX; reg++)
+  {
+    hash = (hash ^ guest->regs[reg]) * 0x94D049BB133111EBULL;
+  }
+  snapshot->hash = hash ^ (hash >> 31);
+  return snapshot;
+}
+
+/*
+ * Puts `guest` back into the state of `snapshot`. If `current` is given, the
+ * guest is known to be in its state apart from the watched pages in
+ * `written` (as for takeSnapshot), and only the pages that may differ from
+ * `snapshot` are copied.
+ */
+void restoreSnapshot(struct Guest* guest, const struct Snapshot* snapshot,
+                     const struct Snapshot* current, uint32_t written)
+{
+  for (int idx = 0; idx < SNAPSHOT_PAGES; idx++)
+  {
+    if (current && current->pages[idx] == snapshot->pages[idx]
+        && !((written >> (idx / PAGES_PER_WATCH_PAGE)) & 1))
+    {
+      continue;
+    }
+    memcpy(guest->mem + idx * SNAPSHOT_PAGE_WORDS, snapshot->pages[idx]->words,
+           sizeof(snapshot->pages[idx]->words));
+  }
+  memcpy(guest->regs, snapshot->regs, sizeof(guest->regs));
+}
+
+// Whether `first` and `second` hold the same state, whatever their hashes.
+int sameSnapshot(const struct Snapshot* first, const struct Snapshot* second)
+{
+  if (memcmp(first->regs, second->regs, sizeof(first->regs)) != 0)
+  {
+    return 0;
+  }
+  for (int idx = 0; idx < SNAPSHOT_PAGES; idx++)
+  {
+    const struct SnapshotPage* page = first->pages[idx];
+    const struct SnapshotPage* other = second->pages[idx];
+    if (page != other && (page->hash != other->hash
+                          || memcmp(page->words, other->words,
+                                    sizeof(page->words)) != 0))
+    {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+void freeSnapshot(struct Snapshot* snapshot)
+{
+  if (!snapshot)
+  {
+    return;
+  }
+  for (int idx = 0; idx < SNAPSHOT_PAGES; idx++)
+  {
+    struct SnapshotPage* page = snapshot->pages[idx];
+    if (__atomic_sub_fetch(&page->references, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+      free(page);
+      __atomic_sub_fetch(&pagesInUse, 1, __ATOMIC_RELAXED);
+    }
+  }
+  free(snapshot);
+}
+
+// The number of distinct pages held by all snapshots.
+uint64_t snapshotPagesInUse()
+{
+  return __atomic_load_n(&pagesInUse, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,831 @@
+/*
+ * Batch workloads often run the same image many times with different inputs.
+ * Those guests spend most of their time at the same program counter, so
+ * instead of interpreting them one at a time we keep a group of them in
+ * lockstep and execute each instruction for all of them at once with SIMD
+ * instructions.
+ *
+ * Each step we pick the lowest program counter of the running guests and
+ * execute the instruction there for every guest sitting at that address. The
+ * guests at other addresses wait, so when a branch sends some guests off on
+ * their own they naturally catch up and join the rest again once they get
+ * back to the same program counter. Instructions that can't be done as a
+ * vector (traps, stores to different addresses, the device registers, or a
+ * guest that is on its own) fall back to executing the guest on its own.
+ *
+ * Every guest has its own clock and timer (see clock.c), on which the
+ * instructions it has retired are counted.
+ */
+#include "architecture.h"
+#include "instruction.h"
+#include "image.h"
+#include "spmd.h"
+
+// We compile the hot loop once for AVX2 and once for the baseline instruction
+// set (SSE2 on x86-64), the right version is picked when the program starts.
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__)
+#include <immintrin.h>
+#define SPMD_CLONES __attribute__((target_clones("avx2", "default")))
+#define SPMD_HAS_GATHER 1
+#else
+#define SPMD_CLONES
+#define SPMD_HAS_GATHER 0
+#endif
+
+/*
+ * Vectors never cross a function call: the baseline clone would pass them
+ * differently from the AVX2 one (GCC warns about it with -Wpsabi). So the
+ * vector helpers are macros or take their vectors by pointer, and they are
+ * always inlined anyway.
+ */
+#define SPMD_INLINE static inline __attribute__((always_inline))
+
+typedef int16_t LaneSigned __attribute__((vector_size(SPMD_LANES * 2)));
+
+volatile sig_atomic_t spmdCurrentOpcode;
+uint64_t spmdInstructions[16];
+
+// How many steps the instructions retired may be kept out of the lanes'
+// clocks for, well short of a LaneVector count overflowing.
+#define UNCLOCKED_STEPS_MAX 0x8000
+
+// The input is exhausted, the guest has nothing left to do.
+static const char* INPUT_EXHAUSTED = "input exhausted";
+
+// Reads the word at `address` for every lane, using the lane's own address.
+static void gatherScalar(const uint16_t* mem, const uint16_t* addresses,
+                         uint16_t* values)
+{
+  for (int lane = 0; lane < SPMD_LANES; lane++)
+  {
+    values[lane] = mem[addresses[lane] * SPMD_LANES + lane];
+  }
+}
+
+#if SPMD_HAS_GATHER
+/*
+ * AVX2 can only gather 32-bit values, so we gather the 32 bits starting at
+ * each lane's word and throw away the top half. The memory for a group has a
+ * spare word at the end so the last word can be read this way.
+ */
+__attribute__((target("avx2")))
+static void gatherAvx2(const uint16_t* mem, const uint16_t* addresses,
+                       uint16_t* values)
+{
+  const __m256i laneIdx = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  for (int lane = 0; lane < SPMD_LANES; lane += 8)
+  {
+    __m128i chunk = _mm_loadu_si128((const __m128i*)(addresses + lane));
+    __m256i idx = _mm256_cvtepu16_epi32(chunk);
+    idx = _mm256_mullo_epi32(idx, _mm256_set1_epi32(SPMD_LANES));
+    idx = _mm256_add_epi32(idx, _mm256_add_epi32(laneIdx,
+                                                 _mm256_set1_epi32(lane)));
+    __m256i words = _mm256_i32gather_epi32((const int*)mem, idx, 2);
+    words = _mm256_and_si256(words, _mm256_set1_epi32(0xFFFF));
+    // Narrow the eight 32-bit values back to 16 bits.
+    __m128i packed = _mm_packus_epi32(_mm256_castsi256_si128(words),
+                                      _mm256_extracti128_si256(words, 1));
+    _mm_storeu_si128((__m128i*)(values + lane), packed);
+  }
+}
+#endif
+
+// aligned_alloc wants the size to be a multiple of the alignment.
+static void* allocateAligned(size_t size)
+{
+  return aligned_alloc(64, (size + 63) & ~(size_t)63);
+}
+
+static void (*gatherLanes)(const uint16_t*, const uint16_t*, uint16_t*) =
+  gatherScalar;
+
+// Copies `x` into every lane, shuffling lane 0 everywhere becomes a single
+// broadcast instruction.
+#define SPLAT(x) __builtin_shuffle((LaneVector){(uint16_t)(x)}, (LaneVector){})
+
+// Picks `a` in the lanes where `mask` is set and `b` everywhere else.
+#define BLEND(mask, a, b) (((a) & (mask)) | ((b) & ~(mask)))
+
+// The vector version of updateConditionFlags, sets `flags` from `values`.
+SPMD_INLINE void conditionFlags(LaneVector* flags, const LaneVector* values)
+{
+  LaneVector zero = (LaneVector)(*values == 0);
+  LaneVector negative = (LaneVector)((LaneSigned)*values < 0);
+  *flags = (zero & FL_ZRO) | (negative & FL_NEG)
+    | (~(zero | negative) & FL_POS);
+}
+
+// The bit for each lane in `SpmdGroup.running`.
+static const LaneVector LANE_BITS = {
+  1 << 0, 1 << 1, 1 << 2, 1 << 3, 1 << 4, 1 << 5, 1 << 6, 1 << 7,
+#if SPMD_LANES == 16
+  1 << 8, 1 << 9, 1 << 10, 1 << 11, 1 << 12, 1 << 13, 1 << 14, 1 << 15
+#endif
+};
+
+#define MASK_FROM_BITS(bits) ((LaneVector)((SPLAT(bits) & LANE_BITS) != 0))
+
+SPMD_INLINE uint32_t bitsFromMask(const LaneVector* mask)
+{
+  uint32_t bits = 0;
+  for (int lane = 0; lane < SPMD_LANES; lane++)
+  {
+    bits |= (uint32_t)((*mask)[lane] & 1) << lane;
+  }
+  return bits;
+}
+
+SPMD_INLINE void loadRow(const struct SpmdGroup* group, uint16_t address,
+                         LaneVector* row)
+{
+  memcpy(row, group->mem + address * SPMD_LANES, sizeof(*row));
+}
+
+SPMD_INLINE void storeRow(struct SpmdGroup* group, uint16_t address,
+                          const LaneVector* row)
+{
+  memcpy(group->mem + address * SPMD_LANES, row, sizeof(*row));
+}
+
+SPMD_INLINE void gather(const struct SpmdGroup* group,
+                        const LaneVector* addresses, LaneVector* values)
+{
+  gatherLanes(group->mem, (const uint16_t*)addresses, (uint16_t*)values);
+}
+
+// A pointer to register `reg` of a single lane.
+static uint16_t* laneReg(struct SpmdGroup* group, int lane, int reg)
+{
+  return (uint16_t*)group->regs + reg * SPMD_LANES + lane;
+}
+
+static uint16_t* laneMem(struct SpmdGroup* group, int lane, uint16_t address)
+{
+  return group->mem + address * SPMD_LANES + lane;
+}
+
+static void haltLane(struct SpmdGroup* group, int lane, const char* error)
+{
+  group->running &= ~(1u << lane);
+  group->lanes[lane].error = error;
+}
+
+static void lanePutc(struct SpmdLane* io, char c)
+{
+  if (io->outputLength == io->outputCapacity)
+  {
+    io->outputCapacity = io->outputCapacity ? io->outputCapacity * 2 : 256;
+    io->output = realloc(io->output, io->outputCapacity);
+  }
+  io->output[io->outputLength++] = c;
+}
+
+static void lanePuts(struct SpmdLane* io, const char* s)
+{
+  while (*s)
+  {
+    lanePutc(io, *s++);
+  }
+}
+
+// Returns the next byte of the lane's input, or -1 once it has all been read.
+static int laneGetc(struct SpmdLane* io)
+{
+  return io->inputPos < io->inputLength ? io->input[io->inputPos++] : -1;
+}
+
+// The clock of a single lane, with all the instructions it has retired.
+static struct GuestClock* laneClock(struct SpmdGroup* group, int lane)
+{
+  struct GuestClock* clock = &group->lanes[lane].clock;
+  clock->instructions += group->unclocked[lane];
+  group->unclocked[lane] = 0;
+  return clock;
+}
+
+/*
+ * The lane version of memRead. Each guest has its own keyboard, which is the
+ * lane's input. A guest that polls the keyboard after all of its input has
+ * been read is waiting for input that will never come, so it is halted.
+ */
+static uint16_t laneMemRead(struct SpmdGroup* group, int lane,
+                            uint16_t address)
+{
+  if (address == MR_CLOCK || address == MR_TIMER)
+  {
+    return readClockRegister(laneClock(group, lane), group->mem + lane,
+                             SPMD_LANES, *laneReg(group, lane, R_PC),
+                             address);
+  }
+  if (address == MR_KBSR)
+  {
+    int c = laneGetc(&group->lanes[lane]);
+    if (c < 0)
+    {
+      haltLane(group, lane, INPUT_EXHAUSTED);
+      *laneMem(group, lane, MR_KBSR) = 0;
+    }
+    else
+    {
+      *laneMem(group, lane, MR_KBSR) = (1 << 15);
+      *laneMem(group, lane, MR_KBDR) = c;
+    }
+  }
+  return *laneMem(group, lane, address);
+}
+
+// The lane version of memWrite, stores to the timer arm the lane's timer.
+static void laneMemWrite(struct SpmdGroup* group, int lane, uint16_t address,
+                         uint16_t value)
+{
+  if (address == MR_TIMER)
+  {
+    armTimer(laneClock(group, lane), value);
+    return;
+  }
+  *laneMem(group, lane, address) = value;
+}
+
+static void laneConditionFlags(struct SpmdGroup* group, int lane, int reg)
+{
+  uint16_t value = *laneReg(group, lane, reg);
+  uint16_t flags = FL_POS;
+  if (value == 0)
+  {
+    flags = FL_ZRO;
+  }
+  else if (value >> 15)
+  {
+    flags = FL_NEG;
+  }
+  *laneReg(group, lane, R_COND) = flags;
+}
+
+// The lane version of handleTrap, the output goes to the lane's console.
+static void laneTrap(struct SpmdGroup* group, int lane, uint16_t instruction)
+{
+  struct SpmdLane* io = &group->lanes[lane];
+  uint16_t* r0 = laneReg(group, lane, R_0);
+  int c;
+
+  *laneReg(group, lane, R_7) = *laneReg(group, lane, R_PC);
+
+  switch (instruction & 0xFF)
+  {
+    case TRAP_IN:
+      lanePuts(io, "Enter a single character: ");
+      // fall through, IN is GETC with a prompt and an echo
+    case TRAP_GETC:
+      c = laneGetc(io);
+      if (c < 0)
+      {
+        haltLane(group, lane, INPUT_EXHAUSTED);
+        return;
+      }
+      if ((instruction & 0xFF) == TRAP_IN)
+      {
+        lanePutc(io, (char)c);
+        // trapIn reads the character into a (signed) char.
+        c = (uint16_t)(char)c;
+      }
+      *r0 = (uint16_t)c;
+      laneConditionFlags(group, lane, R_0);
+      break;
+    case TRAP_OUT:
+      lanePutc(io, (char)(*r0 & 0xFF));
+      break;
+    case TRAP_PUTS:
+      for (uint16_t address = *r0; *laneMem(group, lane, address); address++)
+      {
+        lanePutc(io, (char)*laneMem(group, lane, address));
+      }
+      break;
+    case TRAP_PUTSP:
+      for (uint16_t address = *r0; *laneMem(group, lane, address); address++)
+      {
+        uint16_t chars = *laneMem(group, lane, address);
+        lanePutc(io, (char)(chars & 0xFF));
+        if (!(chars >> 8))
+        {
+          break;
+        }
+        lanePutc(io, (char)(chars >> 8));
+      }
+      break;
+    case TRAP_HALT:
+      lanePuts(io, "Execution halted\n");
+      haltLane(group, lane, NULL);
+      break;
+  }
+}
+
+/*
+ * Executes the next instruction of a single guest, the same way the main
+ * interpreter would. This is the fallback for everything the vector path
+ * can't do.
+ */
+static void stepLane(struct SpmdGroup* group, int lane)
+{
+  uint16_t* pc = laneReg(group, lane, R_PC);
+  uint16_t instruction = laneMemRead(group, lane, (*pc)++);
+  uint16_t dr = extractRegister(instruction, 9);
+  uint16_t sr1 = extractRegister(instruction, 6);
+  uint16_t* r = laneReg(group, lane, R_0);
+  // Registers of the same lane are SPMD_LANES words apart.
+  #define LANE_REG(idx) r[(idx) * SPMD_LANES]
+  uint16_t operand = extractBit(instruction, 5)
+    ? signExtend(instruction & 0x1F, 5)
+    : LANE_REG(extractRegister(instruction, 0));
+  uint16_t offset6 = signExtend(instruction & 0x3F, 6);
+  uint16_t pcOffset = signExtendPcOffset(instruction);
+
+  switch (instruction >> 12)
+  {
+    case OP_ADD:
+      LANE_REG(dr) = LANE_REG(sr1) + operand;
+      laneConditionFlags(group, lane, dr);
+      break;
+    case OP_AND:
+      LANE_REG(dr) = LANE_REG(sr1) & operand;
+      laneConditionFlags(group, lane, dr);
+      break;
+    case OP_NOT:
+      LANE_REG(dr) = ~LANE_REG(sr1);
+      laneConditionFlags(group, lane, dr);
+      break;
+    case OP_BR:
+      if ((instruction >> 9) & LANE_REG(R_COND))
+      {
+        *pc += pcOffset;
+      }
+      break;
+    case OP_JMP:
+      *pc = LANE_REG(sr1);
+      break;
+    case OP_JSR:
+      LANE_REG(R_7) = *pc;
+      *pc = extractBit(instruction, 11)
+        ? *pc + signExtend(instruction & 0x7FF, 11) : LANE_REG(sr1);
+      break;
+    case OP_LD:
+      LANE_REG(dr) = laneMemRead(group, lane, *pc + pcOffset);
+      laneConditionFlags(group, lane, dr);
+      break;
+    case OP_LDI:
+      LANE_REG(dr) = laneMemRead(group, lane,
+                                 laneMemRead(group, lane, *pc + pcOffset));
+      laneConditionFlags(group, lane, dr);
+      break;
+    case OP_LDR:
+      LANE_REG(dr) = laneMemRead(group, lane, LANE_REG(sr1) + offset6);
+      laneConditionFlags(group, lane, dr);
+      break;
+    case OP_LEA:
+      LANE_REG(dr) = *pc + pcOffset;
+      laneConditionFlags(group, lane, dr);
+      break;
+    case OP_ST:
+      laneMemWrite(group, lane, *pc + pcOffset, LANE_REG(dr));
+      break;
+    case OP_STI:
+      laneMemWrite(group, lane, laneMemRead(group, lane, *pc + pcOffset),
+                   LANE_REG(dr));
+      break;
+    case OP_STR:
+      laneMemWrite(group, lane, LANE_REG(sr1) + offset6, LANE_REG(dr));
+      break;
+    case OP_TRAP:
+      laneTrap(group, lane, instruction);
+      break;
+    case OP_RES:
+    case OP_RTI:
+    default:
+      haltLane(group, lane, "invalid opcode");
+      break;
+  }
+  #undef LANE_REG
+  group->scalarSteps++;
+}
+
+static void stepLanes(struct SpmdGroup* group, uint32_t bits)
+{
+  for (int lane = 0; bits; lane++, bits >>= 1)
+  {
+    if (bits & 1)
+    {
+      stepLane(group, lane);
+    }
+  }
+}
+
+// Whether any of the `active` lanes would touch the device registers (the
+// keyboard, the clock and the timer) at the top of memory.
+SPMD_INLINE int touchesDevices(const LaneVector* addresses,
+                               const LaneVector* active)
+{
+  LaneVector hit = (LaneVector)(*addresses >= MR_KBSR) & *active;
+  for (int lane = 0; lane < SPMD_LANES; lane++)
+  {
+    if (hit[lane])
+    {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * The same as signExtend(x & mask, bitCount) in instruction.c, but simple
+ * enough to be inlined into the vector loop: shift the field up to the top
+ * of the word and arithmetic shift it back down.
+ */
+SPMD_INLINE uint16_t fieldSignExtend(uint16_t x, int bitCount)
+{
+  return (uint16_t)((int16_t)(x << (16 - bitCount)) >> (16 - bitCount));
+}
+
+/*
+ * Executes `instruction`, which sits at `pc`, for all the `active` lanes.
+ * Returns 0 if the instruction has to be run lane by lane instead.
+ */
+SPMD_INLINE int stepVector(struct SpmdGroup* group, uint16_t instruction,
+                           uint16_t pc, const LaneVector* activeLanes)
+{
+  LaneVector* regs = group->regs;
+  LaneVector active = *activeLanes;
+  uint16_t dr = (instruction >> 9) & 0x7;
+  uint16_t sr1 = (instruction >> 6) & 0x7;
+  uint16_t nextPc = pc + 1;
+  uint16_t pcOffset = fieldSignExtend(instruction, 9);
+  LaneVector operand = (instruction & 0x20)
+    ? SPLAT(fieldSignExtend(instruction, 5))
+    : regs[instruction & 0x7];
+  LaneVector newPc = SPLAT(nextPc);
+  LaneVector addresses;
+  LaneVector result;
+
+  switch (instruction >> 12)
+  {
+    case OP_ADD:
+      result = regs[sr1] + operand;
+      break;
+    case OP_AND:
+      result = regs[sr1] & operand;
+      break;
+    case OP_NOT:
+      result = ~regs[sr1];
+      break;
+    case OP_LEA:
+      result = SPLAT(nextPc + pcOffset);
+      break;
+    case OP_LD:
+      if ((uint16_t)(nextPc + pcOffset) >= MR_KBSR)
+      {
+        return 0;
+      }
+      loadRow(group, nextPc + pcOffset, &result);
+      break;
+    case OP_LDI:
+      if ((uint16_t)(nextPc + pcOffset) >= MR_KBSR)
+      {
+        return 0;
+      }
+      loadRow(group, nextPc + pcOffset, &addresses);
+      if (touchesDevices(&addresses, &active))
+      {
+        return 0;
+      }
+      gather(group, &addresses, &result);
+      break;
+    case OP_LDR:
+      addresses = regs[sr1] + fieldSignExtend(instruction, 6);
+      if (touchesDevices(&addresses, &active))
+      {
+        return 0;
+      }
+      gather(group, &addresses, &result);
+      break;
+    case OP_BR:
+      newPc = BLEND((LaneVector)((regs[R_COND] & ((instruction >> 9) & 0x7))
+                                 != 0),
+                    SPLAT(nextPc + pcOffset), newPc);
+      regs[R_PC] = BLEND(active, newPc, regs[R_PC]);
+      return 1;
+    case OP_JMP:
+      regs[R_PC] = BLEND(active, regs[sr1], regs[R_PC]);
+      return 1;
+    case OP_JSR:
+      // Like executeJumpToSubroutine, R7 is written before BaseR is read.
+      regs[R_7] = BLEND(active, SPLAT(nextPc), regs[R_7]);
+      newPc = (instruction & 0x800)
+        ? SPLAT(nextPc + fieldSignExtend(instruction, 11))
+        : regs[sr1];
+      regs[R_PC] = BLEND(active, newPc, regs[R_PC]);
+      return 1;
+    case OP_ST:
+      if ((uint16_t)(nextPc + pcOffset) >= MR_KBSR)
+      {
+        return 0;
+      }
+      loadRow(group, nextPc + pcOffset, &result);
+      result = BLEND(active, regs[dr], result);
+      storeRow(group, nextPc + pcOffset, &result);
+      regs[R_PC] = BLEND(active, newPc, regs[R_PC]);
+      return 1;
+    case OP_STR:
+      // There is no scatter in AVX2, so the stores go one lane at a time.
+      addresses = regs[sr1] + fieldSignExtend(instruction, 6);
+      if (touchesDevices(&addresses, &active))
+      {
+        return 0;
+      }
+      for (int lane = 0; lane < SPMD_LANES; lane++)
+      {
+        if (active[lane])
+        {
+          group->mem[addresses[lane] * SPMD_LANES + lane] = regs[dr][lane];
+        }
+      }
+      regs[R_PC] = BLEND(active, newPc, regs[R_PC]);
+      return 1;
+    default:
+      return 0;
+  }
+
+  // Everything that gets here writes `result` to DR and sets the flags.
+  regs[dr] = BLEND(active, result, regs[dr]);
+  LaneVector flags;
+  conditionFlags(&flags, &result);
+  regs[R_COND] = BLEND(active, flags, regs[R_COND]);
+  regs[R_PC] = BLEND(active, newPc, regs[R_PC]);
+  return 1;
+}
+
+// Whether any lane of `mask` is set, done a machine word at a time.
+SPMD_INLINE int anyLane(const LaneVector* mask)
+{
+  typedef uint64_t Words __attribute__((vector_size(SPMD_LANES * 2)));
+  Words words = (Words)*mask;
+  uint64_t any = 0;
+  for (int idx = 0; idx < SPMD_LANES / 4; idx++)
+  {
+    any |= words[idx];
+  }
+  return any != 0;
+}
+
+/*
+ * Executes one instruction for the guests at the lowest program counter.
+ * Returns the number of guest instructions that were retired.
+ *
+ * Most of the time every running guest is at the same program counter, in
+ * which case we can skip looking for the lowest one.
+ */
+SPMD_INLINE uint64_t stepGroup(struct SpmdGroup* group)
+{
+  uint32_t running = group->running;
+  LaneVector runningMask = MASK_FROM_BITS(running);
+  LaneVector pcs = group->regs[R_PC];
+  int first = __builtin_ctz(running);
+  uint16_t pc = pcs[first];
+  LaneVector active = runningMask;
+  uint32_t bits = running;
+
+  if (!group->converged)
+  {
+    for (int lane = 0; lane < SPMD_LANES; lane++)
+    {
+      if (((running >> lane) & 1) && pcs[lane] < pc)
+      {
+        pc = pcs[lane];
+      }
+    }
+    active = (LaneVector)(pcs == pc) & runningMask;
+    bits = bitsFromMask(&active);
+    first = __builtin_ctz(bits);
+  }
+
+  // Of the guests at this program counter, take the ones that have the same
+  // instruction there as the first one (they differ only if a guest has
+  // overwritten its code).
+  LaneVector instructions;
+  loadRow(group, pc, &instructions);
+  uint16_t instruction = instructions[first];
+  LaneVector differs = (LaneVector)(instructions != instruction) & active;
+
+  if (anyLane(&differs))
+  {
+    active &= ~differs;
+    bits = bitsFromMask(&active);
+  }
+  uint64_t retired = __builtin_popcount(bits);
+  group->stepped = bits;
+  spmdCurrentOpcode = instruction >> 12;
+  group->opcodeCounts[instruction >> 12] += retired;
+
+  // The instruction counts before it is executed, like in the interpreter,
+  // and the mask is all ones (-1) in the active lanes.
+  group->unclocked -= active;
+  if (++group->unclockedSteps == UNCLOCKED_STEPS_MAX)
+  {
+    for (int lane = 0; lane < SPMD_LANES; lane++)
+    {
+      laneClock(group, lane);
+    }
+    group->unclockedSteps = 0;
+  }
+
+  if (retired == 1 || pc >= MR_KBSR
+      || !stepVector(group, instruction, pc, &active))
+  {
+    stepLanes(group, bits);
+  }
+  else
+  {
+    group->vectorSteps++;
+  }
+  group->retired += retired;
+
+  // Check whether the guests that are still running are back together.
+  running = group->running;
+  if (running)
+  {
+    pcs = group->regs[R_PC];
+    pc = pcs[__builtin_ctz(running)];
+    LaneVector apart = (LaneVector)(pcs != pc) & MASK_FROM_BITS(running);
+    group->converged = !anyLane(&apart);
+  }
+  return retired;
+}
+
+uint64_t stepSpmdGroup(struct SpmdGroup* group)
+{
+  return group->running ? stepGroup(group) : 0;
+}
+
+SPMD_CLONES
+void runSpmdGroup(struct SpmdGroup* group)
+{
+  while (group->running)
+  {
+    stepGroup(group);
+  }
+}
+
+/*
+ * Creates a group of `laneCount` guests that all start with a copy of `image`
+ * (the memory of a VM that has had its images read in).
+ */
+struct SpmdGroup* createSpmdGroup(const uint16_t* image, int laneCount)
+{
+  struct SpmdGroup* group = allocateAligned(sizeof(struct SpmdGroup));
+  memset(group, 0, sizeof(struct SpmdGroup));
+
+  // The extra word lets the AVX2 gather read 32 bits at the last address.
+  group->mem = allocateAligned((MEMORY_MAX + 1) * SPMD_LANES * 2);
+  for (uint32_t address = 0; address < MEMORY_MAX; address++)
+  {
+    LaneVector row = SPLAT(image[address]);
+    storeRow(group, address, &row);
+  }
+  memset(group->mem + MEMORY_MAX * SPMD_LANES, 0, SPMD_LANES * 2);
+
+  group->regs[R_COND] = SPLAT(FL_ZRO);
+  group->regs[R_PC] = SPLAT(entryPoint);
+  group->running = laneCount >= 32 ? ~0u : (1u << laneCount) - 1;
+  group->converged = 1;
+  for (int lane = 0; lane < SPMD_LANES; lane++)
+  {
+    startClock(&group->lanes[lane].clock);
+  }
+
+#if SPMD_HAS_GATHER
+  if (__builtin_cpu_supports("avx2"))
+  {
+    gatherLanes = gatherAvx2;
+  }
+#endif
+  return group;
+}
+
+void freeSpmdGroup(struct SpmdGroup* group)
+{
+  for (int lane = 0; lane < SPMD_LANES; lane++)
+  {
+    free(group->lanes[lane].output);
+  }
+  free(group->mem);
+  free(group);
+}
+
+void setSpmdInput(struct SpmdGroup* group, int lane, const uint8_t* input,
+                  size_t inputLength)
+{
+  group->lanes[lane].input = input;
+  group->lanes[lane].inputLength = inputLength;
+  group->lanes[lane].inputPos = 0;
+}
+
+static uint8_t* readWholeFile(const char* path, size_t* length)
+{
+  FILE* file = fopen(path, "rb");
+  if (!file)
+  {
+    return NULL;
+  }
+  fseek(file, 0, SEEK_END);
+  *length = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  uint8_t* data = malloc(*length + 1);
+  *length = fread(data, 1, *length, file);
+  fclose(file);
+  return data;
+}
+
+/*
+ * Runs one guest per input file in `inputList` (a comma separated list),
+ * starting from the images that have already been read into `mem`. The
+ * guests run in groups of SPMD_LANES and the output of each is written next
+ * to its input as `<input>.out`.
+ */
+int runSpmdBatch(const char* inputList)
+{
+  char* list = strdup(inputList);
+  const char** paths = NULL;
+  int pathCount = 0;
+  int pathCapacity = 0;
+  for (char* path = strtok(list, ","); path; path = strtok(NULL, ","))
+  {
+    if (pathCount == pathCapacity)
+    {
+      pathCapacity = pathCapacity ? pathCapacity * 2 : 64;
+      paths = realloc(paths, pathCapacity * sizeof(const char*));
+    }
+    paths[pathCount++] = path;
+  }
+
+  uint64_t retired = 0, vectorSteps = 0, scalarSteps = 0;
+  struct timeval start, end;
+  gettimeofday(&start, NULL);
+
+  for (int base = 0; base < pathCount; base += SPMD_LANES)
+  {
+    int laneCount = pathCount - base < SPMD_LANES
+      ? pathCount - base : SPMD_LANES;
+    uint8_t* inputs[SPMD_LANES];
+    struct SpmdGroup* group = createSpmdGroup(mainGuest.mem, laneCount);
+
+    for (int lane = 0; lane < laneCount; lane++)
+    {
+      size_t length;
+      inputs[lane] = readWholeFile(paths[base + lane], &length);
+      if (!inputs[lane])
+      {
+        printf("Failed to read input: %s\n", paths[base + lane]);
+        exit(1);
+      }
+      setSpmdInput(group, lane, inputs[lane], length);
+    }
+
+    runSpmdGroup(group);
+
+    for (int lane = 0; lane < laneCount; lane++)
+    {
+      struct SpmdLane* io = &group->lanes[lane];
+      char outputPath[4096];
+      snprintf(outputPath, sizeof(outputPath), "%s.out", paths[base + lane]);
+      FILE* output = fopen(outputPath, "wb");
+      if (output)
+      {
+        fwrite(io->output, 1, io->outputLength, output);
+        fclose(output);
+      }
+      if (io->error && io->error != INPUT_EXHAUSTED)
+      {
+        printf("%s: %s\n", paths[base + lane], io->error);
+      }
+      free(inputs[lane]);
+    }
+
+    retired += group->retired;
+    for (int opcode = 0; opcode < 16; opcode++)
+    {
+      spmdInstructions[opcode] += group->opcodeCounts[opcode];
+    }
+    vectorSteps += group->vectorSteps;
+    scalarSteps += group->scalarSteps;
+    freeSpmdGroup(group);
+  }
+
+  gettimeofday(&end, NULL);
+  double seconds = (end.tv_sec - start.tv_sec)
+    + (end.tv_usec - start.tv_usec) / 1e6;
+  printf("%d guests, %llu instructions in %.3fs (%.1f MIPS), "
+         "%llu vector steps, %llu scalar steps\n",
+         pathCount, (unsigned long long)retired, seconds,
+         seconds > 0 ? retired / seconds / 1e6 : 0.0,
+         (unsigned long long)vectorSteps, (unsigned long long)scalarSteps);
+  free(paths);
+  free(list);
+  return 1;
+}
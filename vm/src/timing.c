@@ -0,0 +1,473 @@
+/*
+ * A cycle-approximate timing model. Instruction counts hide the real cost
+ * differences between instructions (an LDI makes two memory reads, an ADD
+ * makes none), so this estimates how many cycles a guest would take on a
+ * simple pipelined LC-3:
+ *
+ * - fetch, decode and execute overlap, so in the steady state an instruction
+ *   costs as much as its slowest stage, and at least one cycle
+ * - the execute stage costs the opcode's latency plus the latency of each
+ *   data access it makes
+ * - a taken branch, jump or subroutine call flushes the pipeline
+ * - an instruction using the result of the load right before it stalls
+ *
+ * Everything is worked out from the stream of fetches, reads and writes the
+ * guest makes, so the interpreter loop doesn't change at all. We only know
+ * where an instruction went once the next one is fetched, so each instruction
+ * is accounted for at the fetch of the one after it.
+ *
+ * The cycles are grouped by basic block, where a block starts at the target of
+ * any control transfer, and reported with a breakdown of the stalls when the
+ * VM exits.
+ */
+#include <ctype.h>
+#include <strings.h>
+
+#include "architecture.h"
+#include "cache.h"
+#include "image.h"
+#include "timing.h"
+
+// How many of the most expensive blocks to list in the report.
+#define REPORT_TOP_BLOCKS 20
+
+// Where the cycles of an instruction went.
+enum Stall
+{
+  STALL_BASE = 0,   // the one cycle every instruction takes
+  STALL_FETCH,      // waiting for the instruction to be fetched
+  STALL_DECODE,     // waiting for the decoder
+  STALL_EXECUTE,    // a multi-cycle operation
+  STALL_MEMORY,     // waiting for loads and stores
+  STALL_CONTROL,    // refilling the pipeline after a taken branch
+  STALL_LOAD_USE,   // waiting for the result of the previous load
+  STALL_KINDS
+};
+
+static const char* STALL_NAMES[STALL_KINDS] = {
+  "base", "fetch", "decode", "execute", "memory", "control", "load-use"
+};
+
+static const char* OPCODE_NAMES[16] = {
+  "BR", "ADD", "LD", "ST", "JSR", "AND", "LDR", "STR",
+  "RTI", "NOT", "LDI", "STI", "JMP", "RES", "LEA", "TRAP"
+};
+
+// All latencies are in cycles.
+struct TimingConfig
+{
+  uint32_t opcode[16];
+  uint32_t fetch;
+  uint32_t decode;
+  uint32_t read;
+  uint32_t write;
+  uint32_t trap;
+  // Used instead of fetch, read and write when the caches are simulated.
+  uint32_t l1;
+  uint32_t l2;
+  uint32_t memory;
+  uint32_t branchPenalty;
+  uint32_t loadUse;
+};
+
+struct BlockStats
+{
+  uint64_t entries;
+  uint64_t instructions;
+  uint64_t cycles[STALL_KINDS];
+};
+
+static struct TimingConfig config = {
+  .opcode = { 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1 },
+  .fetch = 1,
+  .decode = 1,
+  .read = 2,
+  .write = 2,
+  .trap = 30,
+  .l1 = 1,
+  .l2 = 8,
+  .memory = 40,
+  .branchPenalty = 2,
+  .loadUse = 1
+};
+
+static int enabled;
+static struct BlockStats* blocks;
+static struct BlockStats totals;
+
+// The instruction that has been fetched but not accounted for yet.
+static int pending;
+static uint16_t pendingPc;
+static uint16_t pendingInstruction;
+static uint32_t pendingFetchCycles;
+static uint32_t pendingMemoryCycles;
+static uint16_t blockLeader;
+// The register written by the previous instruction if it was a load, else -1.
+static int loadedRegister = -1;
+
+/*
+ * Sets `key` in the config. The keys are the opcode names (for the execute
+ * latency of each opcode) and the names of the other latencies, written in
+ * lower case with underscores.
+ */
+static int setConfigValue(const char* key, uint32_t value)
+{
+  struct
+  {
+    const char* name;
+    uint32_t* field;
+  } fields[] = {
+    { "fetch", &config.fetch },
+    { "decode", &config.decode },
+    { "read", &config.read },
+    { "write", &config.write },
+    { "trap", &config.trap },
+    { "l1", &config.l1 },
+    { "l2", &config.l2 },
+    { "memory", &config.memory },
+    { "branch_penalty", &config.branchPenalty },
+    { "load_use", &config.loadUse }
+  };
+
+  for (int op = 0; op < 16; op++)
+  {
+    if (strcasecmp(key, OPCODE_NAMES[op]) == 0)
+    {
+      config.opcode[op] = value;
+      return 1;
+    }
+  }
+  for (size_t idx = 0; idx < sizeof(fields) / sizeof(fields[0]); idx++)
+  {
+    if (strcasecmp(key, fields[idx].name) == 0)
+    {
+      *fields[idx].field = value;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Reads a config file of `key = value` lines, where `#` starts a comment.
+ * Anything not in the file keeps its default.
+ */
+static int readConfig(const char* configPath)
+{
+  FILE* file = fopen(configPath, "r");
+  if (!file)
+  {
+    fprintf(stderr, "Failed to open timing config: %s\n", configPath);
+    return 0;
+  }
+
+  char line[256];
+  int lineNumber = 0;
+  while (fgets(line, sizeof(line), file))
+  {
+    lineNumber++;
+    char* comment = strchr(line, '#');
+    if (comment)
+    {
+      *comment = '\0';
+    }
+
+    char key[64];
+    unsigned value;
+    char extra;
+    if (sscanf(line, " %63[A-Za-z0-9_] = %u %c", key, &value, &extra) == 2)
+    {
+      if (!setConfigValue(key, value))
+      {
+        fprintf(stderr, "%s:%d: unknown timing key '%s'\n", configPath,
+                lineNumber, key);
+        fclose(file);
+        return 0;
+      }
+      continue;
+    }
+
+    // Anything else has to be a blank line.
+    for (char* c = line; *c; c++)
+    {
+      if (!isspace((unsigned char)*c))
+      {
+        fprintf(stderr, "%s:%d: expected 'key = value'\n", configPath,
+                lineNumber);
+        fclose(file);
+        return 0;
+      }
+    }
+  }
+  fclose(file);
+  return 1;
+}
+
+/*
+ * Turns the timing model on, with the latencies in `configPath` or the
+ * defaults if it is NULL. Returns 0 if the config can't be read.
+ */
+int initTiming(const char* configPath)
+{
+  if (configPath && !readConfig(configPath))
+  {
+    return 0;
+  }
+  blocks = calloc(MEMORY_MAX, sizeof(struct BlockStats));
+  enabled = 1;
+  return 1;
+}
+
+int timingEnabled()
+{
+  return enabled;
+}
+
+// The latency of an access served by `cacheLevel`, see cacheFetch.
+static uint32_t cacheLatency(int cacheLevel)
+{
+  if (cacheLevel == CACHE_L2)
+  {
+    return config.l2;
+  }
+  return cacheLevel == CACHE_LEVELS ? config.memory : config.l1;
+}
+
+static int isLoad(uint16_t opcode)
+{
+  return opcode == OP_LD || opcode == OP_LDR || opcode == OP_LDI;
+}
+
+static int isControlTransfer(uint16_t opcode)
+{
+  return opcode == OP_BR || opcode == OP_JMP || opcode == OP_JSR
+    || opcode == OP_TRAP;
+}
+
+/*
+ * Whether `instruction` reads register `reg` (or the condition flags, which
+ * a load sets from `reg`) before it can execute.
+ */
+static int readsRegister(uint16_t instruction, int reg)
+{
+  int sr1 = (instruction >> 6) & 0x7;
+  int sr2 = instruction & 0x7;
+  int sr = (instruction >> 9) & 0x7;
+
+  switch (instruction >> 12)
+  {
+    case OP_ADD:
+    case OP_AND:
+      return sr1 == reg || (!(instruction & 0x20) && sr2 == reg);
+    case OP_NOT:
+    case OP_JMP:
+    case OP_LDR:
+      return sr1 == reg;
+    case OP_JSR:
+      return !(instruction & 0x800) && sr1 == reg;
+    case OP_STR:
+      return sr1 == reg || sr == reg;
+    case OP_ST:
+    case OP_STI:
+      return sr == reg;
+    case OP_BR:
+      return 1;
+    case OP_TRAP:
+      return reg == R_0;
+  }
+  return 0;
+}
+
+// Accounts for the pending instruction, now that we know `nextPc`.
+static void finishInstruction(uint16_t nextPc)
+{
+  uint16_t opcode = pendingInstruction >> 12;
+  uint64_t cycles[STALL_KINDS] = { 0 };
+  uint32_t execute = (opcode == OP_TRAP ? config.trap : config.opcode[opcode])
+    + pendingMemoryCycles;
+  uint32_t stage = execute;
+
+  if (pendingFetchCycles > stage)
+  {
+    stage = pendingFetchCycles;
+  }
+  if (config.decode > stage)
+  {
+    stage = config.decode;
+  }
+
+  // One cycle is the ideal, anything more is charged to the slowest stage.
+  cycles[STALL_BASE] = 1;
+  if (stage > 1)
+  {
+    uint32_t excess = stage - 1;
+    if (stage == execute)
+    {
+      uint32_t memory = excess < pendingMemoryCycles
+        ? excess : pendingMemoryCycles;
+      cycles[STALL_MEMORY] = memory;
+      cycles[STALL_EXECUTE] = excess - memory;
+    }
+    else if (stage == pendingFetchCycles)
+    {
+      cycles[STALL_FETCH] = excess;
+    }
+    else
+    {
+      cycles[STALL_DECODE] = excess;
+    }
+  }
+
+  if (isControlTransfer(opcode) && opcode != OP_TRAP
+      && nextPc != (uint16_t)(pendingPc + 1))
+  {
+    cycles[STALL_CONTROL] = config.branchPenalty;
+  }
+  if (loadedRegister >= 0 && readsRegister(pendingInstruction, loadedRegister))
+  {
+    cycles[STALL_LOAD_USE] = config.loadUse;
+  }
+  loadedRegister = isLoad(opcode) ? (pendingInstruction >> 9) & 0x7 : -1;
+
+  struct BlockStats* block = &blocks[blockLeader];
+  block->instructions++;
+  totals.instructions++;
+  for (int kind = 0; kind < STALL_KINDS; kind++)
+  {
+    block->cycles[kind] += cycles[kind];
+    totals.cycles[kind] += cycles[kind];
+  }
+}
+
+/*
+ * Called for every instruction fetch, with the level of the cache hierarchy
+ * that served it (or -1 if the caches aren't simulated).
+ */
+void timingFetch(uint16_t address, int cacheLevel)
+{
+  int startsBlock = !pending;
+
+  if (pending)
+  {
+    finishInstruction(address);
+    startsBlock = address != (uint16_t)(pendingPc + 1)
+      || isControlTransfer(pendingInstruction >> 12);
+  }
+  if (startsBlock)
+  {
+    blockLeader = address;
+    blocks[address].entries++;
+    totals.entries++;
+  }
+
+  pending = 1;
+  pendingPc = address;
+  pendingInstruction = mainGuest.mem[address];
+  pendingFetchCycles = cacheLevel < 0 ? config.fetch : cacheLatency(cacheLevel);
+  pendingMemoryCycles = 0;
+}
+
+// Called for every load and store, see timingFetch.
+void timingData(enum MemAccess access, int cacheLevel)
+{
+  if (cacheLevel >= 0)
+  {
+    pendingMemoryCycles += cacheLatency(cacheLevel);
+  }
+  else
+  {
+    pendingMemoryCycles += access == ACCESS_WRITE ? config.write : config.read;
+  }
+}
+
+static uint64_t totalCycles(const struct BlockStats* stats)
+{
+  uint64_t sum = 0;
+  for (int kind = 0; kind < STALL_KINDS; kind++)
+  {
+    sum += stats->cycles[kind];
+  }
+  return sum;
+}
+
+/*
+ * Prints the estimated cycles and CPI for the whole run and for the most
+ * expensive basic blocks, to stderr so it doesn't get mixed up with the
+ * guest's output.
+ */
+void reportTiming()
+{
+  if (!enabled)
+  {
+    return;
+  }
+  if (pending)
+  {
+    finishInstruction(pendingPc + 1);
+    pending = 0;
+  }
+
+  uint64_t cycles = totalCycles(&totals);
+  fprintf(stderr, "\nTiming estimate\n");
+  fprintf(stderr, "  %llu instructions, %llu cycles, CPI %.3f\n",
+          (unsigned long long)totals.instructions,
+          (unsigned long long)cycles,
+          totals.instructions ? (double)cycles / totals.instructions : 0.0);
+  for (int kind = 0; kind < STALL_KINDS; kind++)
+  {
+    fprintf(stderr, "  %-9s %14llu cycles (%5.1f%%)\n", STALL_NAMES[kind],
+            (unsigned long long)totals.cycles[kind],
+            cycles ? 100.0 * totals.cycles[kind] / cycles : 0.0);
+  }
+
+  // The most expensive blocks, kept sorted by insertion.
+  uint16_t top[REPORT_TOP_BLOCKS];
+  int topCount = 0;
+  for (uint32_t leader = 0; leader < MEMORY_MAX; leader++)
+  {
+    uint64_t blockCycles = totalCycles(&blocks[leader]);
+    if (!blockCycles)
+    {
+      continue;
+    }
+    int idx = topCount < REPORT_TOP_BLOCKS ? topCount++ : REPORT_TOP_BLOCKS;
+    while (idx > 0 && totalCycles(&blocks[top[idx - 1]]) < blockCycles)
+    {
+      if (idx < REPORT_TOP_BLOCKS)
+      {
+        top[idx] = top[idx - 1];
+      }
+      idx--;
+    }
+    if (idx < REPORT_TOP_BLOCKS)
+    {
+      top[idx] = leader;
+    }
+  }
+
+  fprintf(stderr, "\n  Most expensive basic blocks\n");
+  fprintf(stderr, "  %-6s %10s %12s %14s %6s", "Block", "entries",
+          "instructions", "cycles", "CPI");
+  for (int kind = STALL_FETCH; kind < STALL_KINDS; kind++)
+  {
+    fprintf(stderr, " %10s", STALL_NAMES[kind]);
+  }
+  fprintf(stderr, "\n");
+  for (int idx = 0; idx < topCount; idx++)
+  {
+    struct BlockStats* block = &blocks[top[idx]];
+    uint64_t blockCycles = totalCycles(block);
+    fprintf(stderr, "  x%04X  %10llu %12llu %14llu %6.2f", top[idx],
+            (unsigned long long)block->entries,
+            (unsigned long long)block->instructions,
+            (unsigned long long)blockCycles,
+            (double)blockCycles / block->instructions);
+    for (int kind = STALL_FETCH; kind < STALL_KINDS; kind++)
+    {
+      fprintf(stderr, " %10llu", (unsigned long long)block->cycles[kind]);
+    }
+    char symbol[SYMBOL_TEXT_MAX];
+    formatSymbol(top[idx], symbol, sizeof(symbol));
+    fprintf(stderr, "  %s\n", symbol);
+  }
+}
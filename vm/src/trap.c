@@ -7,59 +7,59 @@
  * until a null character is encountered (0x0000).
  * Note: each memory address stores a single character.
  */
-void trapPuts()
+void trapPuts(struct Guest* guest)
 {
   // take the offset from the memory array mem specified in R0 to get a pointer
   // to the first character.
-  uint16_t* c = mem + regs[R_0];
+  uint16_t* c = guest->mem + guest->regs[R_0];
 
   // Loop while we haven't encountered a null character.
   while (*c)
   {
-    // We convert to a C char and place it in stdout, then move to the next
-    // character.
-    putc((char)*c, stdout);
+    // We convert to a C char and place it on the console, then move to the
+    // next character.
+    consolePutChar(guest, (char)*c);
     c++;
   }
 
-  // Force a write of the string we just put into the stdout stream.
-  fflush(stdout);
+  // Force a write of the string we just put onto the console.
+  consoleFlush(guest);
 }
 
 /*
  * The trap OUT routine writes a character in R0[7:0] to the console.
  */
-void trapOut()
+void trapOut(struct Guest* guest)
 {
   // Take the character in R0 and we convert it to a char (which is 8 bits).
-  // Then we place it on the stdout buffer and flush the buffer.
-  putc((char)(regs[R_0] & 0xFF), stdout);
-  fflush(stdout);
+  // Then we place it on the console and flush it.
+  consolePutChar(guest, (char)(guest->regs[R_0] & 0xFF));
+  consoleFlush(guest);
 }
 
 /*
  * The trap GETC routine fetches a single character from the keyboard and
  * places that character into R0.
  */
-void trapGetc()
+void trapGetc(struct Guest* guest)
 {
-  // We retrieve a char from the keyboard with `getchar` and convert it into
-  // 16 bits to store in R_0.
-  regs[R_0] = (uint16_t)getchar();
-  updateConditionFlags(R_0);
+  // We retrieve a char from the keyboard with `consoleGetChar` and convert it
+  // into 16 bits to store in R_0.
+  guest->regs[R_0] = (uint16_t)consoleGetChar(guest);
+  updateConditionFlags(guest, R_0);
 }
 
 /*
  * The trap IN routine prompts on the screen for a character. It reads in that
  * character, echoes it to the screen and stores it into R0.
  */
-void trapIn() {
-  printf("Enter a single character: ");
-  char c = getchar();
-  putc(c, stdout);
-  fflush(stdout);
-  regs[R_0] = (uint16_t)c;
-  updateConditionFlags(R_0);
+void trapIn(struct Guest* guest) {
+  consoleWrite(guest, "Enter a single character: ");
+  char c = consoleGetChar(guest);
+  consolePutChar(guest, c);
+  consoleFlush(guest);
+  guest->regs[R_0] = (uint16_t)c;
+  updateConditionFlags(guest, R_0);
 }
 
 /*
@@ -69,38 +69,38 @@ void trapIn() {
  * Each location in memory contains 2 characters. The first is in bits [7:0]
  * and the second is in bits [15:8]
  */
-void trapPutsp()
+void trapPutsp(struct Guest* guest)
 {
   // take the offset from the memory array mem specified in R0 to get a pointer
   // to the first character.
-  uint16_t* c = mem + regs[R_0];
+  uint16_t* c = guest->mem + guest->regs[R_0];
 
   // Loop while we haven't encountered a null character.
   while (*c) {
     uint16_t currChar = *c;
     // We first write the lower  bits.
-    putc((char)(currChar & 0xFF), stdout);
+    consolePutChar(guest, (char)(currChar & 0xFF));
     // Now take of the lower 8 bits and write those, unless we have encountered
     // the null character.
     currChar = currChar >> 8;
     if (currChar) {
-      putc((char) currChar, stdout);
+      consolePutChar(guest, (char) currChar);
       c++;
     } else {
       break;
     }
   }
 
-  fflush(stdout);
+  consoleFlush(guest);
 }
 
 /*
  * the trap routine HALT stops the program and prints a message to the console.
  */
-void halt()
+void halt(struct Guest* guest)
 {
-  puts("Execution halted");
-  fflush(stdout);
+  consoleWrite(guest, "Execution halted\n");
+  consoleFlush(guest);
 }
 
 /*
@@ -118,34 +118,35 @@ void halt()
  * It returns an int specifying whether the vm is still in a running state
  * after the trap routine.
  */
-int handleTrap(uint16_t trapInstruction)
+int handleTrap(struct Guest* guest, uint16_t trapInstruction)
 {
   // Store the current value of the program counter in R_7 before jumping to
   // the trap routine so we can load this value again when we execute the
   // trap routine.
-  regs[R_7] = regs[R_PC];
+  guest->regs[R_7] = guest->regs[R_PC];
+  guest->stats.traps[trapInstruction & 0xFF]++;
 
   // We take bitwise-and with 0xFF which is 11111111 to get the 8 least
   // significant bits corresponding to the trap routine.
   switch (trapInstruction & 0xFF)
   {
     case TRAP_GETC:
-      trapGetc();
+      trapGetc(guest);
       break;
     case TRAP_OUT:
-      trapOut();
+      trapOut(guest);
       break;
     case TRAP_PUTS:
-      trapPuts();
+      trapPuts(guest);
       break;
     case TRAP_IN:
-      trapIn();
+      trapIn(guest);
       break;
     case TRAP_PUTSP:
-      trapPutsp();
+      trapPutsp(guest);
       break;
     case TRAP_HALT:
-      halt();
+      halt(guest);
       return 0;
   }
   return 1;
@@ -0,0 +1,1093 @@
+/*
+ * Checks a faster execution engine (the candidate) against the plain
+ * interpreter with idioms turned off (the reference) by running both on the
+ * same images and keyboard input and comparing them as they go.
+ *
+ * The candidate runs on a thread of its own, as it needs its own memory and
+ * registers (see architecture.h). It records a checkpoint at every basic
+ * block boundary, or every N instructions, with the number of instructions
+ * it has retired, the registers (condition flags included), a hash of memory
+ * and how much it has printed and a hash of it. The reference runs on the main thread and
+ * catches up to each checkpoint in turn before comparing its own state with
+ * it. Checkpoints are handed over in batches, so the two threads hardly ever
+ * wait for each other.
+ *
+ * The memory hash is the sum of a hash of every word and its address, so a
+ * store only has to take away the hash of the old word and add that of the
+ * new one. This covers all of memory at the cost of a few instructions per
+ * store. The output hash is a running FNV-1a hash of every byte printed, so
+ * wrong output is caught at the checkpoint after it is printed rather than
+ * only when the guest stops. Memory and output are compared in full when the
+ * guest stops.
+ *
+ * When a checkpoint doesn't match, both engines are run again from the start
+ * (they are deterministic given the same input) and this time the candidate
+ * waits for the reference after every step it takes from the last matching
+ * checkpoint on, which finds the first instruction, or native loop, after
+ * which they disagree.
+ *
+ * The SPMD engine runs a whole group with the same input in every lane, as a
+ * group of one lane never takes the vector path. Each lane keeps a memory
+ * hash of its own and is compared with lane 0 at every checkpoint.
+ */
+#include <pthread.h>
+#include <time.h>
+
+#include "architecture.h"
+#include "clock.h"
+#include "instruction.h"
+#include "interpreter.h"
+#include "idiom.h"
+#include "image.h"
+#include "spmd.h"
+#include "disassemble.h"
+#include "validate.h"
+
+// Checkpoints are handed over BATCH_SIZE at a time, and the candidate can be
+// at most BATCH_COUNT batches ahead of the reference.
+#define BATCH_SIZE 4096
+#define BATCH_COUNT 4
+
+// The number of instructions the reference remembers executing, to show what
+// led up to a divergence.
+#define RECENT_INSTRUCTIONS 16
+
+// The most differences in memory that are listed one by one.
+#define MAX_LISTED_WORDS 16
+
+// The candidate only waits for the reference at its final checkpoint.
+#define NO_LOCKSTEP UINT64_MAX
+
+// Why an engine stopped.
+enum EngineStop
+{
+  ENGINE_RUNNING = 0,
+  ENGINE_HALTED,
+  ENGINE_INPUT,       // it wanted input after all of it had been read
+  ENGINE_INVALID      // it executed RTI or the reserved opcode
+};
+
+// What the reference asks of a candidate that is waiting for it.
+enum Request
+{
+  REQUEST_NONE = 0,
+  REQUEST_NEXT,       // carry on
+  REQUEST_MEMORY,     // copy memory into the validation
+  REQUEST_QUIT
+};
+
+struct Checkpoint
+{
+  uint64_t retired;
+  uint64_t memoryHash;
+  uint64_t outputLength;
+  uint64_t outputHash;
+  uint16_t regs[R_MAX];
+  // The step that led to the checkpoint started with this instruction.
+  uint16_t pc;
+  uint16_t instruction;
+  int stop;
+  // Whether the candidate waits for a request after this checkpoint.
+  int waiting;
+};
+
+struct Engine
+{
+  // First, so that the console callbacks can get at the engine.
+  struct Console console;
+  const char* name;
+  void (*start)(struct Engine* engine);
+  // Executes the next instruction, or the next run of instructions the engine
+  // executes in one go (e.g. a loop run as an idiom), and returns how many
+  // guest instructions that was.
+  uint32_t (*step)(struct Engine* engine);
+  void (*save)(struct Engine* engine, struct Checkpoint* checkpoint);
+  void (*copyMemory)(struct Engine* engine, uint16_t* memory);
+  int idioms;
+  // The guest of an interpreter, or the group of the SPMD engine.
+  struct Guest* guest;
+  struct SpmdGroup* group;
+  // Every lane of the group runs the same input, and is compared with lane 0
+  // as well as lane 0 with the reference. `lane` is the one that is compared
+  // with the reference, which is the first that differs from lane 0 if any.
+  int lane;
+  char laneName[32];
+  uint64_t laneHashes[SPMD_LANES];
+  uint64_t vectorSteps;
+  const uint16_t* image;
+  uint64_t imageHash;
+  const uint8_t* input;
+  size_t inputLength;
+  size_t inputPos;
+  char* output;
+  size_t outputLength;
+  size_t outputCapacity;
+  // The hash of the first `outputHashed` bytes of output.
+  uint64_t outputHash;
+  size_t outputHashed;
+  uint64_t memoryHash;
+  uint64_t retired;
+  uint16_t lastPc;
+  uint16_t lastInstruction;
+  int stop;
+};
+
+struct Validation
+{
+  struct Engine reference;
+  struct Engine candidate;
+  uint64_t every;
+  uint64_t lockstepFrom;
+  uint64_t checkpoints;
+  int reported;
+
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  // The batches are used as a ring, `ready` of them starting at `head` are
+  // full or being compared.
+  struct Checkpoint batches[BATCH_COUNT][BATCH_SIZE];
+  int lengths[BATCH_COUNT];
+  int head;
+  int ready;
+  int request;
+  int memoryCopied;
+  uint16_t memory[MEMORY_MAX];
+
+  uint16_t recentPcs[RECENT_INSTRUCTIONS];
+  uint16_t recentInstructions[RECENT_INSTRUCTIONS];
+};
+
+int validating = 0;
+
+// The finaliser of splitmix64, so that neighbouring addresses and values
+// give unrelated hashes.
+static uint64_t wordHash(uint16_t address, uint16_t value)
+{
+  uint64_t x = ((uint64_t)address << 16 | value) + 0x9E3779B97F4A7C15ULL;
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+  return x ^ (x >> 31);
+}
+
+// The keyboard registers are left out, reading them changes them.
+static int hashedAddress(uint16_t address)
+{
+  return address != MR_KBSR && address != MR_KBDR;
+}
+
+static uint64_t hashMemory(const uint16_t* memory)
+{
+  uint64_t hash = 0;
+  for (uint32_t address = 0; address < MEMORY_MAX; address++)
+  {
+    if (hashedAddress(address))
+    {
+      hash += wordHash(address, memory[address]);
+    }
+  }
+  return hash;
+}
+
+#define OUTPUT_HASH_START 0xCBF29CE484222325ULL
+
+// Adds the output from `outputHashed` to `outputLength` to the output hash.
+static void hashOutput(struct Engine* engine, const char* output,
+                       size_t outputLength)
+{
+  for (; engine->outputHashed < outputLength; engine->outputHashed++)
+  {
+    engine->outputHash ^= (uint8_t)output[engine->outputHashed];
+    engine->outputHash *= 0x100000001B3ULL;
+  }
+}
+
+static void hashStore(uint64_t* hash, uint16_t address, uint16_t oldValue,
+                      uint16_t newValue)
+{
+  if (hashedAddress(address))
+  {
+    *hash += wordHash(address, newValue) - wordHash(address, oldValue);
+  }
+}
+
+// Called by memWrite before `value` is stored, for a guest whose console is
+// an engine's.
+void validateWrite(struct Guest* guest, uint16_t address, uint16_t value)
+{
+  struct Engine* engine = (struct Engine*)guest->console;
+  hashStore(&engine->memoryHash, address, guest->mem[address], value);
+}
+
+static int engineGetChar(struct Console* console)
+{
+  struct Engine* engine = (struct Engine*)console;
+  if (engine->inputPos < engine->inputLength)
+  {
+    return engine->input[engine->inputPos++];
+  }
+  console->stopped = STOP_INPUT;
+  return EOF;
+}
+
+static int engineKeyReady(struct Console* console)
+{
+  struct Engine* engine = (struct Engine*)console;
+  if (engine->inputPos < engine->inputLength)
+  {
+    return 1;
+  }
+  console->stopped = STOP_INPUT;
+  return 0;
+}
+
+static void enginePutChar(struct Console* console, char c)
+{
+  struct Engine* engine = (struct Engine*)console;
+  if (engine->outputLength == engine->outputCapacity)
+  {
+    engine->outputCapacity = engine->outputCapacity
+      ? engine->outputCapacity * 2 : 256;
+    engine->output = realloc(engine->output, engine->outputCapacity);
+  }
+  engine->output[engine->outputLength++] = c;
+}
+
+static void engineFlush(struct Console* console)
+{
+}
+
+// The main interpreter, on the engine's guest.
+static void startInterpreter(struct Engine* engine)
+{
+  struct Guest* guest = engine->guest;
+  memcpy(guest->mem, engine->image, sizeof(guest->mem));
+  memset(guest->regs, 0, sizeof(guest->regs));
+  guest->regs[R_COND] = FL_ZRO;
+  guest->regs[R_PC] = entryPoint;
+  engine->memoryHash = engine->imageHash;
+  engine->outputHash = OUTPUT_HASH_START;
+  engine->outputHashed = 0;
+  guest->idioms.enabled = engine->idioms;
+  guest->console = &engine->console;
+  resetClock(guest);
+}
+
+static uint64_t idiomTotal(struct Guest* guest)
+{
+  uint64_t total = 0;
+  for (int idiom = 0; idiom < IDIOM_KINDS; idiom++)
+  {
+    total += guest->idioms.instructions[idiom];
+  }
+  return total;
+}
+
+static uint32_t stepInterpreter(struct Engine* engine)
+{
+  struct Guest* guest = engine->guest;
+  uint64_t idiomsBefore = engine->idioms ? idiomTotal(guest) : 0;
+
+  engine->lastPc = guest->regs[R_PC];
+  engine->lastInstruction = memFetch(guest, guest->regs[R_PC]++);
+  // Native loops count their instructions on the clock themselves.
+  guest->clock.instructions++;
+  int running = executeInstruction(guest, engine->lastInstruction);
+
+  if (engine->console.stopped == STOP_INPUT)
+  {
+    engine->stop = ENGINE_INPUT;
+  }
+  else if (engine->console.stopped == STOP_INVALID_OPCODE)
+  {
+    engine->stop = ENGINE_INVALID;
+  }
+  else if (!running)
+  {
+    engine->stop = ENGINE_HALTED;
+  }
+  return 1 + (engine->idioms ? idiomTotal(guest) - idiomsBefore : 0);
+}
+
+static void saveInterpreter(struct Engine* engine,
+                            struct Checkpoint* checkpoint)
+{
+  memcpy(checkpoint->regs, engine->guest->regs, sizeof(checkpoint->regs));
+  checkpoint->memoryHash = engine->memoryHash;
+  checkpoint->outputLength = engine->outputLength;
+  hashOutput(engine, engine->output, engine->outputLength);
+  checkpoint->outputHash = engine->outputHash;
+}
+
+static void copyInterpreterMemory(struct Engine* engine, uint16_t* memory)
+{
+  memcpy(memory, engine->guest->mem, sizeof(engine->guest->mem));
+}
+
+/*
+ * A full group of SPMD guests, all with the same input, so that the group
+ * runs as vectors the way it does for a batch (a group of one lane would
+ * only ever step that lane on its own), see spmd.c.
+ */
+static uint16_t* laneWord(struct SpmdGroup* group, int lane,
+                          uint16_t address)
+{
+  return group->mem + address * SPMD_LANES + lane;
+}
+
+static void startSpmd(struct Engine* engine)
+{
+  engine->group = createSpmdGroup(engine->image, SPMD_LANES);
+  for (int lane = 0; lane < SPMD_LANES; lane++)
+  {
+    setSpmdInput(engine->group, lane, engine->input, engine->inputLength);
+    engine->laneHashes[lane] = engine->imageHash;
+  }
+  engine->lane = 0;
+  engine->name = "spmd";
+  engine->outputHash = OUTPUT_HASH_START;
+  engine->outputHashed = 0;
+}
+
+/*
+ * The SPMD engine stores straight into its own memory, so the address of a
+ * store is worked out before the step to keep the memory hash up to date.
+ * Returns whether the instruction at `pc` is a store.
+ */
+static int storeAddress(struct SpmdGroup* group, int lane,
+                        uint16_t* address)
+{
+  uint16_t pc = group->regs[R_PC][lane];
+  uint16_t instruction = *laneWord(group, lane, pc);
+  uint16_t pcRelative = pc + 1 + signExtendPcOffset(instruction);
+  switch (instruction >> 12)
+  {
+    case OP_ST:
+      *address = pcRelative;
+      return 1;
+    case OP_STI:
+      *address = *laneWord(group, lane, pcRelative);
+      return 1;
+    case OP_STR:
+      *address = group->regs[extractRegister(instruction, 6)][lane]
+        + signExtend(instruction & 0x3F, 6);
+      return 1;
+  }
+  return 0;
+}
+
+/*
+ * Steps the group until lane 0 has executed an instruction (the lanes at
+ * lower program counters go first), keeping the memory hash of every lane up
+ * to date. Returns the number of instructions lane 0 retired.
+ */
+static uint32_t stepSpmd(struct Engine* engine)
+{
+  struct SpmdGroup* group = engine->group;
+  uint16_t addresses[SPMD_LANES];
+  uint16_t oldValues[SPMD_LANES];
+
+  do
+  {
+    uint32_t stores = 0;
+    for (int lane = 0; lane < SPMD_LANES; lane++)
+    {
+      if (((group->running >> lane) & 1)
+          && storeAddress(group, lane, &addresses[lane]))
+      {
+        stores |= 1u << lane;
+        oldValues[lane] = *laneWord(group, lane, addresses[lane]);
+      }
+    }
+    engine->lastPc = group->regs[R_PC][0];
+    engine->lastInstruction = *laneWord(group, 0, engine->lastPc);
+
+    stepSpmdGroup(group);
+
+    stores &= group->stepped;
+    for (int lane = 0; stores; lane++, stores >>= 1)
+    {
+      if (stores & 1)
+      {
+        hashStore(&engine->laneHashes[lane], addresses[lane],
+                  oldValues[lane], *laneWord(group, lane, addresses[lane]));
+      }
+    }
+  } while ((group->running & 1) && !(group->stepped & 1));
+
+  if (!(group->running & 1))
+  {
+    const char* error = group->lanes[0].error;
+    engine->stop = !error ? ENGINE_HALTED
+      : strcmp(error, "invalid opcode") == 0 ? ENGINE_INVALID : ENGINE_INPUT;
+  }
+  return group->stepped & 1;
+}
+
+// Whether `lane` has got to a different state from lane 0.
+static int laneDiffers(struct Engine* engine, int lane)
+{
+  struct SpmdGroup* group = engine->group;
+  const struct SpmdLane* first = &group->lanes[0];
+  const struct SpmdLane* other = &group->lanes[lane];
+  if (((group->running >> lane) & 1) != (group->running & 1)
+      || engine->laneHashes[lane] != engine->laneHashes[0]
+      || other->outputLength != first->outputLength)
+  {
+    return 1;
+  }
+  for (int reg = 0; reg < R_MAX; reg++)
+  {
+    if (group->regs[reg][lane] != group->regs[reg][0])
+    {
+      return 1;
+    }
+  }
+  // Output is only compared in full at the end, like with the reference.
+  return engine->stop
+    && memcmp(other->output, first->output, first->outputLength) != 0;
+}
+
+static void saveSpmd(struct Engine* engine, struct Checkpoint* checkpoint)
+{
+  struct SpmdGroup* group = engine->group;
+  // A lane that differs from lane 0 is shown to the reference in its place,
+  // as one of the two is bound to differ from it.
+  int lane = 1;
+  while (lane < SPMD_LANES && !laneDiffers(engine, lane))
+  {
+    lane++;
+  }
+  if (lane == SPMD_LANES)
+  {
+    lane = 0;
+  }
+  if (lane != engine->lane)
+  {
+    engine->lane = lane;
+    snprintf(engine->laneName, sizeof(engine->laneName), "spmd lane %d",
+             lane);
+    engine->name = engine->laneName;
+    engine->outputHash = OUTPUT_HASH_START;
+    engine->outputHashed = 0;
+  }
+
+  for (int reg = 0; reg < R_MAX; reg++)
+  {
+    checkpoint->regs[reg] = group->regs[reg][lane];
+  }
+  checkpoint->memoryHash = engine->laneHashes[lane];
+  checkpoint->outputLength = group->lanes[lane].outputLength;
+  hashOutput(engine, group->lanes[lane].output, checkpoint->outputLength);
+  checkpoint->outputHash = engine->outputHash;
+  if (engine->stop)
+  {
+    engine->output = group->lanes[lane].output;
+    engine->outputLength = group->lanes[lane].outputLength;
+  }
+}
+
+static void copySpmdMemory(struct Engine* engine, uint16_t* memory)
+{
+  for (uint32_t address = 0; address < MEMORY_MAX; address++)
+  {
+    memory[address] = *laneWord(engine->group, engine->lane, address);
+  }
+}
+
+static void saveCheckpoint(struct Engine* engine,
+                           struct Checkpoint* checkpoint)
+{
+  engine->save(engine, checkpoint);
+  checkpoint->retired = engine->retired;
+  checkpoint->pc = engine->lastPc;
+  checkpoint->instruction = engine->lastInstruction;
+  checkpoint->stop = engine->stop;
+}
+
+/*
+ * Hands the batch the candidate has filled over to the reference and waits
+ * for a free one. Returns 0 if the reference has no use for any more.
+ */
+static int handOver(struct Validation* validation, int* filling, int* length)
+{
+  pthread_mutex_lock(&validation->lock);
+  validation->lengths[*filling] = *length;
+  validation->ready++;
+  pthread_cond_broadcast(&validation->changed);
+  while (validation->ready == BATCH_COUNT
+         && validation->request != REQUEST_QUIT)
+  {
+    pthread_cond_wait(&validation->changed, &validation->lock);
+  }
+  *filling = (validation->head + validation->ready) % BATCH_COUNT;
+  *length = 0;
+  int quit = validation->request == REQUEST_QUIT;
+  pthread_mutex_unlock(&validation->lock);
+  return !quit;
+}
+
+/*
+ * Waits for the reference to catch up with a waiting checkpoint and does
+ * what it asks. Returns whether the candidate should carry on.
+ */
+static int answerRequests(struct Validation* validation)
+{
+  pthread_mutex_lock(&validation->lock);
+  for (;;)
+  {
+    while (validation->request == REQUEST_NONE)
+    {
+      pthread_cond_wait(&validation->changed, &validation->lock);
+    }
+    int request = validation->request;
+    if (request == REQUEST_QUIT)
+    {
+      break;
+    }
+    validation->request = REQUEST_NONE;
+    if (request == REQUEST_NEXT)
+    {
+      pthread_mutex_unlock(&validation->lock);
+      return 1;
+    }
+    validation->candidate.copyMemory(&validation->candidate,
+                                     validation->memory);
+    validation->memoryCopied = 1;
+    pthread_cond_broadcast(&validation->changed);
+  }
+  pthread_mutex_unlock(&validation->lock);
+  return 0;
+}
+
+static int endsBlock(uint16_t instruction)
+{
+  switch (instruction >> 12)
+  {
+    case OP_BR:
+    case OP_JMP:
+    case OP_JSR:
+    case OP_TRAP:
+      return 1;
+  }
+  return 0;
+}
+
+static void* runCandidate(void* argument)
+{
+  struct Validation* validation = argument;
+  struct Engine* engine = &validation->candidate;
+  uint64_t lastCheckpoint = 0;
+  int filling = 0;
+  int length = 0;
+
+  engine->start(engine);
+  while (!engine->stop)
+  {
+    engine->retired += engine->step(engine);
+
+    int lockstep = engine->retired >= validation->lockstepFrom;
+    if (!engine->stop && !lockstep)
+    {
+      if (validation->lockstepFrom != NO_LOCKSTEP)
+      {
+        continue;
+      }
+      if (validation->every
+          ? engine->retired - lastCheckpoint < validation->every
+          : !endsBlock(engine->lastInstruction))
+      {
+        continue;
+      }
+    }
+
+    struct Checkpoint* checkpoint = &validation->batches[filling][length++];
+    saveCheckpoint(engine, checkpoint);
+    checkpoint->waiting = lockstep || engine->stop;
+    lastCheckpoint = engine->retired;
+
+    if ((length == BATCH_SIZE || checkpoint->waiting)
+        && !handOver(validation, &filling, &length))
+    {
+      break;
+    }
+    if (checkpoint->waiting && !answerRequests(validation))
+    {
+      break;
+    }
+  }
+
+  if (engine->group)
+  {
+    engine->vectorSteps = engine->group->vectorSteps;
+    freeSpmdGroup(engine->group);
+    engine->group = NULL;
+    engine->output = NULL;
+    engine->outputLength = 0;
+  }
+  return NULL;
+}
+
+static void sendRequest(struct Validation* validation, int request)
+{
+  pthread_mutex_lock(&validation->lock);
+  validation->request = request;
+  pthread_cond_broadcast(&validation->changed);
+  pthread_mutex_unlock(&validation->lock);
+}
+
+// Copies the memory of the (waiting) candidate into the validation.
+static void copyCandidateMemory(struct Validation* validation)
+{
+  pthread_mutex_lock(&validation->lock);
+  validation->memoryCopied = 0;
+  validation->request = REQUEST_MEMORY;
+  pthread_cond_broadcast(&validation->changed);
+  while (!validation->memoryCopied)
+  {
+    pthread_cond_wait(&validation->changed, &validation->lock);
+  }
+  pthread_mutex_unlock(&validation->lock);
+}
+
+// Runs the reference until it has retired `target` instructions or stopped.
+static void catchUp(struct Validation* validation, uint64_t target)
+{
+  struct Engine* reference = &validation->reference;
+  while (reference->retired < target && !reference->stop)
+  {
+    reference->retired += reference->step(reference);
+
+    int recent = reference->retired % RECENT_INSTRUCTIONS;
+    validation->recentPcs[recent] = reference->lastPc;
+    validation->recentInstructions[recent] = reference->lastInstruction;
+  }
+}
+
+static int sameState(const struct Checkpoint* ours,
+                     const struct Checkpoint* theirs)
+{
+  // A guest that runs out of input stops part way through an instruction,
+  // where engines may well have done different amounts of it.
+  if (ours->stop == ENGINE_INPUT && theirs->stop == ENGINE_INPUT)
+  {
+    return 1;
+  }
+  return ours->retired == theirs->retired
+    && ours->stop == theirs->stop
+    && ours->memoryHash == theirs->memoryHash
+    && ours->outputLength == theirs->outputLength
+    && ours->outputHash == theirs->outputHash
+    && memcmp(ours->regs, theirs->regs, sizeof(ours->regs)) == 0;
+}
+
+static const char* stopName(int stop)
+{
+  switch (stop)
+  {
+    case ENGINE_HALTED:
+      return "halted";
+    case ENGINE_INPUT:
+      return "ran out of input";
+    case ENGINE_INVALID:
+      return "executed an invalid opcode";
+  }
+  return "was running";
+}
+
+static void printRecentInstruction(struct Validation* validation,
+                                   uint64_t number)
+{
+  int recent = number % RECENT_INSTRUCTIONS;
+  char text[DISASSEMBLY_MAX];
+  disassembleInstruction(validation->recentPcs[recent],
+                         validation->recentInstructions[recent], text,
+                         sizeof(text));
+  char symbol[SYMBOL_TEXT_MAX];
+  formatSymbol(validation->recentPcs[recent], symbol, sizeof(symbol));
+  printf("  #%-12llu x%04X  x%04X  %-20s %s\n", (unsigned long long)number,
+         validation->recentPcs[recent],
+         validation->recentInstructions[recent], text, symbol);
+}
+
+// Lists the words where the candidate's memory differs from the reference's.
+// Returns the number of them.
+static uint32_t reportMemory(struct Validation* validation)
+{
+  const uint16_t* mem = validation->reference.guest->mem;
+  uint32_t differences = 0;
+  copyCandidateMemory(validation);
+  for (uint32_t address = 0; address < MEMORY_MAX; address++)
+  {
+    if (mem[address] == validation->memory[address])
+    {
+      continue;
+    }
+    if (differences++ == 0)
+    {
+      printf("Memory:\n");
+    }
+    if (differences <= MAX_LISTED_WORDS)
+    {
+      printf("  x%04X      reference x%04X  %s x%04X\n", address,
+             mem[address], validation->candidate.name,
+             validation->memory[address]);
+    }
+  }
+  if (differences > MAX_LISTED_WORDS)
+  {
+    printf("  ... %u words differ in all\n", differences);
+  }
+  return differences;
+}
+
+/*
+ * Describes the first checkpoint the engines disagree on, which came after a
+ * single step of the candidate from the `previous` checkpoint.
+ */
+static void reportDivergence(struct Validation* validation,
+                             const struct Checkpoint* ours,
+                             const struct Checkpoint* theirs,
+                             uint64_t previous)
+{
+  const char* name = validation->candidate.name;
+  validation->reported = 1;
+
+  printf("%s diverged from the reference after %llu instructions\n", name,
+         (unsigned long long)previous);
+  if (theirs->retired == previous + 1 && ours->retired == previous + 1)
+  {
+    printf("The first divergent instruction:\n");
+  }
+  else
+  {
+    char text[DISASSEMBLY_MAX];
+    disassembleInstruction(theirs->pc, theirs->instruction, text,
+                           sizeof(text));
+    printf("%s ran instructions #%llu to #%llu as a single step from "
+           "x%04X (%s), the reference executed (last %d shown):\n", name,
+           (unsigned long long)previous + 1,
+           (unsigned long long)theirs->retired, theirs->pc, text,
+           RECENT_INSTRUCTIONS);
+  }
+  uint64_t first = previous + 1;
+  if (ours->retired >= RECENT_INSTRUCTIONS
+      && first < ours->retired - RECENT_INSTRUCTIONS + 1)
+  {
+    first = ours->retired - RECENT_INSTRUCTIONS + 1;
+  }
+  for (uint64_t number = first; number <= ours->retired; number++)
+  {
+    printRecentInstruction(validation, number);
+  }
+
+  if (ours->retired != theirs->retired || ours->stop != theirs->stop)
+  {
+    printf("The reference %s after %llu instructions, %s %s after %llu\n",
+           stopName(ours->stop), (unsigned long long)ours->retired, name,
+           stopName(theirs->stop), (unsigned long long)theirs->retired);
+  }
+  static const char* registerNames[R_MAX] =
+  {
+    "R0", "R1", "R2", "R3", "R4", "R5", "R6", "R7", "PC", "COND"
+  };
+  for (int reg = 0; reg < R_MAX; reg++)
+  {
+    if (ours->regs[reg] != theirs->regs[reg])
+    {
+      printf("  %-10s reference x%04X  %s x%04X\n", registerNames[reg],
+             ours->regs[reg], name, theirs->regs[reg]);
+    }
+  }
+  if (ours->outputLength != theirs->outputLength)
+  {
+    printf("  output     reference %llu bytes  %s %llu bytes\n",
+           (unsigned long long)ours->outputLength, name,
+           (unsigned long long)theirs->outputLength);
+  }
+  else if (ours->outputHash != theirs->outputHash)
+  {
+    printf("  output     different bytes in the %llu printed\n",
+           (unsigned long long)ours->outputLength);
+  }
+  reportMemory(validation);
+}
+
+/*
+ * Once both engines have stopped the same way, compares all of memory and
+ * everything they printed. Returns whether they are the same.
+ */
+static int compareFinalState(struct Validation* validation)
+{
+  struct Engine* reference = &validation->reference;
+  struct Engine* candidate = &validation->candidate;
+
+  if (reference->stop == ENGINE_INPUT)
+  {
+    return 1;
+  }
+  if (reportMemory(validation))
+  {
+    printf("%s left memory different from the reference when it %s\n",
+           candidate->name, stopName(reference->stop));
+    validation->reported = 1;
+    return 0;
+  }
+  for (size_t idx = 0; idx < reference->outputLength; idx++)
+  {
+    if (reference->output[idx] != candidate->output[idx])
+    {
+      printf("%s printed something different from the reference at byte "
+             "%zu of its output\n", candidate->name, idx);
+      validation->reported = 1;
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static void resetEngine(struct Engine* engine)
+{
+  engine->console.stopped = STOP_NONE;
+  engine->inputPos = 0;
+  engine->outputLength = 0;
+  engine->retired = 0;
+  engine->stop = ENGINE_RUNNING;
+}
+
+/*
+ * Runs both engines from the start and compares them at every checkpoint.
+ * Returns whether they agreed all the way, and otherwise sets `matched` to
+ * the number of instructions at the last checkpoint they agreed on.
+ *
+ * From `lockstepFrom` instructions on the candidate waits for the reference
+ * after every step, which is what the detailed report needs.
+ */
+static int compareRun(struct Validation* validation, uint64_t lockstepFrom,
+                      uint64_t* matched)
+{
+  struct Engine* reference = &validation->reference;
+  int agreed = 1;
+  int done = 0;
+
+  resetEngine(reference);
+  resetEngine(&validation->candidate);
+  validation->lockstepFrom = lockstepFrom;
+  validation->checkpoints = 0;
+  validation->head = 0;
+  validation->ready = 0;
+  validation->request = REQUEST_NONE;
+  *matched = 0;
+
+  reference->start(reference);
+  pthread_t thread;
+  int error = pthread_create(&thread, NULL, runCandidate, validation);
+  if (error)
+  {
+    printf("Failed to start %s: %s\n", validation->candidate.name,
+           strerror(error));
+    exit(1);
+  }
+
+  while (!done)
+  {
+    pthread_mutex_lock(&validation->lock);
+    while (validation->ready == 0)
+    {
+      pthread_cond_wait(&validation->changed, &validation->lock);
+    }
+    struct Checkpoint* batch = validation->batches[validation->head];
+    int length = validation->lengths[validation->head];
+    pthread_mutex_unlock(&validation->lock);
+
+    for (int idx = 0; idx < length && !done; idx++)
+    {
+      struct Checkpoint* theirs = &batch[idx];
+      struct Checkpoint ours;
+      catchUp(validation, theirs->retired);
+      saveCheckpoint(reference, &ours);
+      validation->checkpoints++;
+
+      if (!sameState(&ours, theirs))
+      {
+        if (theirs->waiting && lockstepFrom != NO_LOCKSTEP)
+        {
+          reportDivergence(validation, &ours, theirs, *matched);
+        }
+        agreed = 0;
+        done = 1;
+        break;
+      }
+      *matched = theirs->retired;
+
+      if (theirs->stop)
+      {
+        agreed = compareFinalState(validation);
+        done = 1;
+      }
+      else if (theirs->waiting)
+      {
+        sendRequest(validation, REQUEST_NEXT);
+      }
+    }
+
+    pthread_mutex_lock(&validation->lock);
+    validation->head = (validation->head + 1) % BATCH_COUNT;
+    validation->ready--;
+    pthread_cond_broadcast(&validation->changed);
+    pthread_mutex_unlock(&validation->lock);
+  }
+
+  sendRequest(validation, REQUEST_QUIT);
+  pthread_join(thread, NULL);
+  return agreed;
+}
+
+static uint8_t* readInput(const char* path, size_t* length)
+{
+  FILE* file = fopen(path, "rb");
+  if (!file)
+  {
+    return NULL;
+  }
+  fseek(file, 0, SEEK_END);
+  *length = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  uint8_t* data = malloc(*length + 1);
+  *length = fread(data, 1, *length, file);
+  fclose(file);
+  return data;
+}
+
+static void setUpEngine(struct Engine* engine, const char* name,
+                        struct Guest* guest, const uint16_t* image,
+                        uint64_t imageHash, const uint8_t* input,
+                        size_t inputLength)
+{
+  engine->console = (struct Console){ engineGetChar, engineKeyReady,
+                                      enginePutChar, engineFlush, STOP_NONE };
+  engine->name = name;
+  engine->image = image;
+  engine->imageHash = imageHash;
+  engine->input = input;
+  engine->inputLength = inputLength;
+  if (strcmp(name, "spmd") == 0)
+  {
+    engine->start = startSpmd;
+    engine->step = stepSpmd;
+    engine->save = saveSpmd;
+    engine->copyMemory = copySpmdMemory;
+  }
+  else
+  {
+    engine->start = startInterpreter;
+    engine->step = stepInterpreter;
+    engine->save = saveInterpreter;
+    engine->copyMemory = copyInterpreterMemory;
+    engine->idioms = strcmp(name, "idioms") == 0;
+    engine->guest = guest;
+  }
+}
+
+/*
+ * Validates the engine called `engineName` (idioms or spmd) against the
+ * reference, starting from the images that have already been read into the
+ * main guest and using the contents of `inputPath` (if given) as the keyboard. With
+ * `every` set the engines are compared every that many instructions rather
+ * than at every block boundary.
+ *
+ * Returns whether the engines agreed.
+ */
+int runValidation(const char* engineName, const char* inputPath,
+                  uint64_t every)
+{
+  if (strcmp(engineName, "idioms") != 0 && strcmp(engineName, "spmd") != 0)
+  {
+    printf("Unknown engine: %s (expected idioms or spmd)\n", engineName);
+    return 0;
+  }
+
+  size_t inputLength = 0;
+  uint8_t* input = NULL;
+  if (inputPath && !(input = readInput(inputPath, &inputLength)))
+  {
+    printf("Failed to read input: %s\n", inputPath);
+    return 0;
+  }
+
+  struct Validation* validation = calloc(1, sizeof(struct Validation));
+  uint16_t* image = malloc(sizeof(mainGuest.mem));
+  memcpy(image, mainGuest.mem, sizeof(mainGuest.mem));
+  uint64_t imageHash = hashMemory(image);
+
+  // The reference runs on the main guest and an interpreted candidate on a
+  // guest of its own, on its own thread.
+  struct Guest* candidateGuest = newGuest();
+  if (!candidateGuest)
+  {
+    printf("Failed to allocate a guest for %s\n", engineName);
+    return 0;
+  }
+  setUpEngine(&validation->reference, "reference", &mainGuest, image,
+              imageHash, input, inputLength);
+  setUpEngine(&validation->candidate, engineName, candidateGuest, image,
+              imageHash, input, inputLength);
+  validation->every = every;
+  pthread_mutex_init(&validation->lock, NULL);
+  pthread_cond_init(&validation->changed, NULL);
+
+  // The host's time would be different for each engine, and every time they
+  // are run, so the guest gets the virtual clock.
+  if (!clockRate)
+  {
+    clockRate = CLOCK_DEFAULT_RATE;
+    printf("Validating on the virtual clock, at %u instructions per ms\n",
+           clockRate);
+  }
+
+  // Stores have to reach validateWrite.
+  validating = 1;
+  memObserved = 1;
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  uint64_t matched;
+  int agreed = compareRun(validation, NO_LOCKSTEP, &matched);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  if (agreed)
+  {
+    double seconds = (end.tv_sec - start.tv_sec)
+      + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%s matched the reference at %llu checkpoints over %llu "
+           "instructions (%.2f s, %.1fM instructions/s), the guest %s\n",
+           engineName, (unsigned long long)validation->checkpoints,
+           (unsigned long long)validation->reference.retired, seconds,
+           validation->reference.retired / seconds / 1e6,
+           stopName(validation->reference.stop));
+    if (strcmp(engineName, "spmd") == 0)
+    {
+      printf("All %d lanes matched, %llu steps ran as vectors\n", SPMD_LANES,
+             (unsigned long long)validation->candidate.vectorSteps);
+    }
+  }
+  else if (!validation->reported)
+  {
+    // Run again, stepping through the block after the last checkpoint the
+    // two agreed on, to find out exactly where they part.
+    if (compareRun(validation, matched, &matched))
+    {
+      printf("%s diverged from the reference, but not when run again\n",
+             engineName);
+    }
+  }
+
+  validating = 0;
+  memObserved = 0;
+  free(validation->reference.output);
+  free(validation->candidate.output);
+  free(validation);
+  free(candidateGuest);
+  free(image);
+  free(input);
+  return agreed;
+}
@@ -0,0 +1,1147 @@
+/*
+ * The tests run by `make check`, at least one for every part of the VM, on
+ * the tiny guests in tests/guests (each .obj was assembled from the .asm
+ * next to it).
+ *
+ * Usage: lc3-check [name]...
+ *
+ * It has to be run from the directory the Makefile is in. With names given,
+ * only the tests whose name starts with one of them are run.
+ *
+ * Much of the VM keeps its state in globals (the main guest, the simulated
+ * caches, the thread's watched pages), so every test runs in a process of
+ * its own. Whatever it prints goes to a log that is only shown if it fails,
+ * and tests that check what the VM prints read it back from there.
+ */
+// For nftw.
+#define _GNU_SOURCE
+#include <errno.h>
+#include <dirent.h>
+#include <ftw.h>
+#include <limits.h>
+#include <setjmp.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "architecture.h"
+#include "analysis.h"
+#include "cache.h"
+#include "clock.h"
+#include "codewatch.h"
+#include "container.h"
+#include "debug.h"
+#include "explore.h"
+#include "fuzz.h"
+#include "idiom.h"
+#include "image.h"
+#include "interpreter.h"
+#include "lz4.h"
+#include "metrics.h"
+#include "perfcounters.h"
+#include "server.h"
+#include "snapshot.h"
+#include "spmd.h"
+#include "timing.h"
+#include "validate.h"
+
+#define GUESTS "tests/guests/"
+
+// How long a test may take before it counts as hanging, in seconds.
+#define TEST_TIMEOUT 30
+
+// The most instructions any of the guests needs.
+#define GUEST_BUDGET 1000000
+
+// Addresses in the guests, see the listings in tests/guests.
+#define LOOPS_MUL 0x3002
+#define LOOPS_SHIFT 0x300A
+#define LOOPS_COPYING 0x3012
+#define LOOPS_PRODUCT 0x301A
+#define LOOPS_SHIFTED 0x301B
+#define LOOPS_SOURCE 0x301C
+#define LOOPS_COPY 0x3024
+#define COUNT_COUNT 0x3009
+#define TIMER_NOW 0x3010
+#define STOPWATCH_ELAPSED 0x3012
+#define BUSY_WORK 0x300A
+#define SMC_MUL 0x3005
+#define SMC_FIRST 0x3011
+#define SMC_SECOND 0x3012
+
+enum TestResult
+{
+  TEST_FAILED = 0,
+  TEST_PASSED,
+  TEST_SKIPPED    // what it tests isn't available on this host
+};
+
+// Fails the test, saying where, unless `condition` holds.
+#define CHECK(condition) \
+  do \
+  { \
+    if (!(condition)) \
+    { \
+      fprintf(stderr, "%s:%d: failed: %s\n", __FILE__, __LINE__, \
+              #condition); \
+      return TEST_FAILED; \
+    } \
+  } while (0)
+
+// A directory of the test's own for files and sockets, and its log. Kept
+// short, as socket paths have to fit in a sockaddr_un.
+static char testDirectory[64];
+static char logPath[PATH_MAX];
+
+// The keyboard and screen of a guest under test.
+struct TestConsole
+{
+  // First, so that the console callbacks can get at the rest.
+  struct Console console;
+  const char* input;
+  size_t inputPos;
+  char output[4096];
+  size_t outputLength;
+};
+
+static int testGetChar(struct Console* console)
+{
+  struct TestConsole* test = (struct TestConsole*)console;
+  if (test->input[test->inputPos])
+  {
+    return (unsigned char)test->input[test->inputPos++];
+  }
+  console->stopped = STOP_INPUT;
+  return EOF;
+}
+
+static int testKeyReady(struct Console* console)
+{
+  struct TestConsole* test = (struct TestConsole*)console;
+  if (test->input[test->inputPos])
+  {
+    return 1;
+  }
+  console->stopped = STOP_INPUT;
+  return 0;
+}
+
+static void testPutChar(struct Console* console, char c)
+{
+  struct TestConsole* test = (struct TestConsole*)console;
+  if (test->outputLength < sizeof(test->output) - 1)
+  {
+    test->output[test->outputLength++] = c;
+  }
+}
+
+static void testFlush(struct Console* console)
+{
+}
+
+static struct TestConsole* consoleOf(struct Guest* guest)
+{
+  return (struct TestConsole*)guest->console;
+}
+
+// Gives `guest` a test console with `input` as its keyboard.
+static void attachConsole(struct Guest* guest, const char* input)
+{
+  struct TestConsole* console = calloc(1, sizeof(struct TestConsole));
+  console->console = (struct Console){ testGetChar, testKeyReady,
+                                       testPutChar, testFlush, STOP_NONE };
+  console->input = input;
+  guest->console = &console->console;
+}
+
+static void startGuest(struct Guest* guest)
+{
+  guest->regs[R_COND] = FL_ZRO;
+  guest->regs[R_PC] = entryPoint;
+  resetClock(guest);
+}
+
+// A new guest with tests/guests/`name`.obj in its memory and no input.
+static struct Guest* loadGuest(const char* name)
+{
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), GUESTS "%s.obj", name);
+  struct Image image;
+  struct Guest* guest = newGuest();
+  if (!guest || !loadImage(path, &image))
+  {
+    fprintf(stderr, "Failed to load %s\n", path);
+    exit(TEST_FAILED);
+  }
+  placeImage(guest, &image);
+  freeImage(&image);
+  startGuest(guest);
+  attachConsole(guest, "");
+  return guest;
+}
+
+// loadGuest for the main guest, which some parts of the VM always use.
+static struct Guest* loadMainGuest(const char* name)
+{
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), GUESTS "%s.obj", name);
+  if (!readImage(path))
+  {
+    fprintf(stderr, "Failed to load %s\n", path);
+    exit(TEST_FAILED);
+  }
+  startGuest(&mainGuest);
+  attachConsole(&mainGuest, "");
+  return &mainGuest;
+}
+
+// Runs `guest` with `input` until it stops. Returns whether it halted.
+static int runGuest(struct Guest* guest, const char* input)
+{
+  uint64_t executed;
+  consoleOf(guest)->input = input;
+  return !runInterpreterBudget(guest, GUEST_BUDGET, &executed)
+    && !guest->console->stopped;
+}
+
+// Everything the test has printed so far.
+static const char* printedOutput()
+{
+  static char output[1 << 16];
+  fflush(stdout);
+  fflush(stderr);
+  FILE* file = fopen(logPath, "r");
+  size_t length = file ? fread(output, 1, sizeof(output) - 1, file) : 0;
+  output[length] = '\0';
+  if (file)
+  {
+    fclose(file);
+  }
+  return output;
+}
+
+static void testPath(char* path, const char* name)
+{
+  snprintf(path, PATH_MAX, "%s/%s", testDirectory, name);
+}
+
+// Connects to the Unix domain socket at `path`, waiting for it to appear.
+static int connectTo(const char* path)
+{
+  struct sockaddr_un address = { .sun_family = AF_UNIX };
+  snprintf(address.sun_path, sizeof(address.sun_path), "%s", path);
+  for (int attempt = 0; attempt < 500; attempt++)
+  {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connect(fd, (struct sockaddr*)&address, sizeof(address)) == 0)
+    {
+      return fd;
+    }
+    close(fd);
+    usleep(10000);
+  }
+  return -1;
+}
+
+// Reads from `fd` until the other end closes it.
+static size_t readAll(int fd, char* buffer, size_t size)
+{
+  size_t length = 0;
+  ssize_t received;
+  while (length < size - 1
+         && (received = read(fd, buffer + length, size - 1 - length)) > 0)
+  {
+    length += received;
+  }
+  buffer[length] = '\0';
+  return length;
+}
+
+// Runs `child` in a process of its own, e.g. a server for the test to talk
+// to. The child's exit status is what `child` returns.
+static pid_t forkChild(int (*child)())
+{
+  fflush(stdout);
+  fflush(stderr);
+  pid_t pid = fork();
+  if (pid == 0)
+  {
+    exit(child());
+  }
+  return pid;
+}
+
+static int childStatus(pid_t pid)
+{
+  int status;
+  if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status))
+  {
+    return -1;
+  }
+  return WEXITSTATUS(status);
+}
+
+/*
+ * [user-026] The idiom recogniser finds each kind of loop, and nothing that
+ * only looks like one.
+ */
+static int testIdiomMatchers()
+{
+  struct Guest* guest = loadGuest("loops");
+  CHECK(matchIdiom(guest, LOOPS_MUL) == IDIOM_MULTIPLY);
+  CHECK(matchIdiom(guest, LOOPS_SHIFT) == IDIOM_SHIFT);
+  CHECK(matchIdiom(guest, LOOPS_COPYING) == IDIOM_COPY);
+  CHECK(matchIdiom(guest, PC_START) == IDIOM_NONE);
+  CHECK(matchIdiom(guest, LOOPS_MUL + 1) == IDIOM_NONE);
+
+  // Counting down in twos isn't a multiply any more.
+  guest->mem[LOOPS_MUL + 1] = 0x14BE;   // ADD R2, R2, #-2
+  CHECK(matchIdiom(guest, LOOPS_MUL) == IDIOM_NONE);
+  // Nor is a copy that loads through the register it stores through.
+  guest->mem[LOOPS_COPYING + 1] = 0x78C0;   // STR R4, R3, #0
+  CHECK(matchIdiom(guest, LOOPS_COPYING) == IDIOM_NONE);
+  return TEST_PASSED;
+}
+
+// [user-026] Native loops leave the guest exactly as interpreting them does.
+static int testIdiomsMatchInterpreter()
+{
+  struct Guest* native = loadGuest("loops");
+  struct Guest* interpreted = loadGuest("loops");
+  interpreted->idioms.enabled = 0;
+  CHECK(runGuest(native, ""));
+  CHECK(runGuest(interpreted, ""));
+
+  CHECK(native->mem[LOOPS_PRODUCT] == 7 * 300);
+  CHECK(native->mem[LOOPS_SHIFTED] == 3 << 9);
+  CHECK(memcmp(native->mem + LOOPS_COPY, native->mem + LOOPS_SOURCE,
+               8 * sizeof(uint16_t)) == 0);
+  CHECK(memcmp(native->mem, interpreted->mem, sizeof(native->mem)) == 0);
+  CHECK(memcmp(native->regs, interpreted->regs, sizeof(native->regs)) == 0);
+  CHECK(native->clock.instructions == interpreted->clock.instructions);
+  for (int idiom = IDIOM_MULTIPLY; idiom < IDIOM_KINDS; idiom++)
+  {
+    CHECK(native->idioms.instructions[idiom] > 0);
+  }
+
+  // A budget is kept exactly, even in the middle of a loop.
+  struct Guest* budgeted = loadGuest("loops");
+  uint64_t executed;
+  CHECK(runInterpreterBudget(budgeted, 100, &executed));
+  CHECK(executed == 100);
+  return TEST_PASSED;
+}
+
+// [user-027] Guests run in lockstep print what they print on their own.
+static int testSpmdLanes()
+{
+  const char* inputs[] = { "abq", "hello, q", "q", "abc" };
+  int laneCount = sizeof(inputs) / sizeof(inputs[0]);
+  struct Guest* guest = loadGuest("echo");
+  struct SpmdGroup* group = createSpmdGroup(guest->mem, laneCount);
+  for (int lane = 0; lane < laneCount; lane++)
+  {
+    setSpmdInput(group, lane, (const uint8_t*)inputs[lane],
+                 strlen(inputs[lane]));
+  }
+  runSpmdGroup(group);
+
+  for (int lane = 0; lane < laneCount; lane++)
+  {
+    struct Guest* alone = loadGuest("echo");
+    runGuest(alone, inputs[lane]);
+    struct SpmdLane* io = &group->lanes[lane];
+    CHECK(io->outputLength == consoleOf(alone)->outputLength);
+    CHECK(memcmp(io->output, consoleOf(alone)->output,
+                 io->outputLength) == 0);
+  }
+  CHECK(group->vectorSteps > 0);
+  freeSpmdGroup(group);
+  return TEST_PASSED;
+}
+
+// [user-028] The simulated caches hit, miss and evict where they should.
+static int testCacheSim()
+{
+  CHECK(!initCacheSim("l1d:300:1:16"));
+  CHECK(!initCacheSim("l3:256:1:16"));
+  // Direct mapped, 16 sets of 16 byte lines, and an L2 with 64 sets.
+  CHECK(initCacheSim("l1d:256:1:16,l2:1024:1:16"));
+  CHECK(cacheData(0x4000) == CACHE_LEVELS);
+  CHECK(cacheData(0x4000) == CACHE_L1D);
+  CHECK(cacheData(0x4007) == CACHE_L1D);
+  // 256 bytes on, the same L1D set but a different L2 set.
+  CHECK(cacheData(0x4080) == CACHE_LEVELS);
+  CHECK(cacheData(0x4000) == CACHE_L2);
+  return TEST_PASSED;
+}
+
+// [user-029] The timing model charges memory and load-use stalls.
+static int testTiming()
+{
+  CHECK(initTiming(NULL));
+  mainGuest.mem[0x3000] = 0x1021;   // ADD R0, R0, #1
+  mainGuest.mem[0x3001] = 0x6200;   // LDR R1, R0, #0
+  mainGuest.mem[0x3002] = 0x1460;   // ADD R2, R1, #0
+  timingFetch(0x3000, -1);
+  timingFetch(0x3001, -1);
+  timingData(ACCESS_READ, -1);
+  timingFetch(0x3002, -1);
+  reportTiming();
+
+  // One cycle each, plus two for the read and one for using it right away.
+  CHECK(strstr(printedOutput(), "3 instructions, 6 cycles"));
+  return TEST_PASSED;
+}
+
+// [user-030] The host counters are charged to the guest's opcodes.
+static int testPerfCounters()
+{
+  if (!initPerfCounters())
+  {
+    return TEST_SKIPPED;
+  }
+  struct Guest* guest = loadMainGuest("loops");
+  startPerfCounters();
+  runInterpreterCounted(guest, METRICS_INTERVAL, NULL);
+  stopPerfCounters();
+  reportPerfCounters();
+
+  CHECK(opcodeCounts[OP_TRAP] == 1);
+  CHECK(strstr(printedOutput(), "Host performance counters"));
+  CHECK(strstr(printedOutput(), "interpreter"));
+  return TEST_PASSED;
+}
+
+static int runEchoServer()
+{
+  char socketPath[PATH_MAX];
+  testPath(socketPath, "server");
+  const char* images[] = { GUESTS "echo.obj", GUESTS "loops.obj" };
+  return !runServer(socketPath, images, 2, 2, 4);
+}
+
+// Sends `request` to the server and reads the whole reply into `reply`.
+static void askServer(const char* request, char* reply, size_t size)
+{
+  char socketPath[PATH_MAX];
+  testPath(socketPath, "server");
+  int fd = connectTo(socketPath);
+  reply[0] = '\0';
+  if (fd >= 0)
+  {
+    write(fd, request, strlen(request));
+    readAll(fd, reply, size);
+    close(fd);
+  }
+}
+
+// [user-031] The job server runs jobs, and a slow client holds nobody up.
+static int testServer()
+{
+  pid_t server = forkChild(runEchoServer);
+  char reply[4096];
+
+  askServer("RUN 0 3 echo.obj\nabq", reply, sizeof(reply));
+  CHECK(strncmp(reply, "OUT ", 4) == 0);
+  CHECK(strstr(reply, "abq"));
+  CHECK(strstr(reply, "END halted "));
+  askServer("RUN 0 2 echo.obj\nab", reply, sizeof(reply));
+  CHECK(strstr(reply, "END input "));
+  askServer("RUN 10 0 loops.obj\n", reply, sizeof(reply));
+  CHECK(strncmp(reply, "END budget 10 ", 14) == 0);
+  askServer("RUN 0 0 missing.obj\n", reply, sizeof(reply));
+  CHECK(strcmp(reply, "ERR unknown image\n") == 0);
+
+  char socketPath[PATH_MAX];
+  testPath(socketPath, "server");
+  int slow = connectTo(socketPath);
+  CHECK(slow >= 0);
+  write(slow, "RUN 0 3 echo", 12);
+  askServer("RUN 0 1 echo.obj\nq", reply, sizeof(reply));
+  CHECK(strstr(reply, "END halted "));
+  write(slow, ".obj\nxyq", 8);
+  readAll(slow, reply, sizeof(reply));
+  CHECK(strstr(reply, "xyq"));
+  close(slow);
+
+  kill(server, SIGTERM);
+  waitpid(server, NULL, 0);
+  return TEST_PASSED;
+}
+
+// [user-032] The metrics segment has the guest's counters, exactly at exit.
+static int testMetrics()
+{
+  struct Guest* exact = loadGuest("loops");
+  CHECK(runGuest(exact, ""));
+
+  char name[64];
+  snprintf(name, sizeof(name), "/lc3-check.%d", (int)getpid());
+  struct Guest* guest = loadMainGuest("loops");
+  CHECK(initMetrics(name));
+  runInterpreterSampled(guest, METRICS_INTERVAL, publishMetrics);
+
+  int fd = shm_open(name, O_RDONLY, 0);
+  CHECK(fd >= 0);
+  const struct Metrics* metrics = mmap(NULL, sizeof(struct Metrics),
+                                       PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  CHECK(metrics != MAP_FAILED);
+  CHECK(metrics->magic == METRICS_MAGIC);
+  CHECK(metrics->version == METRICS_VERSION);
+  CHECK(metrics->pid == getpid());
+  CHECK(metrics->running);
+  CHECK(metrics->instructions == exact->clock.instructions);
+  CHECK(metrics->idiomInstructions > 0);
+  CHECK(metrics->traps[TRAP_HALT] == 1);
+
+  closeMetrics();
+  CHECK(!metrics->running);
+  CHECK(shm_open(name, O_RDONLY, 0) < 0 && errno == ENOENT);
+  return TEST_PASSED;
+}
+
+static int runDebuggee()
+{
+  char socketPath[PATH_MAX];
+  testPath(socketPath, "gdb");
+  struct Guest* guest = loadGuest("loops");
+  if (!startDebugger(guest, socketPath))
+  {
+    return 2;
+  }
+  int halted = runGuest(guest, "");
+  stopDebugger();
+  return halted && guest->mem[LOOPS_PRODUCT] == 7 * 300 ? 0 : 1;
+}
+
+// Sends the packet `data` to the stub, and returns its reply.
+static const char* askStub(int fd, const char* data)
+{
+  static char reply[4096];
+  char packet[4096];
+  uint8_t checksum = 0;
+  for (const char* c = data; *c; c++)
+  {
+    checksum += *c;
+  }
+  int length = snprintf(packet, sizeof(packet), "$%s#%02x", data, checksum);
+  write(fd, packet, length);
+
+  char c;
+  size_t replyLength = 0;
+  while (read(fd, &c, 1) == 1 && c != '$')
+  {
+  }
+  while (read(fd, &c, 1) == 1 && c != '#' && replyLength < sizeof(reply) - 1)
+  {
+    reply[replyLength++] = c;
+  }
+  reply[replyLength] = '\0';
+  char sum[2];
+  read(fd, sum, 2);
+  write(fd, "+", 1);
+  return reply;
+}
+
+/*
+ * [user-033] The GDB stub speaks the remote protocol: registers (with the PC
+ * as a byte address), memory, breakpoints and watchpoints.
+ */
+static int testGdbStub()
+{
+  char socketPath[PATH_MAX];
+  testPath(socketPath, "gdb");
+  pid_t debuggee = forkChild(runDebuggee);
+  int fd = connectTo(socketPath);
+  CHECK(fd >= 0);
+
+  CHECK(strcmp(askStub(fd, "?"), "S05") == 0);
+  // R0 to R7, then the PC at byte address x6000 in 32 bits, then COND.
+  CHECK(strcmp(askStub(fd, "g"), "0000000000000000000000000000000000600000"
+               "0200") == 0);
+  CHECK(strcmp(askStub(fd, "m6000,2"), "2050") == 0);   // AND R0, R0, #0
+  CHECK(strcmp(askStub(fd, "Z0,6014,2"), "OK") == 0);
+  CHECK(strcmp(askStub(fd, "c"), "S05") == 0);
+  CHECK(strcmp(askStub(fd, "p8"), "14600000") == 0);
+  CHECK(strcmp(askStub(fd, "p0"), "3408") == 0);   // 2100
+  CHECK(strcmp(askStub(fd, "z0,6014,2"), "OK") == 0);
+  CHECK(strcmp(askStub(fd, "Z2,6036,2"), "OK") == 0);
+  CHECK(strcmp(askStub(fd, "c"), "T05watch:6036;") == 0);
+  CHECK(strcmp(askStub(fd, "P0=0100"), "OK") == 0);
+  CHECK(strcmp(askStub(fd, "p0"), "0100") == 0);
+  CHECK(strcmp(askStub(fd, "D"), "OK") == 0);
+  close(fd);
+  CHECK(childStatus(debuggee) == 0);
+  return TEST_PASSED;
+}
+
+/*
+ * [user-033] A connection that ends part way through a packet's checksum is
+ * GDB going away, and the guest carries on alone, rather than the packet
+ * being acted on, even once acknowledgements are off.
+ */
+static int testGdbHangUp()
+{
+  char socketPath[PATH_MAX];
+  testPath(socketPath, "gdb");
+  pid_t debuggee = forkChild(runDebuggee);
+  int fd = connectTo(socketPath);
+  CHECK(fd >= 0);
+
+  CHECK(strcmp(askStub(fd, "QStartNoAckMode"), "OK") == 0);
+  // "k" would kill the guest before it ran.
+  const char* cutOff = "$k#6";
+  CHECK(write(fd, cutOff, strlen(cutOff)) == (ssize_t)strlen(cutOff));
+  close(fd);
+  CHECK(childStatus(debuggee) == 0);
+  return TEST_PASSED;
+}
+
+// [user-034] The faster engines agree with the interpreter.
+static int testValidateIdioms()
+{
+  loadMainGuest("loops");
+  CHECK(runValidation("idioms", NULL, 0));
+  CHECK(strstr(printedOutput(), "idioms matched the reference"));
+  return TEST_PASSED;
+}
+
+static int testValidateSpmd()
+{
+  char inputPath[PATH_MAX];
+  testPath(inputPath, "input");
+  FILE* input = fopen(inputPath, "w");
+  fputs("hello, q", input);
+  fclose(input);
+
+  loadMainGuest("echo");
+  CHECK(runValidation("spmd", inputPath, 0));
+  CHECK(strstr(printedOutput(), "spmd matched the reference"));
+  // A whole group runs, so it has to have run the vector path too.
+  const char* lanes = strstr(printedOutput(), "All ");
+  int laneCount = 0;
+  unsigned long long vectorSteps = 0;
+  CHECK(lanes && sscanf(lanes, "All %d lanes matched, %llu steps", &laneCount,
+                        &vectorSteps) == 2);
+  CHECK(laneCount == SPMD_LANES);
+  CHECK(vectorSteps > 0);
+  CHECK(!runValidation("native", NULL, 0));
+  return TEST_PASSED;
+}
+
+/*
+ * [user-034] Native loops count towards the clock of both engines, so
+ * guests that read the clock or arm the timer validate too. Host time would
+ * differ between them, so validation runs on the virtual clock.
+ */
+static int testValidateClock()
+{
+  clockRate = 0;
+  loadMainGuest("stopwatch");
+  CHECK(runValidation("idioms", NULL, 1));
+  CHECK(clockRate == CLOCK_DEFAULT_RATE);
+
+  // A millisecond per instruction, so that the clock shows every one.
+  clockRate = 1;
+  loadMainGuest("stopwatch");
+  CHECK(runValidation("idioms", NULL, 1));
+  CHECK(mainGuest.mem[STOPWATCH_ELAPSED] > 900);
+  return TEST_PASSED;
+}
+
+/*
+ * [user-035] Snapshots share unchanged pages, only look at the pages they
+ * are told were written, and are compared by content.
+ */
+static int testSnapshots()
+{
+  struct Guest* guest = loadGuest("count");
+  struct Snapshot* base = takeSnapshot(guest, NULL, ~0u);
+  guest->mem[COUNT_COUNT] = 5;
+  guest->regs[R_0] = 'a';
+  uint32_t written = 1u << (COUNT_COUNT / WATCH_PAGE_WORDS);
+  struct Snapshot* changed = takeSnapshot(guest, base, written);
+  int page = COUNT_COUNT / SNAPSHOT_PAGE_WORDS;
+  CHECK(changed->pages[0] == base->pages[0]);
+  CHECK(changed->pages[page] != base->pages[page]);
+  CHECK(changed->pages[page]->words[COUNT_COUNT % SNAPSHOT_PAGE_WORDS] == 5);
+  CHECK(!sameSnapshot(base, changed));
+
+  // Pages outside the written ones are taken to be unchanged.
+  guest->mem[0x8000] = 1;
+  struct Snapshot* trusted = takeSnapshot(guest, changed, 0);
+  CHECK(trusted->pages[0x8000 / SNAPSHOT_PAGE_WORDS]->words[0] == 0);
+  freeSnapshot(trusted);
+  guest->mem[0x8000] = 0;
+
+  restoreSnapshot(guest, base, changed, 0);
+  CHECK(guest->mem[COUNT_COUNT] == 0);
+  CHECK(guest->regs[R_0] == 0);
+  struct Snapshot* again = takeSnapshot(guest, changed, ~0u);
+  CHECK(again->hash == base->hash);
+  CHECK(sameSnapshot(again, base));
+  CHECK(again->pages[page] != base->pages[page]);
+  freeSnapshot(again);
+  freeSnapshot(changed);
+  freeSnapshot(base);
+  return TEST_PASSED;
+}
+
+// [user-035] The search finds the best inputs and drops repeated states.
+static int testExplore()
+{
+  loadMainGuest("count");
+  struct ExploreOptions options = { "a,b", NULL, 3, 16, 2 };
+  CHECK(runExploration(&options));
+  // b leaves the guest as it was, and a then b ends up where b then a does.
+  CHECK(strstr(printedOutput(), "Depth 2: 2 new states, 2 duplicates"));
+  // With no score, the first of the deepest states wins.
+  CHECK(strstr(printedOutput(), "Best score 0 after 3 inputs: a,a,a"));
+
+  CHECK(!parseExploreScore("average:x3009", &options));
+  CHECK(parseExploreScore("sum:x3009", &options));
+  CHECK(runExploration(&options));
+  CHECK(strstr(printedOutput(), "Best score 3 after 3 inputs: a,a,a"));
+  return TEST_PASSED;
+}
+
+// [user-036] Compressed containers and LZ4 blocks read back what was written.
+static int testContainer()
+{
+  uint8_t data[8192];
+  uint8_t compressed[LZ4_BOUND(sizeof(data))];
+  uint8_t decompressed[sizeof(data)];
+  for (size_t idx = 0; idx < sizeof(data); idx++)
+  {
+    data[idx] = idx < sizeof(data) / 2 ? idx % 7 : rand();
+  }
+  size_t size = lz4Compress(data, sizeof(data), compressed,
+                            sizeof(compressed));
+  CHECK(size > 0 && size < sizeof(data) * 3 / 4);
+  CHECK(lz4Decompress(compressed, size, decompressed, sizeof(data)));
+  CHECK(memcmp(data, decompressed, sizeof(data)) == 0);
+  CHECK(!lz4Decompress(compressed, size - 1, decompressed, sizeof(data)));
+
+  uint16_t code[1000];
+  uint16_t table[50];
+  for (int idx = 0; idx < 1000; idx++)
+  {
+    code[idx] = 0x1021;
+  }
+  for (int idx = 0; idx < 50; idx++)
+  {
+    table[idx] = rand();
+  }
+  struct ImageSegment segments[] = { { 0x3000, 1000, code },
+                                     { 0x5000, 50, table } };
+  struct ImageSymbol symbols[] = { { 0x3000, "START" }, { 0x5000, "TABLE" } };
+  struct Image image = { segments, 2, 1, 0x3000, symbols, 2 };
+
+  FILE* file = tmpfile();
+  CHECK(writeContainer(file, &image, 1));
+  uint8_t container[8192];
+  size_t containerSize = ftell(file);
+  rewind(file);
+  CHECK(fread(container, 1, sizeof(container), file) == containerSize);
+  fclose(file);
+  CHECK(isContainer(container, containerSize));
+  CHECK(containerSize < sizeof(code) / 2);
+
+  struct Image read;
+  CHECK(readContainer(container, containerSize, &read, NULL) == NULL);
+  CHECK(read.hasEntry && read.entry == 0x3000);
+  CHECK(read.segmentCount == 2 && read.symbolCount == 2);
+  for (int idx = 0; idx < 2; idx++)
+  {
+    CHECK(read.segments[idx].origin == segments[idx].origin);
+    CHECK(read.segments[idx].length == segments[idx].length);
+    CHECK(memcmp(read.segments[idx].words, segments[idx].words,
+                 segments[idx].length * sizeof(uint16_t)) == 0);
+    CHECK(read.symbols[idx].address == symbols[idx].address);
+    CHECK(strcmp(read.symbols[idx].name, symbols[idx].name) == 0);
+  }
+  freeImage(&read);
+
+  container[containerSize - 1] ^= 1;
+  CHECK(readContainer(container, containerSize, &read, NULL) != NULL);
+  freeImage(&read);
+  return TEST_PASSED;
+}
+
+static int countEdges()
+{
+  int edges = 0;
+  for (int idx = 0; idx < FUZZ_EDGES; idx++)
+  {
+    edges += fuzzEdges[idx] != 0;
+  }
+  return edges;
+}
+
+// [user-037] Every input starts from the same state, and coverage follows
+// the guest's branches.
+static int testFuzz()
+{
+  const char* images[] = { GUESTS "count.obj" };
+  CHECK(startFuzzing(images, 1, FUZZ_DEFAULT_BUDGET));
+  CHECK(runFuzzInput((const uint8_t*)"aab", 3) == STOP_INPUT);
+  CHECK(mainGuest.mem[COUNT_COUNT] == 2);
+  CHECK(runFuzzInput((const uint8_t*)"a", 1) == STOP_INPUT);
+  CHECK(mainGuest.mem[COUNT_COUNT] == 1);
+
+  memset(fuzzEdges, 0, sizeof(fuzzEdges));
+  runFuzzInput((const uint8_t*)"b", 1);
+  int ignored = countEdges();
+  memset(fuzzEdges, 0, sizeof(fuzzEdges));
+  runFuzzInput((const uint8_t*)"a", 1);
+  int counted = countEdges();
+  CHECK(ignored > 0);
+  CHECK(counted > ignored);
+  return TEST_PASSED;
+}
+
+static sigjmp_buf faultReturn;
+static volatile sig_atomic_t faultsCaught;
+
+static void catchFault(int signal, siginfo_t* info, void* context)
+{
+  faultsCaught++;
+  siglongjmp(faultReturn, 1);
+}
+
+/*
+ * [user-037] A fault in the VM itself, rather than a store to a watched page
+ * of guest memory, goes to the SIGSEGV handler that was there before the
+ * guest was watched (under libFuzzer, the one that reports the crash).
+ */
+static int testFuzzFaults()
+{
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_sigaction = catchFault;
+  action.sa_flags = SA_SIGINFO;
+  sigaction(SIGSEGV, &action, NULL);
+
+  const char* images[] = { GUESTS "count.obj" };
+  CHECK(startFuzzing(images, 1, FUZZ_DEFAULT_BUDGET));
+  CHECK(runFuzzInput((const uint8_t*)"aab", 3) == STOP_INPUT);
+  CHECK(faultsCaught == 0);
+
+  volatile uint16_t* readOnly = mmap(NULL, WATCH_PAGE_WORDS * 2, PROT_READ,
+                                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  CHECK(readOnly != MAP_FAILED);
+  if (!sigsetjmp(faultReturn, 1))
+  {
+    readOnly[0] = 1;
+  }
+  CHECK(faultsCaught == 1);
+
+  // The guest's own stores are still caught and put back between inputs.
+  CHECK(runFuzzInput((const uint8_t*)"a", 1) == STOP_INPUT);
+  CHECK(mainGuest.mem[COUNT_COUNT] == 1);
+  CHECK(faultsCaught == 1);
+  return TEST_PASSED;
+}
+
+// [user-038] A headless guest waiting on its timer or clock is moved on to
+// the deadline rather than running the wait.
+static int testClockWarp()
+{
+  clockRate = CLOCK_DEFAULT_RATE;
+  clockWarp = 1;
+  struct Guest* warped = loadGuest("timer");
+  CHECK(runGuest(warped, ""));
+  CHECK(warped->mem[TIMER_NOW] == 20000);
+  CHECK(warped->clock.instructions < 100);
+
+  // Twenty seconds at the default rate are far more than the budget.
+  clockWarp = 0;
+  struct Guest* waiting = loadGuest("timer");
+  CHECK(!runGuest(waiting, ""));
+  CHECK(waiting->clock.warped == 0);
+
+  // A loop that stores between reads of the timer isn't only waiting, so it
+  // runs the whole 10 ms: 1000 instructions at 100 a millisecond, 4 a pass.
+  clockRate = 100;
+  clockWarp = 1;
+  struct Guest* busy = loadGuest("busy");
+  CHECK(runGuest(busy, ""));
+  CHECK(busy->clock.warped == 0);
+  CHECK(busy->mem[BUSY_WORK] >= 240 && busy->mem[BUSY_WORK] <= 260);
+  return TEST_PASSED;
+}
+
+/*
+ * [user-038] Every SPMD lane has a clock and timer of its own, on which it
+ * waits the same way a guest on its own does.
+ */
+static int testSpmdClock()
+{
+  clockRate = CLOCK_DEFAULT_RATE;
+  clockWarp = 1;
+  struct Guest* guest = loadGuest("timer");
+  struct SpmdGroup* group = createSpmdGroup(guest->mem, SPMD_LANES);
+  runSpmdGroup(group);
+  for (int lane = 0; lane < SPMD_LANES; lane++)
+  {
+    CHECK(!group->lanes[lane].error);
+    CHECK(group->mem[TIMER_NOW * SPMD_LANES + lane] == 20000);
+    CHECK(group->lanes[lane].clock.warped > 0);
+  }
+  CHECK(group->retired < 100 * SPMD_LANES);
+  freeSpmdGroup(group);
+
+  // The clock counts every instruction, so it has to agree with the
+  // interpreter's to the instruction.
+  clockRate = 1;
+  clockWarp = 0;
+  loadMainGuest("stopwatch");
+  CHECK(runValidation("spmd", NULL, 1));
+  return TEST_PASSED;
+}
+
+/*
+ * [user-039] Writes to watched pages are caught, so remembered loops are
+ * forgotten when the guest writes over them.
+ */
+static int testCodeWatch()
+{
+  struct Guest* guest = loadGuest("smc");
+  cacheIdioms(guest);
+  CHECK(guest->idioms.known);
+  CHECK(runGuest(guest, ""));
+  CHECK(guest->mem[SMC_FIRST] == 7 * 300);
+  CHECK(guest->mem[SMC_SECOND] == 7 * 150);
+  CHECK(guest->idioms.instructions[IDIOM_MULTIPLY] > 0);
+  // The store to SECOND may have made it forget the loop again since.
+  CHECK(guest->idioms.known[SMC_MUL] != IDIOM_MULTIPLY + 1);
+
+  CHECK(watchAllPages());
+  takeDirtyPages();
+  guest->mem[0x4000] = 1;
+  guest->mem[0x4001] = 2;
+  CHECK(takeDirtyPages() == 1u << (0x4000 / WATCH_PAGE_WORDS));
+  CHECK(takeDirtyPages() == 0);
+  stopWatching();
+  return TEST_PASSED;
+}
+
+// Opens the one cache file in `directory`, putting its path in `path`.
+static int openAnalysis(const char* directory, char* path)
+{
+  DIR* dir = opendir(directory);
+  struct dirent* entry;
+  while (dir && (entry = readdir(dir)))
+  {
+    if (strstr(entry->d_name, ANALYSIS_EXTENSION))
+    {
+      snprintf(path, PATH_MAX, "%s/%s", directory, entry->d_name);
+      closedir(dir);
+      return open(path, O_RDWR);
+    }
+  }
+  if (dir)
+  {
+    closedir(dir);
+  }
+  return -1;
+}
+
+// Where the bit for `head` is in a cache file.
+static off_t reachedWord(uint16_t head)
+{
+  return offsetof(struct Analysis, reachedHeads) + head / 64 * 8;
+}
+
+// Reads whether `head` is marked as reached in the cache file `fd`.
+static int reachedHead(int fd, uint16_t head)
+{
+  uint64_t word = 0;
+  pread(fd, &word, sizeof(word), reachedWord(head));
+  return (word >> (head % 64)) & 1;
+}
+
+/*
+ * [user-040] The loops one run reached are remembered from the start of the
+ * next, a stray mark only makes the VM look at an address early, and a cache
+ * file for some other image is replaced.
+ */
+static int testAnalysisCache()
+{
+  char directory[PATH_MAX];
+  char path[PATH_MAX];
+  testPath(directory, "cache");
+
+  struct Guest* first = loadGuest("loops");
+  cacheIdioms(first);
+  CHECK(loadAnalysis(first, directory));
+  CHECK(!first->idioms.known[LOOPS_MUL]);
+  CHECK(runGuest(first, ""));
+  stopWatching();
+
+  int fd = openAnalysis(directory, path);
+  CHECK(fd >= 0);
+  CHECK(reachedHead(fd, LOOPS_MUL) && reachedHead(fd, LOOPS_COPYING));
+  CHECK(!reachedHead(fd, PC_START));
+  uint64_t word = 0;
+  pread(fd, &word, sizeof(word), reachedWord(PC_START));
+  word |= 1ULL << (PC_START % 64);
+  CHECK(pwrite(fd, &word, sizeof(word), reachedWord(PC_START))
+        == sizeof(word));
+
+  struct Guest* second = loadGuest("loops");
+  cacheIdioms(second);
+  CHECK(loadAnalysis(second, directory));
+  CHECK(second->idioms.known[LOOPS_MUL] == IDIOM_MULTIPLY + 1);
+  CHECK(second->idioms.known[LOOPS_COPYING] == IDIOM_COPY + 1);
+  CHECK(second->idioms.known[PC_START] == IDIOM_NONE + 1);
+  CHECK(runGuest(second, ""));
+  CHECK(second->mem[LOOPS_PRODUCT] == 7 * 300);
+  stopWatching();
+
+  uint64_t otherImage = 0;
+  CHECK(pwrite(fd, &otherImage, sizeof(otherImage),
+               offsetof(struct Analysis, imageHash)) == sizeof(otherImage));
+  close(fd);
+
+  struct Guest* third = loadGuest("loops");
+  cacheIdioms(third);
+  CHECK(loadAnalysis(third, directory));
+  CHECK(!third->idioms.known[LOOPS_MUL]);
+  fd = openAnalysis(directory, path);
+  CHECK(fd >= 0 && !reachedHead(fd, LOOPS_MUL));
+  close(fd);
+  return TEST_PASSED;
+}
+
+struct Test
+{
+  const char* name;
+  int (*run)();
+};
+
+// In the order the parts they test were added.
+static const struct Test TESTS[] = {
+  { "idiom-matchers", testIdiomMatchers },
+  { "idiom-results", testIdiomsMatchInterpreter },
+  { "spmd", testSpmdLanes },
+  { "cache-sim", testCacheSim },
+  { "timing", testTiming },
+  { "perf-counters", testPerfCounters },
+  { "server", testServer },
+  { "metrics", testMetrics },
+  { "gdb-stub", testGdbStub },
+  { "gdb-hang-up", testGdbHangUp },
+  { "validate-idioms", testValidateIdioms },
+  { "validate-spmd", testValidateSpmd },
+  { "validate-clock", testValidateClock },
+  { "snapshots", testSnapshots },
+  { "explore", testExplore },
+  { "container", testContainer },
+  { "fuzz", testFuzz },
+  { "fuzz-faults", testFuzzFaults },
+  { "clock-warp", testClockWarp },
+  { "spmd-clock", testSpmdClock },
+  { "code-watch", testCodeWatch },
+  { "analysis-cache", testAnalysisCache },
+};
+
+static int removeEntry(const char* path, const struct stat* info, int flag,
+                       struct FTW* ftw)
+{
+  return remove(path);
+}
+
+static int selected(const char* name, int argc, const char* argv[])
+{
+  for (int idx = 1; idx < argc; idx++)
+  {
+    if (strncmp(name, argv[idx], strlen(argv[idx])) == 0)
+    {
+      return 1;
+    }
+  }
+  return argc < 2;
+}
+
+// Runs `test` in a process of its own. Returns what it came to.
+static int runTest(const struct Test* test, const char* root)
+{
+  snprintf(testDirectory, sizeof(testDirectory), "%s/%s", root, test->name);
+  snprintf(logPath, sizeof(logPath), "%s.log", testDirectory);
+  mkdir(testDirectory, 0700);
+  int log = open(logPath, O_CREAT | O_TRUNC | O_WRONLY, 0600);
+
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0)
+  {
+    setpgid(0, 0);
+    dup2(log, STDOUT_FILENO);
+    dup2(log, STDERR_FILENO);
+    alarm(TEST_TIMEOUT);
+    exit(test->run());
+  }
+  close(log);
+  int status = childStatus(pid);
+  // Servers and debuggees the test started don't outlive it.
+  kill(-pid, SIGKILL);
+
+  if (status == TEST_PASSED || status == TEST_SKIPPED)
+  {
+    printf("%-4s %s\n", status == TEST_PASSED ? "ok" : "skip", test->name);
+    return status;
+  }
+  printf("FAIL %s%s\n", test->name, status < 0 ? " (crashed or hung)" : "");
+  FILE* file = fopen(logPath, "r");
+  char line[512];
+  while (file && fgets(line, sizeof(line), file))
+  {
+    printf("     %s", line);
+  }
+  if (file)
+  {
+    fclose(file);
+  }
+  return TEST_FAILED;
+}
+
+int main(int argc, const char* argv[])
+{
+  char root[] = "/tmp/lc3-check.XXXXXX";
+  if (!mkdtemp(root))
+  {
+    fprintf(stderr, "Failed to make a directory for the tests: %s\n",
+            strerror(errno));
+    return 1;
+  }
+
+  int testCount = sizeof(TESTS) / sizeof(TESTS[0]);
+  int failed = 0, passed = 0, skipped = 0;
+  for (int idx = 0; idx < testCount; idx++)
+  {
+    if (!selected(TESTS[idx].name, argc, argv))
+    {
+      continue;
+    }
+    switch (runTest(&TESTS[idx], root))
+    {
+      case TEST_PASSED:
+        passed++;
+        break;
+      case TEST_SKIPPED:
+        skipped++;
+        break;
+      default:
+        failed++;
+        break;
+    }
+  }
+
+  nftw(root, removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+  printf("%d passed, %d failed, %d skipped\n", passed, failed, skipped);
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,15 @@
+; Arms the timer for 10 ms and counts in WORK until it goes off, storing the
+; count on every pass, so it is never just waiting (see clock.c).
+        .ORIG x3000
+        AND R3, R3, #0
+        LD R0, DELAY
+        STI R0, TIMER
+AGAIN   ADD R3, R3, #1
+        ST R3, WORK
+        LDI R1, TIMER
+        BRzp AGAIN
+        HALT
+DELAY   .FILL #10
+TIMER   .FILL xFE0A
+WORK    .BLKW 1
+        .END
@@ -0,0 +1,13 @@
+; Counts the a keys it is given in COUNT, and ignores any other key.
+        .ORIG x3000
+LOOP    GETC
+        LD R1, NEGA
+        ADD R1, R0, R1
+        BRnp LOOP
+        LD R2, COUNT
+        ADD R2, R2, #1
+        ST R2, COUNT
+        BRnzp LOOP
+NEGA    .FILL #-97              ; 'a'
+COUNT   .FILL #0
+        .END
@@ -0,0 +1,10 @@
+; Prints every key it is given, until it is given a q.
+        .ORIG x3000
+LOOP    GETC
+        OUT
+        LD R1, NEGQ
+        ADD R1, R0, R1
+        BRnp LOOP
+        HALT
+NEGQ    .FILL #-113             ; 'q'
+        .END
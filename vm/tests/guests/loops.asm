@@ -0,0 +1,41 @@
+; Runs a loop of each kind the idiom recogniser knows (see idiom.c) and
+; leaves what they worked out in memory.
+        .ORIG x3000
+        AND R0, R0, #0          ; PRODUCT = 7 * 300
+        LD R2, TIMES
+MUL     ADD R0, R0, #7
+        ADD R2, R2, #-1
+        BRp MUL
+        ST R0, PRODUCT
+        AND R1, R1, #0          ; SHIFTED = 3 << 9
+        ADD R1, R1, #3
+        AND R2, R2, #0
+        ADD R2, R2, #9
+SHIFT   ADD R1, R1, R1
+        ADD R2, R2, #-1
+        BRp SHIFT
+        ST R1, SHIFTED
+        LEA R3, SOURCE          ; COPY = SOURCE
+        LEA R4, COPY
+        AND R5, R5, #0
+        ADD R5, R5, #8
+COPYING LDR R6, R3, #0
+        STR R6, R4, #0
+        ADD R3, R3, #1
+        ADD R4, R4, #1
+        ADD R5, R5, #-1
+        BRp COPYING
+        HALT
+TIMES   .FILL #300
+PRODUCT .BLKW 1
+SHIFTED .BLKW 1
+SOURCE  .FILL #1
+        .FILL #2
+        .FILL #3
+        .FILL #5
+        .FILL #8
+        .FILL #13
+        .FILL #21
+        .FILL #34
+COPY    .BLKW 8
+        .END
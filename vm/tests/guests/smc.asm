@@ -0,0 +1,23 @@
+; Runs a multiply loop, then writes over its count down so that it isn't one
+; any more and runs it again. FIRST ends up 2100 and SECOND 1050.
+        .ORIG x3000
+        LD R3, STEP
+        AND R4, R4, #0
+        ADD R4, R4, #1
+AGAIN   AND R0, R0, #0
+        LD R2, TIMES
+MUL     ADD R0, R0, #7
+COUNT   ADD R2, R2, #-1
+        BRp MUL
+        ADD R4, R4, #-1
+        BRn DONE
+        ST R0, FIRST
+        ST R3, COUNT
+        BRnzp AGAIN
+DONE    ST R0, SECOND
+        HALT
+STEP    ADD R2, R2, #-2
+TIMES   .FILL #300
+FIRST   .BLKW 1
+SECOND  .BLKW 1
+        .END
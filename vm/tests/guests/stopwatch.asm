@@ -0,0 +1,25 @@
+; Runs a multiply loop (which the idiom recogniser runs natively), then arms
+; the timer and leaves the clock in ELAPSED and the time left on the timer in
+; LEFT (see clock.c).
+        .ORIG x3000
+        AND R0, R0, #0
+        LD R2, TIMES
+MUL     ADD R0, R0, #7
+        ADD R2, R2, #-1
+        BRp MUL
+        ST R0, PRODUCT
+        LD R1, DELAY
+        STI R1, TIMER
+        LDI R1, CLOCK
+        ST R1, ELAPSED
+        LDI R1, TIMER
+        ST R1, LEFT
+        HALT
+TIMES   .FILL #300
+DELAY   .FILL #5000
+TIMER   .FILL xFE0A
+CLOCK   .FILL xFE08
+PRODUCT .BLKW 1
+ELAPSED .BLKW 1
+LEFT    .BLKW 1
+        .END
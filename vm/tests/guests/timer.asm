@@ -0,0 +1,21 @@
+; Waits 10 s for the timer, then arms it again and waits on the clock until
+; it reaches 20 s, which it leaves in NOW (see clock.c).
+        .ORIG x3000
+        LD R0, DELAY
+        STI R0, TIMER
+WAIT    LDI R1, TIMER
+        BRzp WAIT
+        STI R0, TIMER
+        LD R2, NEGEND
+TICK    LDI R1, CLOCK
+        ADD R1, R1, R2
+        BRn TICK
+        LDI R1, CLOCK
+        ST R1, NOW
+        HALT
+DELAY   .FILL #10000
+NEGEND  .FILL #-20000
+TIMER   .FILL xFE0A
+CLOCK   .FILL xFE08
+NOW     .BLKW 1
+        .END
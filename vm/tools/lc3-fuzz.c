@@ -0,0 +1,166 @@
+/*
+ * A libFuzzer target that fuzzes the keyboard input of a guest (see fuzz.c).
+ *
+ * Usage: lc3-fuzz --image=game.obj [--image=data.obj] [--budget=n]
+ *                 [libFuzzer flags] [corpus dir]...
+ *
+ * libFuzzer ignores flags starting with `--`, so the images and the budget
+ * are given that way (or the image with LC3_FUZZ_IMAGE). An input that makes
+ * the guest execute an invalid opcode is a crash.
+ *
+ * Built with -DLC3_LIBFUZZER and -fsanitize=fuzzer this is a libFuzzer
+ * binary. Otherwise it has a main of its own that runs the files it is given
+ * as inputs, `-runs=n` times each, which is enough to reproduce a crash or
+ * measure how many inputs a second a guest takes.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "architecture.h"
+#include "clock.h"
+#include "fuzz.h"
+
+#define MAX_FUZZ_IMAGES 16
+
+static const char* imagePaths[MAX_FUZZ_IMAGES];
+static int imageCount;
+static uint64_t budget = FUZZ_DEFAULT_BUDGET;
+static int started;
+
+int LLVMFuzzerInitialize(int* argc, char*** argv)
+{
+  for (int idx = 1; idx < *argc; idx++)
+  {
+    const char* arg = (*argv)[idx];
+    if (strncmp(arg, "--image=", 8) == 0 && imageCount < MAX_FUZZ_IMAGES)
+    {
+      imagePaths[imageCount++] = arg + 8;
+    }
+    else if (strncmp(arg, "--budget=", 9) == 0)
+    {
+      budget = strtoull(arg + 9, NULL, 10);
+    }
+  }
+  if (imageCount == 0 && getenv("LC3_FUZZ_IMAGE"))
+  {
+    imagePaths[imageCount++] = getenv("LC3_FUZZ_IMAGE");
+  }
+  if (imageCount == 0)
+  {
+    fprintf(stderr, "lc3-fuzz: give the image to fuzz with --image=path\n");
+    exit(2);
+  }
+  // Nobody watches a guest being fuzzed, and an input has to do the same
+  // thing every time it is run, so the guest gets a virtual clock.
+  clockRate = CLOCK_DEFAULT_RATE;
+  clockWarp = 1;
+  return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+  // The guest is only started with the first input, once libFuzzer has
+  // installed its signal handlers. Watching the guest's memory installs a
+  // SIGSEGV handler too (see codewatch.c), and libFuzzer passes every fault
+  // to a handler that was there before its own rather than report it, so
+  // ours has to come second and pass the faults that aren't ours to it.
+  if (!started)
+  {
+    if (!startFuzzing(imagePaths, imageCount, budget))
+    {
+      exit(2);
+    }
+    started = 1;
+  }
+  if (runFuzzInput(data, size) == STOP_INVALID_OPCODE)
+  {
+    fprintf(stderr, "lc3-fuzz: the guest executed an invalid opcode at "
+            "x%04X\n", (uint16_t)(mainGuest.regs[R_PC] - 1));
+    abort();
+  }
+  return 0;
+}
+
+#ifndef LC3_LIBFUZZER
+
+static uint8_t* readInput(const char* path, size_t* size)
+{
+  FILE* file = fopen(path, "rb");
+  if (!file)
+  {
+    return NULL;
+  }
+  size_t capacity = 4096;
+  uint8_t* data = malloc(capacity);
+  *size = 0;
+  size_t got;
+  while ((got = fread(data + *size, 1, capacity - *size, file)) > 0)
+  {
+    *size += got;
+    if (*size == capacity)
+    {
+      capacity *= 2;
+      data = realloc(data, capacity);
+    }
+  }
+  fclose(file);
+  return data;
+}
+
+static int edgesHit()
+{
+  int hit = 0;
+  for (int idx = 0; idx < FUZZ_EDGES; idx++)
+  {
+    hit += fuzzEdges[idx] != 0;
+  }
+  return hit;
+}
+
+int main(int argc, char* argv[])
+{
+  LLVMFuzzerInitialize(&argc, &argv);
+
+  long runs = 1;
+  uint64_t executions = 0;
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int idx = 1; idx < argc; idx++)
+  {
+    if (strncmp(argv[idx], "-runs=", 6) == 0)
+    {
+      runs = strtol(argv[idx] + 6, NULL, 10);
+    }
+    if (argv[idx][0] == '-')
+    {
+      continue;
+    }
+
+    size_t size;
+    uint8_t* data = readInput(argv[idx], &size);
+    if (!data)
+    {
+      fprintf(stderr, "Failed to read input: %s\n", argv[idx]);
+      return 1;
+    }
+    for (long run = 0; run < runs; run++)
+    {
+      LLVMFuzzerTestOneInput(data, size);
+    }
+    executions += runs;
+    printf("%s: %zu bytes, %d edges\n", argv[idx], size, edgesHit());
+    free(data);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  double seconds = (end.tv_sec - start.tv_sec)
+    + (end.tv_nsec - start.tv_nsec) / 1e9;
+  printf("%llu executions in %.2f s (%.0f/s)\n",
+         (unsigned long long)executions, seconds,
+         seconds > 0 ? executions / seconds : 0);
+  return 0;
+}
+
+#endif
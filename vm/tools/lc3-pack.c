@@ -0,0 +1,238 @@
+/*
+ * Packs LC-3 object files into a container image (see container.h), which
+ * the VM can load wherever it takes an object file.
+ *
+ * Usage: lc3-pack [--lz4] [--entry=address] -o out.lc3c in.obj...
+ *        lc3-pack --list in.lc3c
+ *
+ * Every object file becomes a segment. The symbols come from the symbol
+ * table lc3as writes next to each object file (e.g. game.sym for game.obj)
+ * if there is one. Without --entry the container has no entry point and the
+ * program counter starts at x3000 as usual.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "container.h"
+
+#define MEMORY_WORDS (1 << 16)
+
+static void usage()
+{
+  fprintf(stderr,
+          "usage: lc3-pack [--lz4] [--entry=address] -o out.lc3c in.obj...\n"
+          "       lc3-pack --list in.lc3c\n");
+}
+
+/*
+ * Adds the symbols in the lc3as symbol table at `path` to `image`, e.g.
+ *
+ *   //	Symbol Name       Page Address
+ *   //	----------------  ------------
+ *   //	LOOP              3004
+ *
+ * Lines that don't name a symbol are skipped.
+ */
+static void readSymbols(const char* path, struct Image* image)
+{
+  FILE* file = fopen(path, "r");
+  if (!file)
+  {
+    return;
+  }
+
+  char line[256];
+  char name[128];
+  unsigned address;
+  while (fgets(line, sizeof(line), file))
+  {
+    if (sscanf(line, "//%127s %x", name, &address) != 2 || address > 0xFFFF)
+    {
+      continue;
+    }
+    image->symbols = realloc(image->symbols, (image->symbolCount + 1)
+                             * sizeof(struct ImageSymbol));
+    image->symbols[image->symbolCount].address = address;
+    image->symbols[image->symbolCount].name = strdup(name);
+    image->symbolCount++;
+  }
+  fclose(file);
+}
+
+// Reads the object file at `path` as another segment of `image`, along with
+// its symbols.
+static int readObject(const char* path, struct Image* image)
+{
+  FILE* file = fopen(path, "rb");
+  if (!file)
+  {
+    return 0;
+  }
+  uint16_t origin;
+  if (fread(&origin, sizeof(origin), 1, file) != 1)
+  {
+    fclose(file);
+    return 0;
+  }
+
+  image->segments = realloc(image->segments, (image->segmentCount + 1)
+                            * sizeof(struct ImageSegment));
+  struct ImageSegment* segment = &image->segments[image->segmentCount++];
+  segment->origin = swap16(origin);
+  segment->words = malloc((MEMORY_WORDS - segment->origin)
+                          * sizeof(uint16_t));
+  segment->length = fread(segment->words, sizeof(uint16_t),
+                          MEMORY_WORDS - segment->origin, file);
+  fclose(file);
+  for (uint32_t idx = 0; idx < segment->length; idx++)
+  {
+    segment->words[idx] = swap16(segment->words[idx]);
+  }
+
+  char symbolPath[4096];
+  const char* extension = strrchr(path, '.');
+  int stem = extension ? extension - path : (int)strlen(path);
+  snprintf(symbolPath, sizeof(symbolPath), "%.*s.sym", stem, path);
+  readSymbols(symbolPath, image);
+  return 1;
+}
+
+// Warns about segments that would overwrite each other once placed.
+static void checkOverlaps(const struct Image* image)
+{
+  for (int first = 0; first < image->segmentCount; first++)
+  {
+    for (int second = first + 1; second < image->segmentCount; second++)
+    {
+      const struct ImageSegment* a = &image->segments[first];
+      const struct ImageSegment* b = &image->segments[second];
+      if (a->origin < b->origin + b->length
+          && b->origin < a->origin + a->length)
+      {
+        fprintf(stderr, "warning: segments at x%04X and x%04X overlap\n",
+                a->origin, b->origin);
+      }
+    }
+  }
+}
+
+// Prints the segments, symbols and hash of the container at `path`, after
+// checking it the same way the VM does.
+static int listContainer(const char* path)
+{
+  int fd = open(path, O_RDONLY);
+  struct stat info;
+  if (fd < 0 || fstat(fd, &info) != 0 || info.st_size == 0)
+  {
+    fprintf(stderr, "Failed to open container: %s\n", path);
+    return 1;
+  }
+  uint8_t* data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+  {
+    fprintf(stderr, "Failed to map container: %s\n", path);
+    return 1;
+  }
+
+  struct Image image;
+  const char* error = readContainer(data, info.st_size, &image, NULL);
+  if (error)
+  {
+    fprintf(stderr, "%s: %s\n", path, error);
+    freeImage(&image);
+    munmap(data, info.st_size);
+    return 1;
+  }
+
+  struct ContainerHeader header;
+  memcpy(&header, data, sizeof(header));
+  printf("%s: %lld bytes, content hash %016llx\n", path,
+         (long long)info.st_size, (unsigned long long)header.contentHash);
+  if (image.hasEntry)
+  {
+    printf("entry x%04X\n", image.entry);
+  }
+  for (int idx = 0; idx < header.segmentCount; idx++)
+  {
+    struct ContainerSegment segment;
+    memcpy(&segment, data + sizeof(header) + idx * sizeof(segment),
+           sizeof(segment));
+    printf("segment x%04X-x%04X  %6u words  %7u bytes%s  crc %08x\n",
+           segment.origin, segment.origin + segment.length - 1,
+           segment.length, segment.storedSize,
+           segment.flags & SEGMENT_LZ4 ? " lz4" : "    ", segment.checksum);
+  }
+  for (int idx = 0; idx < image.symbolCount; idx++)
+  {
+    printf("x%04X %s\n", image.symbols[idx].address, image.symbols[idx].name);
+  }
+
+  freeImage(&image);
+  munmap(data, info.st_size);
+  return 0;
+}
+
+int main(int argc, const char* argv[])
+{
+  const char* outputPath = NULL;
+  int compress = 0;
+  struct Image image = { 0 };
+
+  for (int idx = 1; idx < argc; idx++)
+  {
+    if (strcmp(argv[idx], "--list") == 0 && idx + 1 < argc)
+    {
+      return listContainer(argv[idx + 1]);
+    }
+    if (strcmp(argv[idx], "--lz4") == 0)
+    {
+      compress = 1;
+    }
+    else if (strncmp(argv[idx], "--entry=", 8) == 0)
+    {
+      const char* address = argv[idx] + 8;
+      image.entry = strtol(address + (*address == 'x'), NULL, 16);
+      image.hasEntry = 1;
+    }
+    else if (strcmp(argv[idx], "-o") == 0 && idx + 1 < argc)
+    {
+      outputPath = argv[++idx];
+    }
+    else if (argv[idx][0] == '-')
+    {
+      usage();
+      return 2;
+    }
+    else if (!readObject(argv[idx], &image))
+    {
+      fprintf(stderr, "Failed to read object file: %s\n", argv[idx]);
+      return 1;
+    }
+  }
+  if (!outputPath || image.segmentCount == 0)
+  {
+    usage();
+    return 2;
+  }
+  checkOverlaps(&image);
+
+  FILE* output = fopen(outputPath, "wb");
+  int written = output && writeContainer(output, &image, compress);
+  if (output && fclose(output) != 0)
+  {
+    written = 0;
+  }
+  freeImage(&image);
+  if (!written)
+  {
+    fprintf(stderr, "Failed to write container: %s\n", outputPath);
+    return 1;
+  }
+  return 0;
+}
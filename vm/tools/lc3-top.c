@@ -0,0 +1,211 @@
+/*
+ * Shows the live counters a running lc3-vm publishes with `--metrics` (see
+ * metrics.c), refreshing once a second.
+ *
+ * Usage: lc3-top [--once] [pid|segment-name]
+ *
+ * Without a pid or name it picks the most recently started VM.
+ */
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "metrics.h"
+
+static const char* OPCODE_NAMES[16] = {
+  "BR", "ADD", "LD", "ST", "JSR", "AND", "LDR", "STR",
+  "RTI", "NOT", "LDI", "STI", "JMP", "RES", "LEA", "TRAP"
+};
+
+static const char* TRAP_NAMES[6] = {
+  "GETC", "OUT", "PUTS", "IN", "PUTSP", "HALT"
+};
+
+static uint64_t nanoseconds()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Finds the segment of the most recently started VM in /dev/shm.
+static int findSegment(char* name, size_t size)
+{
+  DIR* dir = opendir("/dev/shm");
+  if (!dir)
+  {
+    return 0;
+  }
+
+  time_t newest = 0;
+  struct dirent* entry;
+  while ((entry = readdir(dir)))
+  {
+    char path[512];
+    struct stat info;
+    if (strncmp(entry->d_name, METRICS_PREFIX + 1,
+                strlen(METRICS_PREFIX) - 1) != 0)
+    {
+      continue;
+    }
+    snprintf(path, sizeof(path), "/dev/shm/%s", entry->d_name);
+    if (stat(path, &info) == 0 && info.st_mtime >= newest)
+    {
+      newest = info.st_mtime;
+      snprintf(name, size, "/%s", entry->d_name);
+    }
+  }
+  closedir(dir);
+  return newest != 0;
+}
+
+/*
+ * Takes a consistent copy of the segment, trying again while the VM is in
+ * the middle of an update.
+ */
+static void readMetrics(const struct Metrics* shared, struct Metrics* copy)
+{
+  for (;;)
+  {
+    uint32_t before = __atomic_load_n(&shared->sequence, __ATOMIC_ACQUIRE);
+    memcpy(copy, (const void*)shared, sizeof(*copy));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    uint32_t after = __atomic_load_n(&shared->sequence, __ATOMIC_RELAXED);
+    if (before == after && !(before & 1))
+    {
+      return;
+    }
+  }
+}
+
+static void show(const struct Metrics* metrics, const char* name)
+{
+  uint64_t now = nanoseconds();
+  double elapsed = (metrics->updatedNs - metrics->startNs) / 1e9;
+  // An update is due every METRICS_INTERVAL instructions, so a VM that has
+  // gone quiet is waiting for something (most likely input).
+  int stale = metrics->running && now - metrics->updatedNs > 1000000000;
+
+  printf("lc3-vm %d (%s) ", metrics->pid, name);
+  if (!metrics->running)
+  {
+    printf("stopped\n\n");
+  }
+  else if (stale)
+  {
+    printf("waiting for %.1fs\n\n", (now - metrics->updatedNs) / 1e9);
+  }
+  else
+  {
+    printf("running\n\n");
+  }
+  printf("  instructions %16llu   in %.1fs\n",
+         (unsigned long long)metrics->instructions, elapsed);
+  printf("  MIPS         %16.1f   (%.1f on average)\n",
+         stale ? 0.0 : metrics->mips,
+         elapsed > 0 ? metrics->instructions / elapsed / 1e6 : 0.0);
+  printf("  by idioms    %16llu\n",
+         (unsigned long long)metrics->idiomInstructions);
+  printf("  KBSR polls   %16llu\n", (unsigned long long)metrics->kbsrPolls);
+  printf("  output bytes %16llu\n", (unsigned long long)metrics->outputBytes);
+  printf("  input wait   %16.3fs\n", metrics->inputWaitNs / 1e9);
+
+  printf("\n  %-6s %16s %8s\n", "Opcode", "count", "share");
+  uint64_t interpreted = metrics->instructions - metrics->idiomInstructions;
+  for (int opcode = 0; opcode < 16; opcode++)
+  {
+    if (metrics->opcodes[opcode])
+    {
+      printf("  %-6s %16llu %7.2f%%\n", OPCODE_NAMES[opcode],
+             (unsigned long long)metrics->opcodes[opcode],
+             100.0 * metrics->opcodes[opcode] / interpreted);
+    }
+  }
+
+  printf("\n  %-6s %16s\n", "Trap", "count");
+  for (int vector = 0; vector < 256; vector++)
+  {
+    if (!metrics->traps[vector])
+    {
+      continue;
+    }
+    if (vector >= 0x20 && vector <= 0x25)
+    {
+      printf("  %-6s %16llu\n", TRAP_NAMES[vector - 0x20],
+             (unsigned long long)metrics->traps[vector]);
+    }
+    else
+    {
+      printf("  x%02X    %16llu\n", vector,
+             (unsigned long long)metrics->traps[vector]);
+    }
+  }
+}
+
+int main(int argc, const char* argv[])
+{
+  int once = 0;
+  char name[300] = "";
+
+  for (int idx = 1; idx < argc; idx++)
+  {
+    if (strcmp(argv[idx], "--once") == 0)
+    {
+      once = 1;
+    }
+    else if (strspn(argv[idx], "0123456789") == strlen(argv[idx]))
+    {
+      snprintf(name, sizeof(name), METRICS_PREFIX "%s", argv[idx]);
+    }
+    else
+    {
+      snprintf(name, sizeof(name), "%s%s", argv[idx][0] == '/' ? "" : "/",
+               argv[idx]);
+    }
+  }
+  if (!name[0] && !findSegment(name, sizeof(name)))
+  {
+    printf("No running lc3-vm with --metrics found\n");
+    return 1;
+  }
+
+  int fd = shm_open(name, O_RDONLY, 0);
+  if (fd < 0)
+  {
+    printf("Failed to open metrics segment %s\n", name);
+    return 1;
+  }
+  const struct Metrics* shared = mmap(NULL, sizeof(struct Metrics), PROT_READ,
+                                      MAP_SHARED, fd, 0);
+  close(fd);
+  if (shared == MAP_FAILED || shared->magic != METRICS_MAGIC
+      || shared->version != METRICS_VERSION)
+  {
+    printf("%s is not an lc3-vm metrics segment\n", name);
+    return 1;
+  }
+
+  struct Metrics metrics;
+  for (;;)
+  {
+    readMetrics(shared, &metrics);
+    if (!once)
+    {
+      // Clear the screen and go back to the top.
+      printf("\033[H\033[2J");
+    }
+    show(&metrics, name);
+    fflush(stdout);
+    if (once || !metrics.running)
+    {
+      return 0;
+    }
+    sleep(1);
+  }
+}